@@ -20,7 +20,7 @@
  * Description:
  *
  * Library for Waveshare 2.9" e-ink screen using the
- * wiringPi backend.
+ * wiringPi, native Linux spidev/gpiochip or in-memory backend.
  *
  * Plans to include more waveshare displays in the future.
  */
@@ -28,38 +28,255 @@
 #ifndef LIBWSEPD_H
 #define LIBWSEPD_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include "wsepd_path.h"
+#include "wsepd_font.h"
+#include "wsepd_layout.h"
+#include "wsepd_image.h"
+
+struct Transport;
 
 /* Screen display setting constants */
 enum FOREGROUND_COLOUR { BLACK = 0x00, WHITE = 0xFF };
 enum WRITE_MODE { TOGGLEMODE, FGMODE, BGMODE };
+enum REFRESH_MODE { FULL_REFRESH, PARTIAL_REFRESH };
+
+/* Raster operations combining a source bitmap into the canvas,
+   ROP_INVERT copies the inverted source */
+enum EPD_ROP { ROP_COPY, ROP_AND, ROP_OR, ROP_XOR, ROP_INVERT };
+
+/* Polygon fill rules, which pixels of a self intersecting outline are
+   inside */
+enum FILL_RULE { EVEN_ODD_FILL, NON_ZERO_FILL };
+
+/* Conversion of grey levels to black and white pixels: a fixed
+   threshold, an 8x8 ordered (Bayer) dither or Floyd-Steinberg error
+   diffusion */
+enum EPD_DITHER { DITHER_THRESHOLD, DITHER_ORDERED, DITHER_DIFFUSION };
+
+/* Clockwise turn of the canvas on the panel, and flags reflecting the
+   canvas in its own axes or inverting every pixel */
+enum EPD_ROTATION { ROTATE_0, ROTATE_90, ROTATE_180, ROTATE_270 };
+#define EPD_MIRROR_X 0x01
+#define EPD_MIRROR_Y 0x02
+#define EPD_INVERT   0x04
+
+/* Hardware transport backends, RECORD_BACKEND stores SPI traffic in
+   memory and EMULATE_BACKEND interprets it with a software controller,
+   neither needs hardware */
+enum EPD_BACKEND { WIRINGPI_BACKEND, NATIVE_BACKEND, RECORD_BACKEND,
+		   EMULATE_BACKEND };
 
 typedef struct Epd * EPD;
 
+/* Wiring of one panel, EPD_default_config gives the Waveshare HAT */
+struct EPD_CONFIG {
+    enum EPD_BACKEND backend;
+    int channel;		/* SPI channel (chip enable) */
+    uint32_t speed_hz;		/* SPI clock */
+    int rst_pin, dc_pin, cs_pin, busy_pin; /* BCM numbering */
+};
+
+/* Called after an asynchronous refresh, ticket is the newest frame
+   displayed and rc is non-zero if the refresh failed */
+typedef void (*EPD_REFRESH_CB)(EPD Display, unsigned long ticket,
+			       int rc, void *arg);
+
+/* Phases of a refresh timed by EPD_get_stats */
+enum EPD_PHASE { PHASE_RESET, PHASE_INIT, PHASE_UPLOAD, PHASE_BUSY,
+		 PHASE_SETTLE, PHASE_SLEEP, PHASE_REFRESH, EPD_PHASES };
+
+/* Latency histogram bucket k counts times from 2^k up to 2^(k+1)
+   microseconds (bucket 0 from zero) */
+#define EPD_HIST_BUCKETS 32
+
+struct EPD_PHASE_STATS {
+    unsigned long count;
+    uint64_t total_us, min_us, max_us;
+    unsigned long hist[EPD_HIST_BUCKETS];
+};
+
+/* Statistics since creation or EPD_reset_stats */
+struct EPD_STATS {
+    struct EPD_PHASE_STATS phase[EPD_PHASES];
+    uint64_t spi_bytes;
+    uint64_t spi_transfers;
+    uint64_t pixels;		/* Pixels drawn */
+    unsigned long full_refreshes;
+    unsigned long partial_refreshes;
+    unsigned long skipped_refreshes; /* Frame unchanged */
+};
+
+/* Throughput of one panel in a shared bus refresh, times in
+   microseconds */
+struct EPD_PANEL_STATS {
+    size_t bytes;		/* Frame bytes uploaded */
+    uint64_t upload_us;		/* Bus held for setup and upload */
+    uint64_t busy_us;		/* Panel busy applying the frame */
+    uint64_t elapsed_us;	/* From the start until done */
+    double bytes_per_s;		/* Upload throughput */
+};
+
+/* Aggregate throughput of a shared bus refresh */
+struct EPD_BUS_STATS {
+    size_t panels;		/* Panels refreshed */
+    size_t bytes;
+    uint64_t elapsed_us;	/* Until the last panel finished */
+    uint64_t bus_us;		/* Total time spent transmitting */
+    uint64_t busy_us;		/* Longest panel busy time */
+    double bytes_per_s;		/* Bytes over elapsed_us */
+    double panels_per_s;
+};
+
 /* Electrionic Paper Display object */
-EPD EPD_create(size_t width, size_t height);
+EPD EPD_create(size_t width, size_t height); /* Default backend */
+EPD EPD_create_backend(size_t width, size_t height,
+		       enum EPD_BACKEND backend);
+EPD EPD_create_config(size_t width, size_t height,
+		      const struct EPD_CONFIG *Config);
+void EPD_default_config(struct EPD_CONFIG *Config);
+
+/* Logical canvas tiled over cols x rows panels, each configured by
+   configs (row-major). Drawing and refresh work as for one display,
+   the panels are refreshed concurrently. */
+EPD EPD_create_wall(size_t panel_width, size_t panel_height,
+		    size_t cols, size_t rows,
+		    const struct EPD_CONFIG *configs);
+size_t EPD_get_panel_count(EPD Display);
+EPD EPD_get_panel(EPD Display, size_t n);
+
+/* Panels on one SPI bus, full refreshes upload to one panel while
+   the others are busy. panel_stats may be NULL or hold n entries. */
+int EPD_refresh_shared(EPD *Displays, size_t n, struct EPD_BUS_STATS *Stats,
+		       struct EPD_PANEL_STATS *panel_stats);
+void EPD_set_shared_bus(EPD Wall, int shared);
+void EPD_get_bus_stats(EPD Wall, struct EPD_BUS_STATS *Stats);
 void EPD_destroy(EPD Display);
 void EPD_sleep(EPD Display);
 
+/* Power policy, keep the device initialised between refreshes and
+   sleep it once idle for ms (0 sleeps after every refresh) */
+void EPD_set_idle_sleep(EPD Display, unsigned int ms);
+
 /* Get/Set EPD properties */
 void EPD_set_fgcolour(EPD Display, enum FOREGROUND_COLOUR value);
 void EPD_set_write_mode(EPD Display, enum WRITE_MODE value);
+void EPD_set_refresh_mode(EPD Display, enum REFRESH_MODE value);
+void EPD_set_partial_policy(EPD Display, unsigned int full_every,
+			    unsigned int max_area_pct);
 
 enum WRITE_MODE EPD_get_write_mode(EPD Display);
+enum REFRESH_MODE EPD_get_refresh_mode(EPD Display);
 enum FOREGROUND_COLOUR EPD_get_colour(EPD Display);
 int EPD_get_poweron(EPD Display);
-int EPD_get_width(EPD Display);
+long EPD_get_busy_us(EPD Display); /* Panel busy time, last refresh */
+int EPD_get_width(EPD Display);	/* Of the canvas */
 int EPD_get_height(EPD Display);
+int EPD_get_physical_width(EPD Display); /* Of the panel, unturned */
+int EPD_get_physical_height(EPD Display);
+
+/* Draw on a canvas turned and reflected on the panel, the front
+   buffer is transformed as it is transmitted. A quarter turn swaps the
+   canvas width and height and clears it, and needs whole bytes across
+   and down the panel. Walls and their panels cannot be turned a
+   quarter. Returns non-zero if the orientation is unsupported. */
+int EPD_set_orientation(EPD Display, enum EPD_ROTATION rotation, int flags);
 
 /* Image display and manipulation */
 void EPD_set_px(EPD Display, size_t x, size_t y);
+int EPD_set_pixels(EPD Display, const struct Coordinate *Points, size_t n);
+/* Combine a w x h 1bpp bitmap (stride bytes per row, most significant
+   bit first, set bits white) into the back buffer at (x, y), clipped
+   to the canvas */
+void EPD_blit(EPD Display, const uint8_t *bitmap, size_t w, size_t h,
+	      size_t stride, long x, long y, enum EPD_ROP rop);
 int EPD_draw_path(EPD Display, PATH Route);
-int EPD_refresh(EPD Display);
+
+/* Shapes in the write mode and colour, clipped to the canvas. Outlines
+   are one pixel wide, fills are drawn through the stipple pattern. */
+void EPD_draw_rect(EPD Display, long x, long y, long w, long h);
+void EPD_fill_rect(EPD Display, long x, long y, long w, long h);
+void EPD_draw_circle(EPD Display, long cx, long cy, long r);
+void EPD_fill_circle(EPD Display, long cx, long cy, long r);
+void EPD_draw_ellipse(EPD Display, long cx, long cy, long rx, long ry);
+void EPD_fill_ellipse(EPD Display, long cx, long cy, long rx, long ry);
+int EPD_fill_polygon(EPD Display, PATH Outline, enum FILL_RULE rule);
+
+/* Text from Font in the write mode and colour, inked pixels take the
+   colour. The UTF-8 string is drawn from its top left corner at (x,
+   y), a newline starts a line FONT_HEIGHT below at x. Returns
+   non-zero if no font is set. */
+void EPD_set_font(EPD Display, FONT Font);
+int EPD_draw_text(EPD Display, long x, long y, const char *text);
+/* Draw laid out text in the write mode and colour, LAYOUT_get_bounds
+   gives the area to refresh */
+void EPD_draw_layout(EPD Display, LAYOUT Text);
+
+/* Draw the PBM, PGM or PPM image at path scaled to w x h (0 keeps the
+   width or height of the file) with its top left corner at (x, y),
+   clipped to the canvas. Pixels are copied, white where dithering
+   finds the image light. The file is read a row at a time. Returns
+   non-zero if it cannot be read. */
+int EPD_draw_image(EPD Display, const char *path, long x, long y,
+		   size_t w, size_t h, enum EPD_DITHER dither);
+
+/* 8x8 fill pattern, row y % 8 of pattern masks the pixels of each
+   row (most significant bit first). NULL fills solid. */
+void EPD_set_stipple(EPD Display, const uint8_t pattern[8]);
+/* Ordered dither pattern for a grey of level 64ths */
+void EPD_grey_stipple(uint8_t pattern[8], unsigned int level);
+void EPD_swap(EPD Display);	/* Present the back buffer */
+int EPD_refresh(EPD Display);	/* Transmits the front buffer */
+int EPD_refresh_area(EPD Display, size_t x, size_t y, size_t w, size_t h);
 int EPD_clear(EPD Display);
 
+/* Unchecked drawing into the back buffer in the current write mode
+   and colour. The raster is valid until the next EPD_swap or change
+   of mode or colour, pixels drawn through it are not counted in the
+   statistics. */
+struct EPD_RASTER {
+    uint8_t *buf;
+    size_t stride;		/* Bytes per row */
+    size_t width, height;
+    uint8_t and_mask;		/* 0xFF to set or clear, 0x00 to toggle */
+    uint8_t xor_mask;		/* 0xFF to set or toggle, 0x00 to clear */
+};
+
+void EPD_get_raster(EPD Display, struct EPD_RASTER *Raster);
+
+/* Draw pixel (x, y), which must be within the raster */
+static inline void
+EPD_raster_px(const struct EPD_RASTER *Raster, size_t x, size_t y)
+{
+    uint8_t *p = Raster->buf + (y * Raster->stride) + (x >> 3);
+    uint8_t m = 0x80 >> (x & 7);
+
+    *p = (*p & ~(m & Raster->and_mask)) ^ (m & Raster->xor_mask);
+}
+
+/* Background refresh, frames queued while a refresh is in progress
+   are coalesced so that only the newest is displayed */
+unsigned long EPD_refresh_async(EPD Display); /* Returns ticket */
+int EPD_refresh_wait(EPD Display, unsigned long ticket);
+void EPD_set_refresh_callback(EPD Display, EPD_REFRESH_CB cb, void *arg);
+
+/* Latency and traffic statistics, a wall reports its panels combined */
+void EPD_get_stats(EPD Display, struct EPD_STATS *Stats);
+void EPD_reset_stats(EPD Display);
+int EPD_dump_stats(EPD Display, FILE *stream);
+
+/* SPI trace capture of every display, the newest records entries are
+   kept and written to a file for wsepd_replay */
+int EPD_trace_start(size_t records);
+void EPD_trace_stop(void);
+int EPD_trace_dump(const char *path);
+
 /* Debugging only */
 void EPD_print_bmp(EPD Display);
-uint8_t *EPD_get_bmp(EPD Display);
+uint8_t *EPD_get_bmp(EPD Display); /* Back buffer */
+uint8_t *EPD_get_front(EPD Display);
+struct Transport *EPD_get_transport(EPD Display);
 
 #endif /* LIBWSEPD_H */
@@ -38,50 +38,44 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <ert_log.h>
-#include <wiringPi.h>
-#include <wiringPiSPI.h>
 
 #include "waveshare2.9.h"
+#include "wsepd_transport.h"
+#include "wsepd_clock.h"
+#include "wsepd_trace.h"
 #include "libwsepd.h"
 
 /**
    SPI Communication Methods
 **/
 
-/* Sends hex data buffer to e-paper module over the SPI
-   interface. Returns non-zero on failure. Data in buffer will be
-   overwritten by previous EPD buffer, if the module supports data
-   output. */
+/* Sends hex data buffer to e-paper module over the SPI interface of
+   the transport, dc is the level of the data/command pin (recorded
+   when tracing). Returns non-zero on failure. */
 int
-spi_comms(int channel, uint8_t *out_buf, int len)
+spi_comms(struct Transport *Bus, int dc, const uint8_t *out_buf, size_t len)
 {
-    if (SPILOG) {
-	fprintf(stdout, "%02x",out_buf[0]);
-    }
+    TRACE_spi(Bus, dc, out_buf, len);
 
-    int spi_in = wiringPiSPIDataRW(channel, out_buf, len);
-    if (spi_in < 0) {
+    int rc = bus_spi_write(Bus, out_buf, len);
+    if (rc) {
 	errno = EREMOTEIO;
 	log_err("SPI I/O error.");
     }
-    return (spi_in < 0) ? 1 : 0;
+    return rc ? 1 : 0;
 }
 
 /* Send command (1 Byte) to the e-paper display module, returns
    non-zero in event of an SPI write failure. */
 int
-send_command_byte(enum EPD_COMMANDS command)
+send_command_byte(struct Transport *Bus, enum EPD_COMMANDS command)
 {
-    if (SPILOG) {
-	fprintf(stdout, "\n[SPI] 0x");
-    }
-
     uint8_t command_byte = command & 0xFF;
 
-    digitalWrite(DC_PIN, GPIO_LOW);
-    digitalWrite(CS_PIN, GPIO_LOW);
-    int rc = spi_comms(PI_CHANNEL, &command_byte, 1);
-    digitalWrite(CS_PIN, GPIO_HIGH);
+    bus_gpio_write(Bus, Bus->pins.dc, GPIO_LOW);
+    bus_gpio_write(Bus, Bus->pins.cs, GPIO_LOW);
+    int rc = spi_comms(Bus, GPIO_LOW, &command_byte, 1);
+    bus_gpio_write(Bus, Bus->pins.cs, GPIO_HIGH);
 
     return rc;
 }
@@ -89,16 +83,77 @@ send_command_byte(enum EPD_COMMANDS command)
 /* Send one byte of data to the e-paper display module, returns
    non-zero in event of an SPI write failure */
 int
-send_data_byte(uint8_t data)
+send_data_byte(struct Transport *Bus, uint8_t data)
 {
-    digitalWrite(DC_PIN, GPIO_HIGH);
-    digitalWrite(CS_PIN, GPIO_LOW);
-    int rc = spi_comms(PI_CHANNEL, &data, 1);
-    digitalWrite(CS_PIN, GPIO_HIGH);
+    bus_gpio_write(Bus, Bus->pins.dc, GPIO_HIGH);
+    bus_gpio_write(Bus, Bus->pins.cs, GPIO_LOW);
+    int rc = spi_comms(Bus, GPIO_HIGH, &data, 1);
+    bus_gpio_write(Bus, Bus->pins.cs, GPIO_HIGH);
 
     return rc;
 }
 
+/* Send a buffer of data to the e-paper display module. DC and CS are
+   asserted once for the whole buffer, which is streamed in transfers
+   of at most SPI_BUF_MAX bytes (the spidev limit). Returns non-zero
+   in event of an SPI write failure. */
+int
+send_data_buf(struct Transport *Bus, const uint8_t *data, size_t len)
+{
+    int rc = 0;
+
+    bus_gpio_write(Bus, Bus->pins.dc, GPIO_HIGH);
+    bus_gpio_write(Bus, Bus->pins.cs, GPIO_LOW);
+    while (len > 0 && !rc) {
+	size_t n = (len < SPI_BUF_MAX) ? len : SPI_BUF_MAX;
+	rc = spi_comms(Bus, GPIO_HIGH, data, n);
+	data += n;
+	len -= n;
+    }
+    bus_gpio_write(Bus, Bus->pins.cs, GPIO_HIGH);
+
+    return rc;
+}
+
+/* Send a command byte followed by its parameters, the parameters are
+   sent in a single transfer. Returns non-zero on SPI write failure. */
+int
+send_command(struct Transport *Bus, enum EPD_COMMANDS command,
+	     const uint8_t *data, size_t len)
+{
+    if (send_command_byte(Bus, command))
+	return 1;
+
+    return (len > 0) ? send_data_buf(Bus, data, len) : 0;
+}
+
+/* Interpret a command script of len bytes. Each command is encoded as
+   an opcode, a payload length and the payload itself:
+
+   { opcode, n, data[0], ... data[n-1], opcode, n, ... }
+
+   Returns non-zero on SPI write failure or a malformed script. */
+int
+run_script(struct Transport *Bus, const uint8_t *script, size_t len)
+{
+    size_t pc = 0;		/* Offset of the next opcode */
+
+    while (pc < len) {
+	if (pc + 2 > len || pc + 2 + script[pc + 1] > len) {
+	    errno = EINVAL;
+	    log_err("Malformed command script at byte %zu.", pc);
+	    return 1;
+	}
+
+	if (send_command(Bus, script[pc], script + pc + 2, script[pc + 1]))
+	    return 1;
+
+	pc += 2 + script[pc + 1];
+    }
+
+    return 0;
+}
+
 /**
    Device Commands
 **/
@@ -106,192 +161,237 @@ send_data_byte(uint8_t data)
 /* Initialise the EPD display using the waveshare EPD hex
    commands. This code is specific to the 2.9" HAT module */
 int
-init_epd(EPD Display)
+init_epd(struct Transport *Bus, EPD Display)
 {
-    reset_epd();
-
-    int rc = send_command_byte(DRIVER_OUTPUT_CONTROL);
-    if (rc) goto out;
-    rc = send_data_byte((EPD_get_height(Display) - 1) & 0xFF);
-    if (rc) goto out;
-    rc = send_data_byte(((EPD_get_height(Display) - 1) >> 8) & 0xFF);
-    if (rc) goto out;
-    rc = send_data_byte(0x00);
-    if (rc) goto out;
-    
-    rc = send_command_byte(BOOSTER_SOFT_START_CONTROL);
-    if (rc) goto out;
-    rc = send_data_byte(0xD7);
-    if (rc) goto out;
-    rc = send_data_byte(0xD6);
-    if (rc) goto out;
-    rc = send_data_byte(0x9D);
-    if (rc) goto out;
-
-    rc = send_command_byte(WRITE_VCOM_REGISTER);
-    if (rc) goto out;
-    rc = send_data_byte(0xA8);
-    if (rc) goto out;
-
-    rc = send_command_byte(SET_DUMMY_LINE_PERIOD);
-    if (rc) goto out;
-    rc = send_data_byte(0x1A);
-    if (rc) goto out;
-
-    rc = send_command_byte(SET_GATE_TIME);
-    if (rc) goto out;
-    rc = send_data_byte(0x08);
-    if (rc) goto out;
-
-    rc = send_command_byte(BORDER_WAVEFORM_CONTROL);
-    if (rc) goto out;
-    rc = send_data_byte(0x03);
-    if (rc) goto out;
-
-    rc = send_command_byte(DATA_ENTRY_MODE_SETTING);
-    if (rc) goto out;
-    rc = send_data_byte(0x03);
-    if (rc) goto out;
-
-    rc = send_command_byte(WRITE_LUT_REGISTER);
-    if (rc) goto out;
-    for (int i = 0; i < 30; ++i) {// check cant send entire buffer
-	rc = send_data_byte(lut_full_update[i]);
-	if (rc) goto out;
+    reset_epd(Bus);
+
+    return configure_epd(Bus, Display);
+}
+
+/* Configure a freshly reset controller and load the full update
+   LUT. Returns non-zero on failure. */
+int
+configure_epd(struct Transport *Bus, EPD Display)
+{
+    /* Gate lines depend on the panel height */
+    uint16_t gates = EPD_get_physical_height(Display) - 1;
+    const uint8_t driver_script[] =
+	{ DRIVER_OUTPUT_CONTROL, 3, gates & 0xFF, (gates >> 8) & 0xFF, 0x00 };
+
+    if (run_script(Bus, driver_script, sizeof driver_script)
+	|| run_script(Bus, init_script, sizeof init_script)
+	|| run_script(Bus, lut_full_update, sizeof lut_full_update)) {
+	errno = EREMOTEIO;
+	log_err("Failed to initialise e-paper display module.");
+	return 1;
     }
 
     log_info("E-paper display initialised successfully.");
     
     return 0;
- out:
-    errno = EREMOTEIO;
-    log_err("Failed to initialise e-paper display module.");
-    return 1;
 }
 
 /* Set the e-paper display window to the provided minimum and maximum
-   ranges for the x and y coordinates.
+   ranges for the x and y coordinates, the maximums are inclusive.
 
    If sizes is provided it should be a pointers to the start of an
    array containing 4 integers representing:
-   sizes[0] - minimum width in pixels
-   sizes[1] - maximum height in pixels
-   sizes[2] - minimum width in pixels
-   sizes[3] - maximum height in pixels
+   sizes[0] - minimum x in pixels
+   sizes[1] - maximum x in pixels
+   sizes[2] - minimum y in pixels
+   sizes[3] - maximum y in pixels
        
-   If size is NULL, the default maximum pixels are used from the
-   display structure and the minimums are set to the origin.
+   If size is NULL, the entire display area is used, from the origin
+   to the last pixel in the display structure.
 
    Returns non-zero on failure. */
-void
-set_display_window(EPD Display, size_t *sizes)
+int
+set_display_window(struct Transport *Bus, EPD Display, size_t *sizes)
 {
     uint16_t xmin, xmax, ymin, ymax;
 
     if (sizes == NULL) {		/* use default, max area */
 	xmin = 0;
-	xmax = EPD_get_width(Display);
+	xmax = EPD_get_physical_width(Display) - 1;
 	ymin = 0;
-	ymax = EPD_get_height(Display);
+	ymax = EPD_get_physical_height(Display) - 1;
     } else {			/* use provided sizes */
 	xmin = sizes[0];
 	xmax = sizes[1];
 	ymin = sizes[2];
 	ymax = sizes[3];
     }
-    // try to send more than one byte at a time over SPI with
-    // send_data_spi.
-    //
-    // May need to reverse order of bytes... or find out order wiringPi
-    // sends data in.
-    //
-    // Determine why only one byte is sent for x address and 2 for y
-    // address (is it just pixel width related?).
-    //
-    // Also determine what the point of the bit shift on width is
-    // required for.
-    send_command_byte(SET_RAM_X_ADDRESS_START_END_POSITION);
-    send_data_byte((xmin >> 3) & 0xFF);
-    send_data_byte((xmax >> 3) & 0xFF);
-
-    send_command_byte(SET_RAM_Y_ADDRESS_START_END_POSITION);
-    send_data_byte(ymin & 0xFF);
-    send_data_byte((ymin >> 8) & 0xFF);
-    send_data_byte(ymax & 0xFF);
-    send_data_byte((ymax >> 8) & 0xFF);
 
-    return;
+    /* The x address counts bytes (8 pixels), y counts gate lines */
+    const uint8_t window_script[] =
+	{ SET_RAM_X_ADDRESS_START_END_POSITION, 2,
+	  (xmin >> 3) & 0xFF, (xmax >> 3) & 0xFF,
+	  SET_RAM_Y_ADDRESS_START_END_POSITION, 4,
+	  ymin & 0xFF, (ymin >> 8) & 0xFF, ymax & 0xFF, (ymax >> 8) & 0xFF };
+
+    return run_script(Bus, window_script, sizeof window_script);
 }
 
 /* Set the cursor position (typically run prior to writing image data
-   to RAM) */
-void
-set_cursor(uint16_t x, uint16_t y)
+   to RAM). Returns non-zero on failure. */
+int
+set_cursor(struct Transport *Bus, uint16_t x, uint16_t y)
 {
-    send_command_byte(SET_RAM_X_ADDRESS_COUNTER);
-    send_data_byte((x >> 3) & 0xFF);
+    const uint8_t cursor_script[] =
+	{ SET_RAM_X_ADDRESS_COUNTER, 1, (x >> 3) & 0xFF,
+	  SET_RAM_Y_ADDRESS_COUNTER, 2, y & 0xFF, (y >> 8) & 0xFF };
 
-    send_command_byte(SET_RAM_Y_ADDRESS_COUNTER);
-    send_data_byte(y & 0xFF);
-    send_data_byte((y >> 8) & 0xFF);
+    return run_script(Bus, cursor_script, sizeof cursor_script);
+}
 
-    return;
+/* Stream an entire frame to RAM in a single WRITE_RAM, relying on the
+   controller incrementing x then y (see DATA_ENTRY_MODE_SETTING). The
+   display window must cover the whole frame. Returns non-zero on
+   failure. */
+int
+write_ram_frame(struct Transport *Bus, const uint8_t *buf, size_t len)
+{
+    if (set_cursor(Bus, 0, 0))
+	return 1;
+
+    return send_command(Bus, WRITE_RAM, buf, len);
+}
+
+/* Stream rows ymin to ymax (inclusive) of buf to RAM in a single
+   WRITE_RAM, as write_ram_frame. stride is the length of a row in
+   bytes and must match the display window. Returns non-zero on
+   failure. */
+int
+write_ram_rows(struct Transport *Bus, const uint8_t *buf, size_t stride,
+	       size_t ymin, size_t ymax)
+{
+    if (set_cursor(Bus, 0, ymin))
+	return 1;
+
+    return send_command(Bus, WRITE_RAM, buf + (ymin * stride),
+			(ymax - ymin + 1) * stride);
 }
 
-/* Wait until busy pin reads low. Return wait time (in ms) or -1 if
-   the wait time was greater than 100x BUSY_DELAY_MS.  */
+/* Write the window of buf bounded by pixel columns xmin to xmax and
+   rows ymin to ymax (inclusive) to RAM, one row at a time. stride is
+   the length of a row of buf in bytes. The x bounds are rounded out to
+   whole bytes. Returns non-zero on failure. */
 int
-wait_while_busy(void)
+write_ram_window(struct Transport *Bus, const uint8_t *buf, size_t stride,
+		 size_t xmin, size_t xmax, size_t ymin, size_t ymax)
 {
-    int t = 0;
-    while (digitalRead(BUSY_PIN) == GPIO_HIGH) {
+    size_t sizes[4] = { xmin, xmax, ymin, ymax };
+    size_t first = xmin / 8, last = xmax / 8;
+
+    if (set_display_window(Bus, NULL, sizes))
+	return 1;
 
-	if (t > 100) {
-	    errno = EBUSY;
-	    log_err("Device not leaving busy state. Is power connected?");
-	    return -1;
+    for (size_t y = ymin; y <= ymax; ++y) {
+	if (set_cursor(Bus, xmin, y))
+	    return 1;
+	if (send_command(Bus, WRITE_RAM, buf + (y * stride) + first,
+			 last - first + 1))
+	    return 1;
+    }
+
+    return 0;
+}
+
+/* Wait until busy pin reads low. The transport sleeps until the
+   falling edge where it can, otherwise the pin is polled every
+   BUSY_POLL_MS. Returns the time spent busy in microseconds, or -1 if
+   the device is still busy after BUSY_TIMEOUT_MS. */
+long
+wait_while_busy(struct Transport *Bus)
+{
+    uint64_t start = clock_now_us();
+    uint64_t deadline = start + (uint64_t)BUSY_TIMEOUT_MS * 1000;
+
+    int rc = bus_wait_level(Bus, Bus->pins.busy, GPIO_LOW, BUSY_TIMEOUT_MS);
+    while (rc < 0) {		/* no edge events, fall back to polling */
+	if (bus_gpio_read(Bus, Bus->pins.busy) != GPIO_HIGH) {
+	    rc = 0;
+	} else if (clock_now_us() >= deadline) {
+	    rc = 1;
+	} else {
+	    bus_delay(Bus, BUSY_POLL_MS);
 	}
+    }
 
-	delay(BUSY_DELAY_MS);
-	++t;
+    if (rc) {
+	errno = EBUSY;
+	log_err("Device not leaving busy state. Is power connected?");
+	return -1;
     }
 
-   return t * BUSY_DELAY_MS;
+    return clock_now_us() - start;
 }
 
 /* Apply the bitmap in RAM to the e-paper display, returns 1 if busy
-   line is held low for too long (see wait_while_busy). */
+   line is held low for too long (see wait_while_busy). The time spent
+   busy is stored in busy_us when it is not NULL. */
 int
-load_display_from_ram(void)
+load_display_from_ram(struct Transport *Bus, long *busy_us)
 {
-    send_command_byte(DISPLAY_UPDATE_CONTROL_2);
-    send_data_byte(0xC4);
-
-    send_command_byte(MASTER_ACTIVATION);
-    send_command_byte(TERMINATE_FRAME_READ_WRITE);
+    if (activate_display(Bus))
+	return 1;
 
-    if (wait_while_busy() < 0) {
+    long t = wait_while_busy(Bus);
+    if (t < 0) {
 	errno = EBUSY;
 	log_err("Failed to load display from RAM.");
 	return 1;
     }
+    log_debug("Display busy for %ldus.", t);
+
+    if (busy_us)
+	*busy_us = t;
     
     return 0;
 }
 
+/* Start applying the bitmap in RAM to the display without waiting,
+   the busy pin stays high until it is done. Returns non-zero on
+   failure. */
+int
+activate_display(struct Transport *Bus)
+{
+    if (run_script(Bus, activate_script, sizeof activate_script)) {
+	errno = EREMOTEIO;
+	log_err("Failed to load display from RAM.");
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Send the e-paper display into deep sleep, returns non-zero on
+   failure. A reset is required to wake the device. */
+int
+sleep_epd(struct Transport *Bus)
+{
+    if (wait_while_busy(Bus) < 0) {
+	errno = EBUSY;
+	log_err("Device busy, cannot enter deep sleep.");
+	return 1;
+    }
+
+    return run_script(Bus, sleep_script, sizeof sleep_script);
+}
+
 /* Resets the e-paper display by stepping the reset pin low for
    RST_DELAY_MS */
 void
-reset_epd(void)
+reset_epd(struct Transport *Bus)
 {
-    digitalWrite(RST_PIN, GPIO_HIGH);
-    delay(RST_DELAY_MS);
+    bus_gpio_write(Bus, Bus->pins.rst, GPIO_HIGH);
+    bus_delay(Bus, RST_DELAY_MS);
 
-    digitalWrite(RST_PIN, GPIO_LOW);
-    delay(RST_DELAY_MS);
+    bus_gpio_write(Bus, Bus->pins.rst, GPIO_LOW);
+    bus_delay(Bus, RST_DELAY_MS);
 
-    digitalWrite(RST_PIN, GPIO_HIGH);
-    delay(RST_DELAY_MS);    
+    bus_gpio_write(Bus, Bus->pins.rst, GPIO_HIGH);
+    bus_delay(Bus, RST_DELAY_MS);
 
     return;
 }
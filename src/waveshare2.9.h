@@ -30,18 +30,20 @@
  * THE SOFTWARE.
  */
 
+#ifndef WAVESHARE29_H
+#define WAVESHARE29_H
+
+#include <stddef.h>
 #include <stdint.h>
 #include "libwsepd.h"
-
-/* When true, all SPI communication is output to stdout. */
-#ifndef SPILOG
-#define SPILOG = 0
-#endif
+#include "wsepd_transport.h"
 
 #define SPI_CLK_HZ 32000000	/* SPI clock speed (Hz) */
 #define PI_CHANNEL 0		/* RPi has two channels */
+#define SPI_BUF_MAX 4096	/* spidev maximum transfer size (bytes) */
 #define RST_DELAY_MS 200	/* GPIO reset time delay (ms) */
-#define BUSY_DELAY_MS 100	/* GPIO busy wait time (ms) */
+#define BUSY_POLL_MS 5		/* Busy poll period without edges (ms) */
+#define BUSY_TIMEOUT_MS 10000	/* Longest the device may stay busy (ms) */
 
 /* Waveshare EPD module commands */
 enum EPD_COMMANDS
@@ -77,30 +79,65 @@ enum BCM_EPD_PINS
 enum GPIO_OUTPUT_LEVEL { GPIO_LOW, GPIO_HIGH };
 
 
+/* Command scripts, interpreted by run_script(). Each command is
+   encoded as { opcode, payload length, payload... } */
+
+/* Controller configuration applied after DRIVER_OUTPUT_CONTROL */
+static const uint8_t init_script[] =
+    { BOOSTER_SOFT_START_CONTROL, 3, 0xD7, 0xD6, 0x9D,
+      WRITE_VCOM_REGISTER,        1, 0xA8,
+      SET_DUMMY_LINE_PERIOD,      1, 0x1A,
+      SET_GATE_TIME,              1, 0x08,
+      BORDER_WAVEFORM_CONTROL,    1, 0x03,
+      DATA_ENTRY_MODE_SETTING,    1, 0x03 }; /* x then y increment */
+
+/* Apply the RAM contents to the panel */
+static const uint8_t activate_script[] =
+    { DISPLAY_UPDATE_CONTROL_2,   1, 0xC4,
+      MASTER_ACTIVATION,          0,
+      TERMINATE_FRAME_READ_WRITE, 0 };
+
+static const uint8_t sleep_script[] =
+    { DEEP_SLEEP_MODE, 1, 0x01 };
+
 /* Waveshare look up tables for module register */
 static const uint8_t lut_full_update[] =
-    { 0x02, 0x02, 0x01, 0x11, 0x12, 0x12, 0x22, 0x22,
+    { WRITE_LUT_REGISTER, 30,
+      0x02, 0x02, 0x01, 0x11, 0x12, 0x12, 0x22, 0x22,
       0x66, 0x69, 0x69, 0x59, 0x58, 0x99, 0x99, 0x88,
       0x00, 0x00, 0x00, 0x00, 0xF8, 0xB4, 0x13, 0x51,
       0x35, 0x51, 0x51, 0x19, 0x01, 0x00 };
 
-/* static const uint8_t lut_partial_update[] = */
-/*   { 0x10, 0x18, 0x18, 0x08, 0x18, 0x18, 0x08, 0x00, */
-/*     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, */
-/*     0x00, 0x00, 0x00, 0x00, 0x13, 0x14, 0x44, 0x12, */
-/*     0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; */
+static const uint8_t lut_partial_update[] =
+    { WRITE_LUT_REGISTER, 30,
+      0x10, 0x18, 0x18, 0x08, 0x18, 0x18, 0x08, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x13, 0x14, 0x44, 0x12,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 
 /* Epd <-> RPi SPI communication */
-int spi_comms(int channel, uint8_t *buf, int len);
-int send_command_byte(enum EPD_COMMANDS command);
-int send_data_byte(uint8_t data);
+int spi_comms(struct Transport *Bus, int dc, const uint8_t *buf, size_t len);
+int send_command_byte(struct Transport *Bus, enum EPD_COMMANDS command);
+int send_data_byte(struct Transport *Bus, uint8_t data);
+int send_data_buf(struct Transport *Bus, const uint8_t *data, size_t len);
+int send_command(struct Transport *Bus, enum EPD_COMMANDS command,
+		 const uint8_t *data, size_t len);
+int run_script(struct Transport *Bus, const uint8_t *script, size_t len);
 
 /* EPD commands */
-int init_epd(EPD Display);
-void set_display_window(EPD Display, size_t *sizes);
-void set_cursor(uint16_t x, uint16_t y);
-int wait_while_busy(void);
-int load_display_from_ram(void);
-void reset_epd(void);
-
+int init_epd(struct Transport *Bus, EPD Display);
+int configure_epd(struct Transport *Bus, EPD Display);
+int set_display_window(struct Transport *Bus, EPD Display, size_t *sizes);
+int set_cursor(struct Transport *Bus, uint16_t x, uint16_t y);
+int write_ram_frame(struct Transport *Bus, const uint8_t *buf, size_t len);
+int write_ram_rows(struct Transport *Bus, const uint8_t *buf, size_t stride,
+		   size_t ymin, size_t ymax);
+int write_ram_window(struct Transport *Bus, const uint8_t *buf, size_t stride,
+		     size_t xmin, size_t xmax, size_t ymin, size_t ymax);
+long wait_while_busy(struct Transport *Bus);
+int load_display_from_ram(struct Transport *Bus, long *busy_us);
+int activate_display(struct Transport *Bus);
+int sleep_epd(struct Transport *Bus);
+void reset_epd(struct Transport *Bus);
 
+#endif /* WAVESHARE29_H */
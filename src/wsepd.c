@@ -27,35 +27,132 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <ert_log.h>
-#include <math.h>
-#include <wiringPi.h>
-#include <wiringPiSPI.h>
+#include <pthread.h>
 
 #include "libwsepd.h"
 #include "wsepd_signal.h"
 #include "waveshare2.9.h"
 #include "wsepd_path.h"
+#include "wsepd_transport.h"
+#include "wsepd_worker.h"
+#include "wsepd_sched.h"
+#include "wsepd_stats.h"
+#include "wsepd_clock.h"
+#include "wsepd_raster.h"
 
 #define NEVERPRINT 1
+#define SIGNAL_POLL_MS 100	/* Idle thread check for deferred signals */
+
+/* Backend used by EPD_create, wiringPi unless built with WIRINGPI=0 */
+#ifndef WIRINGPI
+#define WIRINGPI 1
+#endif
+#if WIRINGPI
+#define DEFAULT_BACKEND WIRINGPI_BACKEND
+#else
+#define DEFAULT_BACKEND NATIVE_BACKEND
+#endif
 
 /* A bitmap representing the e-paper dispay screen */
 struct bitmap {
-    uint8_t *buf;		      /* Pointer to 1D image bitmap buffer */
+    uint8_t *buf;		      /* Back buffer, target of all drawing */
+    uint8_t *front;		      /* Front buffer, read to transmit */
+    uint8_t *shadow;		      /* Contents of the controller RAM */
+    uint8_t *phys;		      /* Front buffer turned onto the panel */
+    int shadow_valid;		      /* Zero until a full frame is sent */
     size_t buflen;	      /* Total Length in bytes of 1D array  */
     size_t width;		      /* Theoretical width in bytes if 2D */
+    size_t phys_width;		      /* Bytes per row on the panel */
     /* Theoretical height is one byte per pixel (height in struct Epd) */
 };
 
+/* Bounds of the bytes that differ between two frames, inclusive */
+struct dirty {
+    size_t xmin, xmax;		/* Bytes within a row */
+    size_t ymin, ymax;		/* Rows */
+};
+
+/* Look up table loaded in the controller */
+enum EPD_LUT { LUT_NONE, LUT_FULL, LUT_PARTIAL };
+
+/* A reset line, shared by the displays wired to the same pin of one
+   backend. A pulse resets every controller on the line, so each
+   display compares the count of pulses with the count at its own
+   reset to tell that a sibling has reset it. Guarded by rst_lock. */
+struct RstLine {
+    enum EPD_BACKEND backend;
+    int pin;
+    unsigned long resets;	/* Pulses sent on the line */
+    unsigned int refs;		/* Displays wired to the line */
+    struct RstLine *Next;
+};
+
 /* E-paper display object */
 struct Epd {
-    size_t width;
+    size_t width;		/* Of the canvas */
     size_t height;
+    size_t phys_width;		/* Of the panel */
+    size_t phys_height;
     int poweron;
+    struct Transport *Bus;
+    struct RstLine *Rst;	/* NULL for a wall */
+    unsigned long rst_seen;	/* Rst->resets at the last reset */
+    pthread_mutex_t io_lock;	/* Serialises access to the device */
+    pthread_mutex_t front_lock;	/* Held while the front buffer is read */
+    struct Worker *Worker;	/* Started by first asynchronous call */
+    EPD_REFRESH_CB refresh_cb;
+    void *refresh_arg;
+    long busy_us;		/* Busy time of the last refresh */
+
+    /* Partial refresh policy, a full refresh is forced after
+       full_every partials or when the window exceeds full_area_pct of
+       the display */
+    enum REFRESH_MODE refresh_mode;
+    enum EPD_LUT lut;
+    unsigned int partial_count;	/* Partials since the last full */
+    unsigned int full_every;
+    unsigned int full_area_pct;
+
+    /* Power policy, with idle_ms zero the device sleeps after each
+       refresh, otherwise it is kept initialised until idle for
+       idle_ms. The idle thread waits on idle_cond with io_lock. */
+    unsigned int idle_ms;
+    uint64_t idle_deadline;	/* Monotonic time to sleep (us) */
+    int idle_running;
+    int idle_stop;
+    pthread_t idle_thread;
+    pthread_cond_t idle_cond;
+
+    /* A wall only holds the canvas, drawn as one display and split
+       into the panels' front buffers at refresh time */
+    struct Epd **Panels;	/* NULL for a single panel */
+    int in_wall;		/* A panel of a wall, its size is fixed */
+    size_t npanels;
+    size_t cols;		/* Panels across the canvas */
+    int shared_bus;		/* Refresh through the bus scheduler */
+    struct EPD_BUS_STATS bus_stats; /* Last scheduled refresh */
+
+    /* Statistics, guarded by io_lock apart from the pixel count. The
+       SPI counters are read from the transport. */
+    struct EPD_STATS stats;
+    uint64_t pixels;		/* Pixels drawn */
+    uint64_t spi_bytes_base;	/* Transport counters at last reset */
+    uint64_t spi_transfers_base;
+
+    struct Epd *Next;		/* Registry of live displays */
     struct bitmap bmp;
     enum FOREGROUND_COLOUR colour;
     enum WRITE_MODE write_mode;
+    uint8_t stipple[8];		/* Fill pattern */
+    int stippled;		/* Zero to fill solid */
+    FONT Font;			/* For EPD_draw_text, not owned */
+
+    /* RASTER_orient ops producing the panel frame from the canvas,
+       zero transmits the front buffer as it is */
+    int orient_ops;
 };
 
 /**
@@ -63,48 +160,163 @@ struct Epd {
  **/
 
 /* Device initialisation */
-static int initialise_gpio(void);
+static void initialise_fields(struct Epd *Display,
+			      size_t width, size_t height);
+static int initialise_gpio(struct Epd *Display,
+			   const struct EPD_CONFIG *Config);
 static int initialise_epd(struct Epd *Display);
+static int initialise_worker(struct Epd *Display);
+static int initialise_idle(struct Epd *Display);
+static void *idle_run(void *data);
+
+/* Registry of live displays, put to sleep at exit */
+static struct Epd *registry = NULL;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+static void registry_add(struct Epd *Display);
+static void registry_remove(struct Epd *Display);
+static void registry_at_exit(void);
+static void registry_setup(void);
+
+/* Reset lines shared between displays */
+static struct RstLine *rst_lines = NULL;
+static pthread_mutex_t rst_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct RstLine *rst_line_get(enum EPD_BACKEND backend, int pin);
+static void rst_line_put(struct RstLine *Rst);
+static void rst_line_pulsed(struct Epd **Displays, size_t n);
+static void display_check_reset(struct Epd *Display);
+
+/* Device operations, io_lock must be held */
+static int prepare_device(struct Epd *Display, enum EPD_LUT lut);
+static void finish_refresh(struct Epd *Display);
+static int refresh_frame(struct Epd *Display, const uint8_t *frame);
+static int refresh_window(struct Epd *Display, const uint8_t *frame,
+			  size_t xmin, size_t xmax, size_t ymin, size_t ymax);
+static int refresh_changes(struct Epd *Display, const uint8_t *frame);
+static void display_sleep(struct Epd *Display);
+static void display_slept(struct Epd *Display);
+static void display_time(struct Epd *Display, enum EPD_PHASE phase,
+			 uint64_t start);
+static int worker_refresh(EPD Display, const uint8_t *frame);
+static const uint8_t *orient_frame(struct Epd *Display, const uint8_t *frame);
+static void orient_area(struct Epd *Display, size_t *x, size_t *y,
+			size_t *w, size_t *h);
+
+/* Walls of panels */
+static int wall_refresh(struct Epd *Wall, const uint8_t *frame,
+			size_t x, size_t y, size_t w, size_t h, int whole);
+static void wall_split(struct Epd *Wall, const uint8_t *frame, size_t n);
+static int wall_refresh_shared(struct Epd *Wall, const uint8_t *frame);
+static void *panel_run(void *data);
 
 /* Bitmap manipulation and application */
 static int bitmap_alloc(struct Epd *Display);
-static void bitmap_write_to_ram(struct Epd *Display);
+static void bitmap_write_to_ram(struct Epd *Display, const uint8_t *frame);
+static int bitmap_diff(struct Epd *Display, const uint8_t *frame,
+		       struct dirty *Dirty);
+static void bitmap_update_shadow(struct Epd *Display, const uint8_t *frame,
+				 const struct dirty *Dirty);
 static void bitmap_set_px(uint8_t *byte, uint8_t n);
 static void bitmap_unset_px(uint8_t *byte, uint8_t n);
 static void bitmap_flip_px(uint8_t *byte, uint8_t n);
 static void bitmap_clear(struct Epd *Display);
+static enum BITMAP_OP bitmap_op(struct Epd *Display);
+static struct RasterBuf bitmap_raster(struct Epd *Display);
+static void bitmap_span(struct Epd *Display, enum BITMAP_OP op,
+			size_t x0, size_t x1, size_t y);
 static int bitmap_draw_line(struct Epd *Display,
 			    size_t x1, size_t y1, size_t x2, size_t y2);
 
-/* Initialise GPIO and SPI on raspberry pi */
+/* Set every field to its default, with no device or buffers */
+static void
+initialise_fields(struct Epd *Display, size_t width, size_t height)
+{
+    Display->width = width;
+    Display->height = height;
+    Display->phys_width = width;
+    Display->phys_height = height;
+    Display->poweron = 0;
+    Display->Bus = NULL;
+    Display->Rst = NULL;
+    Display->rst_seen = 0;
+    Display->Worker = NULL;
+    Display->refresh_cb = NULL;
+    Display->refresh_arg = NULL;
+    Display->busy_us = 0;
+    Display->idle_ms = 0;
+    Display->idle_deadline = 0;
+    Display->idle_running = 0;
+    Display->idle_stop = 0;
+    Display->refresh_mode = FULL_REFRESH;
+    Display->lut = LUT_NONE;
+    Display->partial_count = 0;
+    Display->full_every = 10;
+    Display->full_area_pct = 50;
+    Display->Panels = NULL;
+    Display->in_wall = 0;
+    Display->npanels = 0;
+    Display->cols = 0;
+    Display->shared_bus = 0;
+    memset(&Display->stats, 0, sizeof Display->stats);
+    Display->pixels = 0;
+    Display->spi_bytes_base = 0;
+    Display->spi_transfers_base = 0;
+    memset(&Display->bus_stats, 0, sizeof Display->bus_stats);
+    Display->Next = NULL;
+    Display->bmp.buf = NULL;
+    Display->bmp.front = NULL;
+    Display->bmp.shadow = NULL;
+    Display->bmp.phys = NULL;
+    Display->stippled = 0;
+    Display->Font = NULL;
+    Display->orient_ops = 0;
+    pthread_mutex_init(&Display->io_lock, NULL);
+    pthread_mutex_init(&Display->front_lock, NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&Display->idle_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return;
+}
+
+/* Open the transport backend and set up the GPIO pins used by the
+   e-paper module. Returns non-zero on failure. */
 static int
-initialise_gpio(void)
-{
-    wiringPiSetupGpio();	/* fatal on failure */
-    switch (errno) {
-    case EACCES:
-    /* warning resets errno set by wiringPi */
-	log_warn("Running without root privileges,\n\t"
-		 "this may work dependant on hardware configuration.");
-    case 0:
-	break;
-    default:
-	log_warn("GPIO error");
+initialise_gpio(struct Epd *Display, const struct EPD_CONFIG *Config)
+{
+    const struct TransportPins pins = { .rst = Config->rst_pin,
+					.dc = Config->dc_pin,
+					.cs = Config->cs_pin,
+					.busy = Config->busy_pin };
+
+    Display->Bus = TRANSPORT_create(Config->backend, Config->channel,
+				    Config->speed_hz, &pins);
+    if (NULL == Display->Bus)
+	return 1;
+
+    Display->Rst = rst_line_get(Config->backend, pins.rst);
+    if (NULL == Display->Rst) {
+	TRANSPORT_destroy(Display->Bus);
+	Display->Bus = NULL;
+	return 1;
     }
-    
-    /* GPIO operating modes (see page 9/26 in waveshare epd manual) */
-    pinMode(RST_PIN, OUTPUT);
-    pinMode(DC_PIN, OUTPUT);
-    pinMode(CS_PIN, OUTPUT);
-    pinMode(BUSY_PIN, INPUT);
 
-    if (wiringPiSPISetup(PI_CHANNEL, SPI_CLK_HZ) == -1) {
-	log_err("Failed to initialise SPI comms.");
+    /* GPIO operating modes (see page 9/26 in waveshare epd manual) */
+    if (bus_pin_mode(Display->Bus, pins.rst, GPIO_OUTPUT)
+	|| bus_pin_mode(Display->Bus, pins.dc, GPIO_OUTPUT)
+	|| bus_pin_mode(Display->Bus, pins.cs, GPIO_OUTPUT)
+	|| bus_pin_mode(Display->Bus, pins.busy, GPIO_INPUT)) {
+	log_err("Failed to set GPIO pin modes.");
+	rst_line_put(Display->Rst);
+	Display->Rst = NULL;
+	TRANSPORT_destroy(Display->Bus);
+	Display->Bus = NULL;
 	return 1;
     }
 
-    log_info("GPIO initialised.");
-    
     return 0;
 }
 
@@ -124,312 +336,1623 @@ initialise_epd(struct Epd *Display)
        damage */
     start_signal_handler();
     Display->poweron = 1;
-    int rc = init_epd(Display);
-    check_signal_handler(Display);
+
+    uint64_t start = clock_now_us();
+    reset_epd(Display->Bus);
+    rst_line_pulsed(&Display, 1);
+    display_time(Display, PHASE_RESET, start);
+
+    start = clock_now_us();
+    int rc = configure_epd(Display->Bus, Display);
+    display_time(Display, PHASE_INIT, start);
+    Display->lut = rc ? LUT_NONE : LUT_FULL;
+
+    if (check_signal_handler()) {
+	display_sleep(Display);
+	return 1;
+    }
 
     return rc;
 }
 
-/* Stores image buffer large enough to store binary data for each
-   pixel in the e-paper display in the e-paper display object. Returns
-   0 on success or 1 on memory error. */
+/* Start the background refresh worker if it is not already
+   running. Returns non-zero on failure. */
 static int
-bitmap_alloc(struct Epd *Display)
+initialise_worker(struct Epd *Display)
 {
-    /* A bit can characterise one pixel, so one byte can represent 8
-       pixels across the width (x axis). This is multiplied by the
-       number of pixels in the height (y axis) to determine the number of
-       bytes required to describe the entire e-paper display area.  */
+    if (Display->Worker)
+	return 0;
 
-    Display->bmp.width = (Display->width % 8 == 0)
-	? Display->width / 8
-	: Display->width / 8 + 1;
+    Display->Worker = WORKER_create(Display, Display->bmp.buflen,
+				    worker_refresh);
+    if (NULL == Display->Worker)
+	return 1;
 
-    Display->bmp.buflen = Display->bmp.width * Display->height;
+    WORKER_set_callback(Display->Worker,
+			Display->refresh_cb, Display->refresh_arg);
 
-    Display->bmp.buf = calloc(Display->bmp.buflen, sizeof *Display->bmp.buf);
-    if (Display->bmp.buf == NULL) {
-	log_err("Memory error.");
+    return 0;
+}
+
+/* Start the idle thread if it is not already running. Returns
+   non-zero on failure. */
+static int
+initialise_idle(struct Epd *Display)
+{
+    if (Display->idle_running)
+	return 0;
+
+    Display->idle_stop = 0;
+    if (pthread_create(&Display->idle_thread, NULL, idle_run, Display)) {
+	log_err("Failed to start idle sleep thread.");
 	return 1;
     }
-    log_debug("Allocated %zuB for bitmap buffer.",
-	      (sizeof *Display->bmp.buf) * Display->bmp.buflen);
+    Display->idle_running = 1;
 
     return 0;
 }
 
-/* Write bitmap to e-paper RAM and refresh screen */
-static void
-bitmap_write_to_ram(struct Epd *Display)
+/* Idle thread, sleeps the device once idle_deadline passes. While the
+   device is powered it also wakes every SIGNAL_POLL_MS, so a deferred
+   SIGINT or SIGTERM still puts the device to sleep. */
+static void *
+idle_run(void *data)
 {
-    size_t addr = 0;		/* 1D array index (calc from 2D) */
+    struct Epd *Display = data;
 
-    for (size_t y = 0; y < Display->height; ++y) {
-	/* Set cursor at start of each new row */
-	set_cursor(0, y);
-	send_command_byte(WRITE_RAM);
+    pthread_mutex_lock(&Display->io_lock);
+    while (!Display->idle_stop) {
+	if (!Display->poweron || Display->idle_ms == 0) {
+	    pthread_cond_wait(&Display->idle_cond, &Display->io_lock);
+	    continue;
+	}
 
-	/* Send one row of byte data */
-	for (size_t x = 0; x < Display->bmp.width; ++x) {
-	    addr = (y * Display->bmp.width) + x; 
-	    send_data_byte(Display->bmp.buf[addr]);
+	uint64_t now = clock_now_us();
+	if (check_signal_handler() || now >= Display->idle_deadline) {
+	    log_debug("Idle for %ums, sleeping device.", Display->idle_ms);
+	    display_sleep(Display);
+	    continue;
 	}
-    }
 
-    if (LOGLEVEL == 3) {
-	EPD_print_bmp(Display);
+	uint64_t wake = now + SIGNAL_POLL_MS * 1000;
+	if (wake > Display->idle_deadline)
+	    wake = Display->idle_deadline;
+	struct timespec ts = clock_us_to_timespec(wake);
+	pthread_cond_timedwait(&Display->idle_cond, &Display->io_lock, &ts);
     }
-  
-    return;
+    pthread_mutex_unlock(&Display->io_lock);
+
+    return NULL;
 }
 
-/* Set specified bit number to 0 */
-static void
-bitmap_set_px(uint8_t *byte, uint8_t n)
+/* Power up the device if required and make sure the look up table
+   for the refresh waveform is loaded. Returns non-zero on failure. */
+static int
+prepare_device(struct Epd *Display, enum EPD_LUT lut)
 {
-    *byte &= 0x80 >> n;
-    return;
+    display_check_reset(Display);
+    if (Display->poweron) {
+	log_debug("Device initialised, skipping reset.");
+    } else if (initialise_epd(Display)) {
+	errno = EREMOTEIO;
+	return 1;
+    }
+
+    if (Display->lut == lut)
+	return 0;
+
+    uint64_t start = clock_now_us();
+    int rc = (lut == LUT_PARTIAL)
+	? run_script(Display->Bus,
+		     lut_partial_update, sizeof lut_partial_update)
+	: run_script(Display->Bus,
+		     lut_full_update, sizeof lut_full_update);
+    Display->lut = rc ? LUT_NONE : lut;
+    display_time(Display, PHASE_INIT, start);
+
+    return rc;
 }
 
-/* Set sepecified bit number n to 0 */
+/* Put the device to sleep after a refresh, or leave it initialised
+   and restart the idle timer */
 static void
-bitmap_unset_px(uint8_t *byte, uint8_t n)
+finish_refresh(struct Epd *Display)
 {
-    *byte &= ~(0x80 >> n);
+    if (Display->idle_ms == 0 || check_signal_handler()) {
+	display_sleep(Display);
+    } else {
+	Display->idle_deadline = clock_now_us()
+	    + (uint64_t)Display->idle_ms * 1000;
+	pthread_cond_signal(&Display->idle_cond);
+    }
+
     return;
 }
 
-/* Flip specified bit number */
-static void
-bitmap_flip_px(uint8_t *byte, uint8_t n)
+/* Power up the device if required, write frame to RAM and refresh
+   the display with the full update waveform. Returns non-zero on
+   failure. */
+static int
+refresh_frame(struct Epd *Display, const uint8_t *frame)
 {
-    *byte ^= 0x80 >> n;
-    return;
+    uint64_t begin = clock_now_us();
+
+    if (prepare_device(Display, LUT_FULL))
+	goto out;
+
+    uint64_t start = clock_now_us();
+    set_display_window(Display->Bus, Display, NULL);
+    bitmap_write_to_ram(Display, frame);
+    display_time(Display, PHASE_UPLOAD, start);
+
+    start = clock_now_us();
+    if (load_display_from_ram(Display->Bus, &Display->busy_us)) {
+	errno = EBUSY;
+	goto out;
+    }
+    display_time(Display, PHASE_BUSY, start);
+
+    start = clock_now_us();
+    bus_delay(Display->Bus, 500);
+    display_time(Display, PHASE_SETTLE, start);
+
+    bitmap_update_shadow(Display, frame, NULL);
+    Display->partial_count = 0;
+    ++Display->stats.full_refreshes;
+    log_info("Display refreshed.");
+    finish_refresh(Display);
+    display_time(Display, PHASE_REFRESH, begin);
+    
+    return 0;
+ out:
+    log_err("Failed to refresh display.");
+    return 1;
 }
 
-/* Set each bit in the bitmap to the background colour (background
-   colour is the inverse of the draw colour stored in E-paper display
-   object */
-static void
-bitmap_clear(struct Epd *Display)
+/* Refresh the window of frame from pixel (xmin, ymin) to (xmax, ymax)
+   inclusive. In PARTIAL_REFRESH mode only the window is written and
+   the fast waveform is used, unless the partial policy calls for a
+   full refresh to clear ghosting. A partial refresh needs the previous
+   image in the controller RAM, so a sleeping device is always given a
+   full refresh. Returns non-zero on failure. */
+static int
+refresh_window(struct Epd *Display, const uint8_t *frame,
+	       size_t xmin, size_t xmax, size_t ymin, size_t ymax)
 {
-    size_t i;
+    size_t area = (xmax - xmin + 1) * (ymax - ymin + 1);
+
+    display_check_reset(Display);
+    if (Display->refresh_mode != PARTIAL_REFRESH
+	|| !Display->poweron
+	|| Display->partial_count >= Display->full_every
+	|| area * 100 > (Display->full_area_pct
+			 * Display->phys_width * Display->phys_height))
+	return refresh_frame(Display, frame);
+
+    uint64_t begin = clock_now_us();
+    if (prepare_device(Display, LUT_PARTIAL))
+	goto out;
 
-    for (i = 0; i < Display->bmp.buflen; ++i) 
-	Display->bmp.buf[i] = (~Display->colour) & 0xFF;
+    uint64_t start = clock_now_us();
+    if (write_ram_window(Display->Bus, frame, Display->bmp.phys_width,
+			 xmin, xmax, ymin, ymax))
+	goto out;
+    display_time(Display, PHASE_UPLOAD, start);
 
-    log_debug("Buffer cleared (%zuB of %zuB).",
-	      i, Display->bmp.buflen);
+    start = clock_now_us();
+    if (load_display_from_ram(Display->Bus, &Display->busy_us))
+	goto out;
+    display_time(Display, PHASE_BUSY, start);
 
-    return;
+    /* The controller alternates between two RAM buffers, bring the
+       other one up to date for the next partial refresh */
+    start = clock_now_us();
+    if (write_ram_window(Display->Bus, frame, Display->bmp.phys_width,
+			 xmin, xmax, ymin, ymax))
+	goto out;
+    display_time(Display, PHASE_UPLOAD, start);
+
+    struct dirty Window = { xmin / 8, xmax / 8, ymin, ymax };
+    bitmap_update_shadow(Display, frame, &Window);
+    ++Display->partial_count;
+    ++Display->stats.partial_refreshes;
+    log_info("Display partially refreshed (%zupx window).", area);
+    finish_refresh(Display);
+    display_time(Display, PHASE_REFRESH, begin);
+
+    return 0;
+ out:
+    log_err("Failed to partially refresh display.");
+    return 1;
 }
 
-/* Toggles all pixels in a straight line from (x,y) to (x,y). Returns
-   0 on success or 1 and sets errno to ECANCELLED if the coordiantes
-   are identical. */
+/* Refresh the display with frame, transmitting only what differs from
+   the last frame sent. Nothing is done if the frames are identical.
+   In FULL_REFRESH mode, a device kept initialised only receives the
+   changed rows, as the rest of its RAM is already up to date. In
+   PARTIAL_REFRESH mode the bounding window of the changes is
+   refreshed. Returns non-zero on failure. */
 static int
-bitmap_draw_line(struct Epd *Display,
-		 size_t x1, size_t y1, size_t x2, size_t y2)
+refresh_changes(struct Epd *Display, const uint8_t *frame)
 {
-    log_debug("Drawing line from (%zu,%zu) to (%zu,%zu).",
-	      x1, y1, x2, y2);
-
-    // bug? is float always big enough?
+    struct dirty Dirty;
 
-    float dx = (float)x2 - x1;
-    float dy = (float)y2 - y1;
-    log_debug("dx == %0.2f, dy == %0.2f", dx, dy);
+    display_check_reset(Display);
+    if (!Display->bmp.shadow_valid)
+	return refresh_frame(Display, frame);
 
-    if (dx == 0 && dy == 0) {
-	errno = ECANCELED;
-	log_warn("Cannot draw line, coordinates are identical.");
-	return 1;
+    if (!bitmap_diff(Display, frame, &Dirty)) {
+	++Display->stats.skipped_refreshes;
+	log_info("Frame unchanged, skipping refresh.");
+	return 0;
+    }
+    log_debug("Changed bytes %zu-%zu, rows %zu-%zu.",
+	      Dirty.xmin, Dirty.xmax, Dirty.ymin, Dirty.ymax);
+
+    if (Display->refresh_mode == PARTIAL_REFRESH) {
+	size_t xmax = (Dirty.xmax * 8) + 7;
+	if (xmax >= Display->phys_width)
+	    xmax = Display->phys_width - 1;
+	return refresh_window(Display, frame, Dirty.xmin * 8, xmax,
+			      Dirty.ymin, Dirty.ymax);
     }
 
-    /* For maximum resolution, line should be calculated with respect
-       to the greatest dimension (height) */
+    if (!Display->poweron || Display->lut != LUT_FULL)
+	return refresh_frame(Display, frame);
 
-    size_t x, y;
-    float m = (dx == 0) ? 0 : dy / dx; /* protects against inf */
-    float c = y2 - (m * x2);
+    /* Warm device, the RAM outside the changed rows is current */
+    uint64_t begin = clock_now_us();
+    if (set_display_window(Display->Bus, Display, NULL)
+	|| write_ram_rows(Display->Bus, frame, Display->bmp.phys_width,
+			  Dirty.ymin, Dirty.ymax))
+	goto out;
+    display_time(Display, PHASE_UPLOAD, begin);
+
+    uint64_t start = clock_now_us();
+    if (load_display_from_ram(Display->Bus, &Display->busy_us))
+	goto out;
+    display_time(Display, PHASE_BUSY, start);
+
+    start = clock_now_us();
+    bus_delay(Display->Bus, 500);
+    display_time(Display, PHASE_SETTLE, start);
+
+    Dirty.xmin = 0;
+    Dirty.xmax = Display->bmp.phys_width - 1;
+    bitmap_update_shadow(Display, frame, &Dirty);
+    Display->partial_count = 0;
+    ++Display->stats.full_refreshes;
+    log_info("Display refreshed (rows %zu-%zu sent).",
+	     Dirty.ymin, Dirty.ymax);
+    finish_refresh(Display);
+    display_time(Display, PHASE_REFRESH, begin);
 
-    if (dx == 0) { 		/* vertical line */
-	for (y =  fminf(y1, y2); y <= fmaxf(y1, y2); ++y) {
-	    x = x1;
-	    EPD_set_px(Display, x, y);
-	}
-    } else if (dy == 0) {	/* horizontal line */
-	for (x =  fminf(x1, x2); x <= fmaxf(x1, x2); ++x) {
-	    y = y1;
-	    EPD_set_px(Display, x, y);
-	}
-    } else if (Display->width >= Display->height) {
-	for (x =  fminf(x1, x2); x <= fmaxf(x1, x2); ++x) {
-	    y = (size_t)roundf((m * x) + c);
-	    EPD_set_px(Display, x, y);
-	}
-    } else {
-	for (y =  fminf(y1, y2); y <= fmaxf(y1, y2); ++y) {
-	    x = (size_t)roundf((y - c) / m );
-	    EPD_set_px(Display, x, y);
-	}
-    }
-	    
     return 0;
+ out:
+    log_err("Failed to refresh display.");
+    return 1;
 }
 
-/**
- ** Interface functions
- **/
-
-/* Create an object representing the e-paper display */
-struct Epd *
-EPD_create(size_t width, size_t height)
+/* Send device into deep sleep */
+static void
+display_sleep(struct Epd *Display)
 {
-    if (initialise_gpio())
-	goto out1;
-
-    struct Epd *Display = malloc(sizeof *Display);
-    if (!Display) {
-	log_err("Memory error.");
-	goto out1;
-    } 
-    log_debug("Allocated %zuB for EPD object", sizeof *Display);
+    if (0 == Display->poweron) {
+	log_debug("Display is already asleep, doing nothing.");
+	return;
+    }
 
+    uint64_t start = clock_now_us();
+    if (sleep_epd(Display->Bus)) {
+	log_err("Failed to sleep device");
+	return;
+    }
+    display_time(Display, PHASE_SLEEP, start);
 
-    Display->width = width;
-    Display->height = height;
-    Display->poweron = 0;
+    display_slept(Display);
 
-    if (create_signal_handler())
-	goto out2;
-    if (initialise_epd(Display))
-	goto out2;
-    if (bitmap_alloc(Display))
-	goto out2;
+    return;
+}
 
-    EPD_sleep(Display);
+/* Record the time since start against phase */
+static void
+display_time(struct Epd *Display, enum EPD_PHASE phase, uint64_t start)
+{
+    STATS_record(&Display->stats.phase[phase], clock_now_us() - start);
+    return;
+}
 
-    /* Set some defaults */
-    EPD_set_fgcolour(Display, BLACK);
-    EPD_set_write_mode(Display, FGMODE);
+/* Record that the device has been sent into deep sleep */
+static void
+display_slept(struct Epd *Display)
+{
+    Display->poweron = 0;
+    Display->lut = LUT_NONE;
+    log_info("E-paper display sleeping");
+    stop_signal_handler();
 
-    if (EPD_clear(Display))
-	goto out3;
+    return;
+}
 
-    delay(500);			/* wiringPi delay */
+/* The reset line of backend's pin, shared with any display already
+   wired to it. Returns NULL on memory error. */
+static struct RstLine *
+rst_line_get(enum EPD_BACKEND backend, int pin)
+{
+    struct RstLine *Rst;
+
+    pthread_mutex_lock(&rst_lock);
+    for (Rst = rst_lines; Rst; Rst = Rst->Next)
+	if (Rst->backend == backend && Rst->pin == pin)
+	    break;
+
+    if (Rst) {
+	++Rst->refs;
+    } else if ((Rst = calloc(1, sizeof *Rst)) != NULL) {
+	Rst->backend = backend;
+	Rst->pin = pin;
+	Rst->refs = 1;
+	Rst->Next = rst_lines;
+	rst_lines = Rst;
+    } else {
+	log_err("Memory error.");
+    }
+    pthread_mutex_unlock(&rst_lock);
 
-    return Display;
- out3:
-    free(Display->bmp.buf);
- out2:
-    free(Display);
- out1:
-    errno = ECANCELED;
-    log_err("Failed to create e-paper display object");
-    return NULL;
+    return Rst;
 }
 
-/* Free all memory in e-paper display object and power down the
-   device */
-void
-EPD_destroy(struct Epd *Display)
+/* Drop a display's reference to its reset line */
+static void
+rst_line_put(struct RstLine *Rst)
 {
-    if (!Display) {
-	log_warn("Attempted to destroy invalid object");
+    if (NULL == Rst)
 	return;
-    }
 
-    EPD_sleep(Display);
-    
-    if (Display->bmp.buf != NULL) {
-	free(Display->bmp.buf);
-	Display->bmp.buf = NULL;
-    } else {
-	log_debug("No bitmap buffer to free");
+    pthread_mutex_lock(&rst_lock);
+    if (--Rst->refs == 0) {
+	struct RstLine **Link = &rst_lines;
+	while (*Link != Rst)
+	    Link = &(*Link)->Next;
+	*Link = Rst->Next;
+	free(Rst);
     }
+    pthread_mutex_unlock(&rst_lock);
 
-    if (Display) {
-	free(Display);
-	Display = NULL;
-    } else {
-	log_debug("No display object to free");
+    return;
+}
+
+/* Count one pulse on the reset line of each of the n displays, which
+   were reset together, and record that they have seen it */
+static void
+rst_line_pulsed(struct Epd **Displays, size_t n)
+{
+    pthread_mutex_lock(&rst_lock);
+    for (size_t i = 0; i < n; ++i) {
+	size_t j = 0;
+	while (j < i && Displays[j]->Rst != Displays[i]->Rst)
+	    ++j;
+	if (j == i)
+	    ++Displays[i]->Rst->resets;
     }
+    for (size_t i = 0; i < n; ++i)
+	Displays[i]->rst_seen = Displays[i]->Rst->resets;
+    pthread_mutex_unlock(&rst_lock);
 
-    log_debug("Display object cleanup complete");
-    
     return;
 }
-  
-/* Send device into deep sleep */
-void
-EPD_sleep(struct Epd *Display)
+
+/* Forget the controller state of a display reset through a line it
+   shares since its own reset, it must be configured again. Called
+   with io_lock held. */
+static void
+display_check_reset(struct Epd *Display)
 {
-    if (0 == Display->poweron) {
-	log_debug("Display is already asleep, doing nothing.");
+    if (!Display->poweron || NULL == Display->Rst)
 	return;
+
+    pthread_mutex_lock(&rst_lock);
+    int reset = (Display->rst_seen != Display->Rst->resets);
+    pthread_mutex_unlock(&rst_lock);
+
+    if (reset) {
+	log_info("Controller reset through a shared RST line.");
+	display_slept(Display);
     }
 
-    if (wait_while_busy() < 0) {
-	errno = EBUSY;
-	log_err("Failed to sleep device");
-	return;
+    return;
+}
+
+/* Add Display to the registry, setting up the exit handler on first
+   use */
+static void
+registry_add(struct Epd *Display)
+{
+    pthread_once(&registry_once, registry_setup);
+
+    pthread_mutex_lock(&registry_lock);
+    Display->Next = registry;
+    registry = Display;
+    pthread_mutex_unlock(&registry_lock);
+
+    return;
+}
+
+static void
+registry_remove(struct Epd *Display)
+{
+    pthread_mutex_lock(&registry_lock);
+    for (struct Epd **Link = &registry; *Link; Link = &(*Link)->Next) {
+	if (*Link == Display) {
+	    *Link = Display->Next;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    return;
+}
+
+static void
+registry_setup(void)
+{
+    if (atexit(registry_at_exit))
+	log_warn("Displays will not be put to sleep at exit.");
+
+    return;
+}
+
+/* Put every live display into deep sleep before the process exits */
+static void
+registry_at_exit(void)
+{
+    pthread_mutex_lock(&registry_lock);
+    for (struct Epd *Display = registry; Display; Display = Display->Next)
+	EPD_sleep(Display);
+    pthread_mutex_unlock(&registry_lock);
+
+    return;
+}
+
+/* Refresh from the worker thread, taking the device lock */
+static int
+worker_refresh(EPD Display, const uint8_t *frame)
+{
+    if (Display->Panels != NULL)
+	return wall_refresh(Display, frame, 0, 0,
+			    Display->width, Display->height, 1);
+
+    pthread_mutex_lock(&Display->io_lock);
+    int rc = refresh_changes(Display, orient_frame(Display, frame));
+    pthread_mutex_unlock(&Display->io_lock);
+
+    return rc;
+}
+
+/* The panel frame for the canvas frame, turned into bmp.phys unless
+   the orientation leaves it unchanged. Called with io_lock held. */
+static const uint8_t *
+orient_frame(struct Epd *Display, const uint8_t *frame)
+{
+    if (!Display->orient_ops)
+	return frame;
+
+    struct RasterBuf Phys = { .buf = Display->bmp.phys,
+			      .stride = Display->bmp.phys_width,
+			      .width = Display->phys_width,
+			      .height = Display->phys_height };
+    RASTER_orient(&Phys, frame, Display->bmp.width, Display->orient_ops);
+
+    return Display->bmp.phys;
+}
+
+/* Map the canvas area w by h from (x, y) to the area it covers on the
+   panel */
+static void
+orient_area(struct Epd *Display, size_t *x, size_t *y, size_t *w, size_t *h)
+{
+    const int ops = Display->orient_ops;
+
+    if (ops & RASTER_FLIP_X)
+	*x = Display->width - *x - *w;
+    if (ops & RASTER_FLIP_Y)
+	*y = Display->height - *y - *h;
+    if (ops & RASTER_TRANSPOSE) {
+	size_t t = *x;
+	*x = *y;
+	*y = t;
+	t = *w;
+	*w = *h;
+	*h = t;
+    }
+
+    return;
+}
+
+/* A panel's share of a wall refresh, the area is in panel
+   coordinates */
+struct panel_job {
+    struct Epd *Panel;
+    size_t x, y, w, h;
+    int whole;			/* Refresh any change to the panel */
+    int rc;
+};
+
+/* Refresh one panel of a wall */
+static void *
+panel_run(void *data)
+{
+    struct panel_job *Job = data;
+
+    if (Job->whole)
+	Job->rc = EPD_refresh(Job->Panel);
+    else
+	Job->rc = EPD_refresh_area(Job->Panel, Job->x, Job->y,
+				   Job->w, Job->h);
+
+    return NULL;
+}
+
+/* Copy panel n's tile of the wall frame into the panel's front
+   buffer */
+static void
+wall_split(struct Epd *Wall, const uint8_t *frame, size_t n)
+{
+    struct Epd *Panel = Wall->Panels[n];
+    const size_t stride = Panel->bmp.width;
+    const uint8_t *tile = frame
+	+ ((n / Wall->cols) * Panel->height * Wall->bmp.width)
+	+ ((n % Wall->cols) * stride);
+
+    pthread_mutex_lock(&Panel->front_lock);
+    for (size_t y = 0; y < Panel->height; ++y)
+	memcpy(Panel->bmp.front + (y * stride),
+	       tile + (y * Wall->bmp.width), stride);
+    pthread_mutex_unlock(&Panel->front_lock);
+
+    return;
+}
+
+/* Split frame into every panel and refresh them through the bus
+   scheduler. Returns non-zero if any panel failed. */
+static int
+wall_refresh_shared(struct Epd *Wall, const uint8_t *frame)
+{
+    for (size_t n = 0; n < Wall->npanels; ++n)
+	wall_split(Wall, frame, n);
+
+    pthread_mutex_lock(&Wall->io_lock);
+    int rc = EPD_refresh_shared(Wall->Panels, Wall->npanels,
+				&Wall->bus_stats, NULL);
+    pthread_mutex_unlock(&Wall->io_lock);
+
+    return rc;
+}
+
+/* Split frame into the panels covering the area w by h from (x, y)
+   and refresh them concurrently, one thread per panel. With whole set
+   each panel refreshes whatever changed, otherwise only its part of
+   the area. Panels on a shared bus are refreshed one after another
+   under the wall's io_lock, as their DC and RST lines may be common.
+   Returns non-zero if any panel failed. */
+static int
+wall_refresh(struct Epd *Wall, const uint8_t *frame,
+	     size_t x, size_t y, size_t w, size_t h, int whole)
+{
+    const int shared = Wall->shared_bus;
+
+    if (whole && shared)
+	return wall_refresh_shared(Wall, frame);
+
+    struct panel_job *Jobs = calloc(Wall->npanels, sizeof *Jobs);
+    pthread_t *threads = calloc(Wall->npanels, sizeof *threads);
+    int *started = calloc(Wall->npanels, sizeof *started);
+    int rc = 0;
+
+    if (NULL == Jobs || NULL == threads || NULL == started) {
+	log_err("Memory error.");
+	rc = 1;
+	goto out;
+    }
+
+    if (shared)
+	pthread_mutex_lock(&Wall->io_lock);
+    for (size_t n = 0; n < Wall->npanels; ++n) {
+	struct Epd *Panel = Wall->Panels[n];
+	size_t px = (n % Wall->cols) * Panel->width;
+	size_t py = (n / Wall->cols) * Panel->height;
+
+	/* Intersect the area with the panel */
+	size_t x0 = (x > px) ? x : px;
+	size_t y0 = (y > py) ? y : py;
+	size_t x1 = (x + w < px + Panel->width) ? x + w : px + Panel->width;
+	size_t y1 = (y + h < py + Panel->height) ? y + h : py + Panel->height;
+	if (x0 >= x1 || y0 >= y1)
+	    continue;
+
+	wall_split(Wall, frame, n);
+	Jobs[n] = (struct panel_job){ .Panel = Panel,
+				      .x = x0 - px, .y = y0 - py,
+				      .w = x1 - x0, .h = y1 - y0,
+				      .whole = whole };
+
+	if (shared) {
+	    panel_run(&Jobs[n]);
+	} else if (pthread_create(&threads[n], NULL, panel_run,
+				  &Jobs[n]) == 0) {
+	    started[n] = 1;
+	} else {
+	    log_warn("Refreshing panel %zu in the calling thread.", n);
+	    panel_run(&Jobs[n]);
+	}
+    }
+    if (shared)
+	pthread_mutex_unlock(&Wall->io_lock);
+
+    for (size_t n = 0; n < Wall->npanels; ++n) {
+	if (started[n])
+	    pthread_join(threads[n], NULL);
+	if (Jobs[n].rc) {
+	    log_err("Panel %zu failed to refresh.", n);
+	    rc = 1;
+	}
+    }
+
+ out:
+    free(started);
+    free(threads);
+    free(Jobs);
+    return rc;
+}
+
+/* Stores image buffer large enough to store binary data for each
+   pixel in the e-paper display in the e-paper display object. Returns
+   0 on success or 1 on memory error. */
+static int
+bitmap_alloc(struct Epd *Display)
+{
+    /* A bit can characterise one pixel, so one byte can represent 8
+       pixels across the width (x axis). This is multiplied by the
+       number of pixels in the height (y axis) to determine the number of
+       bytes required to describe the entire e-paper display area.  */
+
+    Display->bmp.width = (Display->width % 8 == 0)
+	? Display->width / 8
+	: Display->width / 8 + 1;
+
+    Display->bmp.phys_width = Display->bmp.width;
+    Display->bmp.buflen = Display->bmp.width * Display->height;
+
+    Display->bmp.buf = calloc(Display->bmp.buflen, sizeof *Display->bmp.buf);
+    if (Display->bmp.buf == NULL) {
+	log_err("Memory error.");
+	return 1;
+    }
+
+    Display->bmp.front = calloc(Display->bmp.buflen,
+				sizeof *Display->bmp.front);
+    Display->bmp.shadow = calloc(Display->bmp.buflen,
+				 sizeof *Display->bmp.shadow);
+    if (Display->bmp.front == NULL || Display->bmp.shadow == NULL) {
+	log_err("Memory error.");
+	free(Display->bmp.shadow);
+	free(Display->bmp.front);
+	free(Display->bmp.buf);
+	Display->bmp.buf = NULL;
+	Display->bmp.front = NULL;
+	Display->bmp.shadow = NULL;
+	return 1;
+    }
+    Display->bmp.shadow_valid = 0;
+
+    log_debug("Allocated 3x %zuB for back, front and shadow buffers.",
+	      (sizeof *Display->bmp.buf) * Display->bmp.buflen);
+
+    return 0;
+}
+
+/* Write a whole frame to e-paper RAM in a single stream */
+static void
+bitmap_write_to_ram(struct Epd *Display, const uint8_t *frame)
+{
+    if (write_ram_frame(Display->Bus, frame, Display->bmp.buflen))
+	log_err("Failed to write bitmap to RAM.");
+
+    if (LOGLEVEL == 3) {
+	EPD_print_bmp(Display);
+    }
+  
+    return;
+}
+
+/* Compare frame with the shadow of the controller RAM a word at a
+   time, storing the bounds of the bytes that differ in Dirty. Returns
+   zero if the frames are identical. */
+static int
+bitmap_diff(struct Epd *Display, const uint8_t *frame, struct dirty *Dirty)
+{
+    const size_t stride = Display->bmp.phys_width;
+    int changed = 0;
+
+    Dirty->xmin = stride;
+    Dirty->xmax = 0;
+
+    for (size_t y = 0; y < Display->phys_height; ++y) {
+	const uint8_t *a = frame + (y * stride);
+	const uint8_t *b = Display->bmp.shadow + (y * stride);
+	size_t first = stride, last = 0;
+
+	for (size_t i = 0; i < stride; i += sizeof (uint64_t)) {
+	    size_t n = stride - i;
+	    if (n >= sizeof (uint64_t)) {
+		uint64_t wa, wb;
+		memcpy(&wa, a + i, sizeof wa);
+		memcpy(&wb, b + i, sizeof wb);
+		if (wa == wb)
+		    continue;
+		n = sizeof (uint64_t);
+	    }
+
+	    /* Locate the differing bytes within the word */
+	    for (size_t j = i; j < i + n; ++j) {
+		if (a[j] != b[j]) {
+		    if (j < first)
+			first = j;
+		    last = j;
+		}
+	    }
+	}
+
+	if (first == stride)
+	    continue;
+
+	if (!changed)
+	    Dirty->ymin = y;
+	Dirty->ymax = y;
+	if (first < Dirty->xmin)
+	    Dirty->xmin = first;
+	if (last > Dirty->xmax)
+	    Dirty->xmax = last;
+	changed = 1;
+    }
+
+    return changed;
+}
+
+/* Record the bytes of frame within Dirty (or all of frame when Dirty
+   is NULL) as transmitted to the controller */
+static void
+bitmap_update_shadow(struct Epd *Display, const uint8_t *frame,
+		     const struct dirty *Dirty)
+{
+    if (Dirty == NULL) {
+	memcpy(Display->bmp.shadow, frame, Display->bmp.buflen);
+	Display->bmp.shadow_valid = 1;
+	return;
+    }
+
+    size_t len = Dirty->xmax - Dirty->xmin + 1;
+    for (size_t y = Dirty->ymin; y <= Dirty->ymax; ++y) {
+	size_t addr = (y * Display->bmp.phys_width) + Dirty->xmin;
+	memcpy(Display->bmp.shadow + addr, frame + addr, len);
+    }
+
+    return;
+}
+
+/* Set specified bit number n to 1 */
+static void
+bitmap_set_px(uint8_t *byte, uint8_t n)
+{
+    *byte |= 0x80 >> n;
+    return;
+}
+
+/* Set sepecified bit number n to 0 */
+static void
+bitmap_unset_px(uint8_t *byte, uint8_t n)
+{
+    *byte &= ~(0x80 >> n);
+    return;
+}
+
+/* Flip specified bit number */
+static void
+bitmap_flip_px(uint8_t *byte, uint8_t n)
+{
+    *byte ^= 0x80 >> n;
+    return;
+}
+
+/* Set each bit in the bitmap to the background colour (background
+   colour is the inverse of the draw colour stored in E-paper display
+   object */
+static void
+bitmap_clear(struct Epd *Display)
+{
+    size_t i;
+
+    for (i = 0; i < Display->bmp.buflen; ++i) 
+	Display->bmp.buf[i] = (~Display->colour) & 0xFF;
+
+    log_debug("Buffer cleared (%zuB of %zuB).",
+	      i, Display->bmp.buflen);
+
+    return;
+}
+
+/* Bit operation applied by the write mode and colour, 0 bits are
+   black */
+static enum BITMAP_OP
+bitmap_op(struct Epd *Display)
+{
+    switch (Display->write_mode) {
+    case FGMODE:
+	return (Display->colour == WHITE) ? OP_SET : OP_UNSET;
+    case BGMODE:
+	return (Display->colour == BLACK) ? OP_SET : OP_UNSET;
+    case TOGGLEMODE:
+    default:
+	return OP_FLIP;
+    }
+}
+
+/* The back buffer as a raster */
+static struct RasterBuf
+bitmap_raster(struct Epd *Display)
+{
+    return (struct RasterBuf){ .buf = Display->bmp.buf,
+			       .stride = Display->bmp.width,
+			       .width = Display->width,
+			       .height = Display->height };
+}
+
+/* Apply op to the pixels x0 to x1 (inclusive) of row y */
+static void
+bitmap_span(struct Epd *Display, enum BITMAP_OP op,
+	    size_t x0, size_t x1, size_t y)
+{
+    const struct RasterBuf Dst = bitmap_raster(Display);
+
+    Display->pixels += RASTER_span(&Dst, op, NULL, x0, x1, y);
+
+    return;
+}
+
+/* Draw a straight line from (x1,y1) to (x2,y2) inclusive in the write
+   mode, using integer Bresenham stepping along the line's major axis.
+   Consecutive pixels on one row are filled as a single span. Returns
+   0 on success or 1 and sets errno to ECANCELED if the coordinates
+   are identical, or EINVAL if either is off the canvas. */
+static int
+bitmap_draw_line(struct Epd *Display,
+		 size_t x1, size_t y1, size_t x2, size_t y2)
+{
+    log_debug("Drawing line from (%zu,%zu) to (%zu,%zu).",
+	      x1, y1, x2, y2);
+
+    if (x1 == x2 && y1 == y2) {
+	errno = ECANCELED;
+	log_warn("Cannot draw line, coordinates are identical.");
+	return 1;
+    }
+    if (x1 >= Display->width || x2 >= Display->width
+	|| y1 >= Display->height || y2 >= Display->height) {
+	errno = EINVAL;
+	log_err("Invalid coordinates, must be within %zupxW x %zupxH.",
+		Display->width, Display->height);
+	return 1;
+    }
+
+    enum BITMAP_OP op = bitmap_op(Display);
+
+    /* Walk left to right so each row's run is a rising span */
+    if (x1 > x2) {
+	size_t t = x1; x1 = x2; x2 = t;
+	t = y1; y1 = y2; y2 = t;
+    }
+
+    long dx = (long)(x2 - x1);
+    long dy = (y2 > y1) ? (long)(y1 - y2) : (long)(y2 - y1); /* -|dy| */
+    int sy = (y2 > y1) ? 1 : -1;
+    long err = dx + dy;
+
+    /* Steep lines have one pixel per row, stepped along by address */
+    if (-dy >= dx) {
+	uint8_t *p = Display->bmp.buf + (Display->bmp.width * y1) + (x1 / 8);
+	ptrdiff_t row = (ptrdiff_t)Display->bmp.width * sy;
+	uint8_t mask = 0x80 >> (x1 % 8);
+
+	for (long n = -dy; n >= 0; --n) {
+	    switch (op) {
+	    case OP_SET: *p |= mask;
+		break;
+	    case OP_UNSET: *p &= ~mask;
+		break;
+	    case OP_FLIP: *p ^= mask;
+		break;
+	    }
+
+	    long e2 = 2 * err;
+	    if (e2 >= dy) {
+		err += dy;
+		if (!(mask >>= 1)) {
+		    mask = 0x80;
+		    ++p;
+		}
+	    }
+	    err += dx;		/* Always steps in y */
+	    p += row;
+	}
+	Display->pixels += 1 - dy;
+
+	return 0;
+    }
+
+    size_t x = x1, y = y1, run = x1; /* run starts the current span */
+
+    while (x != x2 || y != y2) {
+	long e2 = 2 * err;
+	size_t nx = x;
+
+	if (e2 >= dy) {
+	    err += dy;
+	    ++nx;
+	}
+	if (e2 <= dx) {		/* Leaving the row, flush its span */
+	    err += dx;
+	    bitmap_span(Display, op, run, x, y);
+	    y += sy;
+	    run = nx;
+	}
+	x = nx;
+    }
+    bitmap_span(Display, op, run, x, y);
+
+    return 0;
+}
+
+/**
+ ** Interface functions
+ **/
+
+/* Fill Config with the wiring of the Waveshare HAT on the default
+   backend */
+void
+EPD_default_config(struct EPD_CONFIG *Config)
+{
+    Config->backend = DEFAULT_BACKEND;
+    Config->channel = PI_CHANNEL;
+    Config->speed_hz = SPI_CLK_HZ;
+    Config->rst_pin = RST_PIN;
+    Config->dc_pin = DC_PIN;
+    Config->cs_pin = CS_PIN;
+    Config->busy_pin = BUSY_PIN;
+
+    return;
+}
+
+/* Create an object representing the e-paper display using the
+   default backend */
+struct Epd *
+EPD_create(size_t width, size_t height)
+{
+    return EPD_create_backend(width, height, DEFAULT_BACKEND);
+}
+
+/* Create an object representing the e-paper display, driven through
+   the provided transport backend */
+struct Epd *
+EPD_create_backend(size_t width, size_t height, enum EPD_BACKEND backend)
+{
+    struct EPD_CONFIG Config;
+
+    EPD_default_config(&Config);
+    Config.backend = backend;
+
+    return EPD_create_config(width, height, &Config);
+}
+
+/* Create an object representing an e-paper display wired as described
+   by Config */
+struct Epd *
+EPD_create_config(size_t width, size_t height,
+		  const struct EPD_CONFIG *Config)
+{
+    struct Epd *Display = malloc(sizeof *Display);
+    if (!Display) {
+	log_err("Memory error.");
+	goto out1;
+    } 
+    log_debug("Allocated %zuB for EPD object", sizeof *Display);
+
+    initialise_fields(Display, width, height);
+
+    if (initialise_gpio(Display, Config))
+	goto out2;
+    if (create_signal_handler())
+	goto out3;
+    if (initialise_epd(Display))
+	goto out3;
+    if (bitmap_alloc(Display))
+	goto out3;
+
+    EPD_sleep(Display);
+
+    /* Set some defaults */
+    EPD_set_fgcolour(Display, BLACK);
+    EPD_set_write_mode(Display, FGMODE);
+
+    if (EPD_clear(Display))
+	goto out3;
+
+    bus_delay(Display->Bus, 500);
+    registry_add(Display);
+
+    return Display;
+ out3:
+    EPD_sleep(Display);
+    free(Display->bmp.buf);
+    free(Display->bmp.front);
+    free(Display->bmp.shadow);
+    rst_line_put(Display->Rst);
+    TRANSPORT_destroy(Display->Bus);
+ out2:
+    pthread_cond_destroy(&Display->idle_cond);
+    pthread_mutex_destroy(&Display->front_lock);
+    pthread_mutex_destroy(&Display->io_lock);
+    free(Display);
+ out1:
+    errno = ECANCELED;
+    log_err("Failed to create e-paper display object");
+    return NULL;
+}
+
+/* Create a canvas of cols x rows panels of panel_width by
+   panel_height pixels. configs holds one entry per panel, row by row
+   from the top left. The panel width must be a whole number of
+   bytes. */
+struct Epd *
+EPD_create_wall(size_t panel_width, size_t panel_height,
+		size_t cols, size_t rows, const struct EPD_CONFIG *configs)
+{
+    if (cols == 0 || rows == 0 || panel_width % 8 != 0) {
+	errno = EINVAL;
+	log_err("Invalid wall, panel width must be a multiple of 8.");
+	return NULL;
+    }
+
+    struct Epd *Wall = malloc(sizeof *Wall);
+    if (!Wall) {
+	log_err("Memory error.");
+	goto out1;
+    }
+    initialise_fields(Wall, panel_width * cols, panel_height * rows);
+    Wall->cols = cols;
+
+    Wall->Panels = calloc(cols * rows, sizeof *Wall->Panels);
+    if (NULL == Wall->Panels || bitmap_alloc(Wall)) {
+	log_err("Memory error.");
+	goto out2;
+    }
+
+    for (size_t n = 0; n < cols * rows; ++n) {
+	Wall->Panels[n] = EPD_create_config(panel_width, panel_height,
+					    &configs[n]);
+	if (NULL == Wall->Panels[n]) {
+	    log_err("Failed to create panel %zu.", n);
+	    goto out2;
+	}
+	Wall->Panels[n]->in_wall = 1;
+	++Wall->npanels;
+    }
+
+    EPD_set_fgcolour(Wall, BLACK);
+    EPD_set_write_mode(Wall, FGMODE);
+
+    /* The panels were cleared as they were created */
+    bitmap_clear(Wall);
+    EPD_swap(Wall);
+    bitmap_clear(Wall);
+
+    log_info("Wall of %zux%zu panels (%zupxW x %zupxH).",
+	     cols, rows, Wall->width, Wall->height);
+
+    return Wall;
+ out2:
+    EPD_destroy(Wall);
+ out1:
+    errno = ECANCELED;
+    log_err("Failed to create e-paper wall object");
+    return NULL;
+}
+
+/* Free all memory in e-paper display object and power down the
+   device */
+void
+EPD_destroy(struct Epd *Display)
+{
+    if (!Display) {
+	log_warn("Attempted to destroy invalid object");
+	return;
+    }
+
+    registry_remove(Display);
+
+    /* Lets the worker finish any pending frame */
+    if (Display->Worker != NULL) {
+	WORKER_destroy(Display->Worker);
+	Display->Worker = NULL;
+    }
+
+    if (Display->idle_running) {
+	pthread_mutex_lock(&Display->io_lock);
+	Display->idle_stop = 1;
+	pthread_cond_signal(&Display->idle_cond);
+	pthread_mutex_unlock(&Display->io_lock);
+	pthread_join(Display->idle_thread, NULL);
+	Display->idle_running = 0;
+    }
+
+    EPD_sleep(Display);
+
+    for (size_t n = 0; n < Display->npanels; ++n)
+	EPD_destroy(Display->Panels[n]);
+    free(Display->Panels);
+    Display->Panels = NULL;
+    
+    if (Display->bmp.buf != NULL) {
+	free(Display->bmp.buf);
+	free(Display->bmp.front);
+	free(Display->bmp.shadow);
+	free(Display->bmp.phys);
+	Display->bmp.buf = NULL;
+	Display->bmp.front = NULL;
+	Display->bmp.shadow = NULL;
+	Display->bmp.phys = NULL;
+    } else {
+	log_debug("No bitmap buffer to free");
+    }
+
+    rst_line_put(Display->Rst);
+    Display->Rst = NULL;
+    if (Display->Bus != NULL) {
+	TRANSPORT_destroy(Display->Bus);
+	Display->Bus = NULL;
+    } else {
+	log_debug("No transport to close");
+    }
+
+    pthread_cond_destroy(&Display->idle_cond);
+    pthread_mutex_destroy(&Display->front_lock);
+    pthread_mutex_destroy(&Display->io_lock);
+
+    if (Display) {
+	free(Display);
+	Display = NULL;
+    } else {
+	log_debug("No display object to free");
+    }
+
+    log_debug("Display object cleanup complete");
+    
+    return;
+}
+  
+/* Send device into deep sleep */
+void
+EPD_sleep(struct Epd *Display)
+{
+    for (size_t n = 0; n < Display->npanels; ++n)
+	EPD_sleep(Display->Panels[n]);
+
+    pthread_mutex_lock(&Display->io_lock);
+    display_sleep(Display);
+    pthread_mutex_unlock(&Display->io_lock);
+
+    return;
+}
+
+/* Keep the device initialised for ms after each refresh, so that
+   following refreshes skip the reset and LUT upload. The device is put
+   to sleep by a timer once idle for ms. Zero (the default) sleeps the
+   device straight after each refresh. */
+void
+EPD_set_idle_sleep(struct Epd *Display, unsigned int ms)
+{
+    if (Display->Panels != NULL) {
+	for (size_t n = 0; n < Display->npanels; ++n)
+	    EPD_set_idle_sleep(Display->Panels[n], ms);
+	Display->idle_ms = ms;
+	return;
+    }
+
+    pthread_mutex_lock(&Display->io_lock);
+
+    Display->idle_ms = ms;
+    if (ms > 0 && initialise_idle(Display))
+	Display->idle_ms = 0;
+
+    if (Display->idle_ms == 0) {
+	display_sleep(Display);
+    } else {			/* re-arm the timer from now */
+	Display->idle_deadline = clock_now_us()
+	    + (uint64_t)Display->idle_ms * 1000;
+	pthread_cond_signal(&Display->idle_cond);
+    }
+
+    pthread_mutex_unlock(&Display->io_lock);
+
+    if (ms > 0)
+	log_info("Device sleeps after %ums idle.", Display->idle_ms);
+    else
+	log_info("Device sleeps after each refresh.");
+
+    return;
+}
+
+/* Toggle the pixel colour at (x, y) in the bitmap */
+void
+EPD_set_px(struct Epd *Display, size_t x, size_t y)
+{
+    if (x >= Display->width || y >= Display->height) {
+	errno = EINVAL;
+	log_err("Invalid coordinates, must be within %zupxW x %zupxH.",
+		Display->width, Display->height);
+	return;
+    }
+
+    /* Convert 2D coordinates into flat array index and obtain byte of
+       interest (each byte contains the bitmap data for 8 pixels
+       across the width). */
+    size_t byte_addr = (Display->bmp.width * y) + (x / 8);
+    uint8_t *point = Display->bmp.buf + byte_addr;
+    ++Display->pixels;
+
+    switch (Display->write_mode) {
+
+    case TOGGLEMODE:
+	bitmap_flip_px(point, (x % 8) & 0xFF);
+	break;
+
+    case FGMODE:
+	if (Display->colour == WHITE)
+	    bitmap_set_px(point, (x % 8) & 0xFF);
+	else
+	    bitmap_unset_px(point, (x % 8) & 0xFF);
+	break;
+
+    case BGMODE:
+	if (Display->colour == BLACK)
+	    bitmap_set_px(point, (x % 8) & 0xFF);
+	else
+	    bitmap_unset_px(point, (x % 8) & 0xFF);
+	break;
+
+    default:			/* should not reach */
+	errno = EINVAL;
+	log_err("Invalid WRITE_MODE enum value in object!");
+    }
+    
+    return;
+}
+
+/* Draw the n points with the kernel for op, skipping those off the
+   canvas. Inlined for each op so the loop carries no mode branch.
+   Returns the number of points skipped. */
+static inline __attribute__((always_inline)) size_t
+bitmap_plot(struct Epd *Display, const struct Coordinate *Points, size_t n,
+	    const enum BITMAP_OP op)
+{
+    uint8_t *buf = Display->bmp.buf;
+    const size_t stride = Display->bmp.width;
+    const size_t width = Display->width, height = Display->height;
+    size_t skipped = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+	size_t x = Points[i].x, y = Points[i].y;
+	if (x >= width || y >= height) {
+	    ++skipped;
+	    continue;
+	}
+
+	uint8_t *p = buf + (y * stride) + (x >> 3);
+	uint8_t m = 0x80 >> (x & 7);
+	switch (op) {
+	case OP_SET: *p |= m;
+	    break;
+	case OP_UNSET: *p &= ~m;
+	    break;
+	case OP_FLIP: *p ^= m;
+	    break;
+	}
+    }
+
+    return skipped;
+}
+
+/* Draw a batch of points in the write mode, the mode is resolved once
+   for the batch. Points off the canvas are skipped, returns non-zero
+   if there were any. */
+int
+EPD_set_pixels(struct Epd *Display, const struct Coordinate *Points, size_t n)
+{
+    size_t skipped = 0;
+
+    switch (bitmap_op(Display)) {
+    case OP_SET: skipped = bitmap_plot(Display, Points, n, OP_SET);
+	break;
+    case OP_UNSET: skipped = bitmap_plot(Display, Points, n, OP_UNSET);
+	break;
+    case OP_FLIP: skipped = bitmap_plot(Display, Points, n, OP_FLIP);
+	break;
+    }
+    Display->pixels += n - skipped;
+
+    if (skipped) {
+	errno = EINVAL;
+	log_err("%zu of %zu points outside %zupxW x %zupxH.", skipped, n,
+		Display->width, Display->height);
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Combine a 1bpp bitmap into the back buffer */
+void
+EPD_blit(struct Epd *Display, const uint8_t *bitmap, size_t w, size_t h,
+	 size_t stride, long x, long y, enum EPD_ROP rop)
+{
+    const struct RasterBuf Dst = bitmap_raster(Display);
+
+    Display->pixels += RASTER_blit(&Dst, bitmap, w, h, stride, x, y, rop);
+
+    return;
+}
+
+/* Fill pattern of the display, NULL when solid */
+static const uint8_t *
+bitmap_stipple(struct Epd *Display)
+{
+    return Display->stippled ? Display->stipple : NULL;
+}
+
+void
+EPD_draw_rect(struct Epd *Display, long x, long y, long w, long h)
+{
+    const struct RasterBuf Dst = bitmap_raster(Display);
+
+    Display->pixels += RASTER_rect(&Dst, bitmap_op(Display), NULL,
+				   x, y, w, h, 0);
+    return;
+}
+
+void
+EPD_fill_rect(struct Epd *Display, long x, long y, long w, long h)
+{
+    const struct RasterBuf Dst = bitmap_raster(Display);
+
+    Display->pixels += RASTER_rect(&Dst, bitmap_op(Display),
+				   bitmap_stipple(Display), x, y, w, h, 1);
+    return;
+}
+
+void
+EPD_draw_circle(struct Epd *Display, long cx, long cy, long r)
+{
+    EPD_draw_ellipse(Display, cx, cy, r, r);
+    return;
+}
+
+void
+EPD_fill_circle(struct Epd *Display, long cx, long cy, long r)
+{
+    EPD_fill_ellipse(Display, cx, cy, r, r);
+    return;
+}
+
+void
+EPD_draw_ellipse(struct Epd *Display, long cx, long cy, long rx, long ry)
+{
+    const struct RasterBuf Dst = bitmap_raster(Display);
+
+    Display->pixels += RASTER_ellipse(&Dst, bitmap_op(Display), NULL,
+				      cx, cy, rx, ry, 0);
+    return;
+}
+
+void
+EPD_fill_ellipse(struct Epd *Display, long cx, long cy, long rx, long ry)
+{
+    const struct RasterBuf Dst = bitmap_raster(Display);
+
+    Display->pixels += RASTER_ellipse(&Dst, bitmap_op(Display),
+				      bitmap_stipple(Display),
+				      cx, cy, rx, ry, 1);
+    return;
+}
+
+/* Fill the polygon through the coordinates of Outline, the last
+   joined back to the first. Like EPD_draw_path the path is traversed
+   from its start. Returns non-zero on failure. */
+int
+EPD_fill_polygon(struct Epd *Display, PATH Outline, enum FILL_RULE rule)
+{
+    size_t n = PATH_get_length(Outline), pixels = 0;
+    int rc = 1;
+
+    if (n < 3) {
+	errno = EINVAL;
+	log_err("Failed to fill polygon. Need at least three coordinates.");
+	return 1;
+    }
+
+    struct Coordinate *Vertices = malloc(n * sizeof *Vertices);
+    if (NULL == Vertices) {
+	log_err("Memory error.");
+	return 1;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+	struct Coordinate *Next = PATH_get_next_coordinate(Outline);
+	if (NULL == Next) {
+	    log_err("Failed to read polygon coordinate %zu.", i);
+	    goto out;
+	}
+	Vertices[i] = *Next;
+    }
+
+    const struct RasterBuf Dst = bitmap_raster(Display);
+    rc = RASTER_polygon(&Dst, bitmap_op(Display), bitmap_stipple(Display),
+			Vertices, n, rule, &pixels);
+    Display->pixels += pixels;
+ out:
+    free(Vertices);
+    return rc;
+}
+
+void
+EPD_set_font(struct Epd *Display, FONT Font)
+{
+    Display->Font = Font;
+    return;
+}
+
+/* Draw text glyph by glyph, each through the stencil kernel */
+int
+EPD_draw_text(struct Epd *Display, long x, long y, const char *text)
+{
+    if (NULL == Display->Font) {
+	errno = EINVAL;
+	log_err("No font set.");
+	return 1;
+    }
+
+    const struct RasterBuf Dst = bitmap_raster(Display);
+    enum BITMAP_OP op = bitmap_op(Display);
+    struct FontGlyph Glyph;
+    long pen = x;
+
+    while (*text) {
+	uint32_t c = FONT_utf8_next(&text);
+	if (c == '\n') {
+	    pen = x;
+	    y += FONT_HEIGHT;
+	    continue;
+	}
+	if (FONT_get_glyph(Display->Font, c, &Glyph))
+	    continue;
+
+	Display->pixels += RASTER_stencil(&Dst, op, Glyph.bitmap, Glyph.width,
+					  Glyph.height, Glyph.stride, pen, y);
+	pen += Glyph.width;
+    }
+
+    return 0;
+}
+
+void
+EPD_draw_layout(struct Epd *Display, LAYOUT Text)
+{
+    const struct RasterBuf Dst = bitmap_raster(Display);
+    enum BITMAP_OP op = bitmap_op(Display);
+    FONT Font = LAYOUT_get_font(Text);
+    struct FontGlyph Glyph;
+    size_t n;
+
+    const struct LayoutGlyph *Glyphs = LAYOUT_get_glyphs(Text, &n);
+    for (size_t i = 0; i < n; ++i) {
+	if (FONT_get_glyph(Font, Glyphs[i].codepoint, &Glyph))
+	    continue;
+	Display->pixels += RASTER_stencil(&Dst, op, Glyph.bitmap, Glyph.width,
+					  Glyph.height, Glyph.stride,
+					  Glyphs[i].x, Glyphs[i].y);
+    }
+
+    return;
+}
+
+/* Each row of the image is read scaled, dithered and copied into the
+   back buffer, so only a few rows are held at once */
+int
+EPD_draw_image(struct Epd *Display, const char *path, long x, long y,
+	       size_t w, size_t h, enum EPD_DITHER dither)
+{
+    const struct RasterBuf Dst = bitmap_raster(Display);
+    uint8_t *grey = NULL, *bits = NULL;
+    int16_t *err = NULL;
+    int rc = 1;
+
+    IMAGE Img = IMAGE_open(path);
+    if (NULL == Img)
+	return 1;
+    if (!w)
+	w = IMAGE_get_width(Img);
+    if (!h)
+	h = IMAGE_get_height(Img);
+    if (IMAGE_set_size(Img, w, h))
+	goto out;
+
+    grey = malloc(w);
+    bits = malloc((w + 7) / 8);
+    err = calloc(2 * (w + 2), sizeof *err);
+    if (NULL == grey || NULL == bits || NULL == err) {
+	log_err("Memory error.");
+	goto out;
     }
 
-    send_command_byte(DEEP_SLEEP_MODE);
-    send_data_byte(0x01);
+    /* Rows above the canvas are still read to carry their error */
+    for (size_t r = 0; r < h && y + (long)r < (long)Display->height; ++r) {
+	if (IMAGE_read_row(Img, grey))
+	    goto out;
+	RASTER_dither(bits, grey, w, r, dither, err);
+	Display->pixels += RASTER_blit(&Dst, bits, w, 1, (w + 7) / 8,
+				       x, y + (long)r, ROP_COPY);
+    }
+    rc = 0;
 
-    check_signal_handler(Display);
-    stop_signal_handler();
+ out:
+    if (rc)
+	log_err("Failed to draw image %s.", path);
+    free(err);
+    free(bits);
+    free(grey);
+    IMAGE_close(Img);
+    return rc;
+}
 
-    Display->poweron = 0;
-    log_info("E-paper display sleeping");
+/* Stipple subsequent fills with pattern, or fill solid if NULL */
+void
+EPD_set_stipple(struct Epd *Display, const uint8_t pattern[8])
+{
+    Display->stippled = (pattern != NULL);
+    if (pattern)
+	memcpy(Display->stipple, pattern, sizeof Display->stipple);
 
     return;
 }
 
-/* Toggle the pixel colour at (x, y) in the bitmap */
 void
-EPD_set_px(struct Epd *Display, size_t x, size_t y)
+EPD_grey_stipple(uint8_t pattern[8], unsigned int level)
 {
-    if (x >= Display->width || y >= Display->height) {
-	errno = EINVAL;
-	log_err("Invalid coordinates, must be within %zupxW x %zupxH.",
-		Display->width, Display->height);
-	return;
-    }
-
-    /* Convert 2D coordinates into flat array index and obtain byte of
-       interest (each byte contains the bitmap data for 8 pixels
-       across the width). */
-    size_t byte_addr = (Display->bmp.width * y) + (x / 8);
-    uint8_t *point = Display->bmp.buf + byte_addr;
-
-    switch (Display->write_mode) {
-
-    case TOGGLEMODE:
-	bitmap_flip_px(point, (x % 8) & 0xFF);
-	break;
+    RASTER_grey_stipple(pattern, level);
+    return;
+}
 
-    case FGMODE:
-	if (Display->colour == WHITE)
-	    bitmap_set_px(point, (x % 8) & 0xFF);
-	else
-	    bitmap_unset_px(point, (x % 8) & 0xFF);
-	break;
+/* Describe the back buffer and the write mode for EPD_raster_px */
+void
+EPD_get_raster(struct Epd *Display, struct EPD_RASTER *Raster)
+{
+    enum BITMAP_OP op = bitmap_op(Display);
 
-    case BGMODE:
-	if (Display->colour == BLACK)
-	    bitmap_set_px(point, (x % 8) & 0xFF);
-	else
-	    bitmap_unset_px(point, (x % 8) & 0xFF);
-	break;
+    Raster->buf = Display->bmp.buf;
+    Raster->stride = Display->bmp.width;
+    Raster->width = Display->width;
+    Raster->height = Display->height;
+    Raster->and_mask = (op == OP_FLIP) ? 0x00 : 0xFF;
+    Raster->xor_mask = (op == OP_UNSET) ? 0x00 : 0xFF;
 
-    default:			/* should not reach */
-	errno = EINVAL;
-	log_err("Invalid WRITE_MODE enum value in object!");
-    }
-    
     return;
 }
 
@@ -453,44 +1976,209 @@ int EPD_draw_path(EPD Display, PATH Route)
     return 0;
 }
 
-/* Apply transformations (according to flags), write the bitmap to ram
-   and refresh the display.  */
+/* Draw on a canvas turned clockwise by rotation and reflected by
+   flags. Each refresh turns the front buffer onto the panel a block of
+   8x8 pixels at a time, drawing is unaffected. Returns non-zero if the
+   orientation is unsupported or on memory error. */
 int
-EPD_refresh(struct Epd *Display)
+EPD_set_orientation(struct Epd *Display, enum EPD_ROTATION rotation,
+		    int flags)
 {
-    if (initialise_epd(Display)) {
-	errno = EREMOTEIO;
-	goto out;
+    /* The panel as seen from the canvas at each rotation */
+    static const int rotate_ops[] = {
+	[ROTATE_0] = 0,
+	[ROTATE_90] = RASTER_TRANSPOSE | RASTER_FLIP_Y,
+	[ROTATE_180] = RASTER_FLIP_X | RASTER_FLIP_Y,
+	[ROTATE_270] = RASTER_TRANSPOSE | RASTER_FLIP_X };
+
+    if (Display->Panels != NULL || rotation > ROTATE_270) {
+	errno = EINVAL;
+	log_err("Invalid orientation, or display is a wall.");
+	return 1;
     }
-	
-    set_display_window(Display, NULL);
-    bitmap_write_to_ram(Display);
 
-    if (load_display_from_ram()) {
-	errno = EBUSY;
-	goto out;
+    int ops = rotate_ops[rotation];
+    if (flags & EPD_MIRROR_X)
+	ops ^= RASTER_FLIP_X;
+    if (flags & EPD_MIRROR_Y)
+	ops ^= RASTER_FLIP_Y;
+    if (flags & EPD_INVERT)
+	ops |= RASTER_INVERT;
+
+    const int turn = ops & RASTER_TRANSPOSE;
+    if ((turn || (ops & RASTER_FLIP_X)) && (Display->phys_width % 8
+					    || (turn && Display->phys_height % 8))) {
+	errno = EINVAL;
+	log_err("Panel of %zupxW x %zupxH is not whole bytes across and "
+		"down.", Display->phys_width, Display->phys_height);
+	return 1;
+    }
+    if (turn && Display->in_wall) {
+	errno = EINVAL;
+	log_err("A panel of a wall cannot be turned a quarter.");
+	return 1;
     }
 
-    delay(500);
-    log_info("Display refreshed.");
-    EPD_sleep(Display);
-    
+    if (ops && NULL == Display->bmp.phys) {
+	Display->bmp.phys = calloc(Display->bmp.buflen,
+				   sizeof *Display->bmp.phys);
+	if (NULL == Display->bmp.phys) {
+	    log_err("Memory error.");
+	    return 1;
+	}
+    }
+
+    pthread_mutex_lock(&Display->front_lock);
+    pthread_mutex_lock(&Display->io_lock);
+    size_t width = turn ? Display->phys_height : Display->phys_width;
+    if (width != Display->width) {
+	/* The canvas is reshaped, start it blank */
+	Display->width = width;
+	Display->height = turn ? Display->phys_width : Display->phys_height;
+	Display->bmp.width = width / 8;
+	bitmap_clear(Display);
+	memcpy(Display->bmp.front, Display->bmp.buf, Display->bmp.buflen);
+    }
+    Display->orient_ops = ops;
+    pthread_mutex_unlock(&Display->io_lock);
+    pthread_mutex_unlock(&Display->front_lock);
+
+    log_info("Canvas turned %d degrees%s%s%s (%zupxW x %zupxH).",
+	     90 * (int)rotation, (flags & EPD_MIRROR_X) ? ", mirrored in x" : "",
+	     (flags & EPD_MIRROR_Y) ? ", mirrored in y" : "",
+	     (flags & EPD_INVERT) ? ", inverted" : "",
+	     Display->width, Display->height);
+
     return 0;
- out:
-    log_err("Failed to refresh display.");
-    return 1;
 }
 
-/* Wipe the bitmap and apply the background colour (inverse of
+/* Exchange the front and back buffers, making the frame drawn so far
+   the one transmitted by the next refresh. Only the pointers are
+   swapped: the new back buffer holds the previous front frame. Waits
+   for any refresh reading the front buffer to finish. */
+void
+EPD_swap(struct Epd *Display)
+{
+    pthread_mutex_lock(&Display->front_lock);
+    uint8_t *front = Display->bmp.front;
+    Display->bmp.front = Display->bmp.buf;
+    Display->bmp.buf = front;
+    pthread_mutex_unlock(&Display->front_lock);
+
+    return;
+}
+
+/* Turn the front buffer onto the panel by the orientation, write it
+   to ram and refresh the display.  */
+int
+EPD_refresh(struct Epd *Display)
+{
+    pthread_mutex_lock(&Display->front_lock);
+    int rc;
+    if (Display->Panels != NULL) {
+	rc = wall_refresh(Display, Display->bmp.front, 0, 0,
+			  Display->width, Display->height, 1);
+    } else {
+	pthread_mutex_lock(&Display->io_lock);
+	rc = refresh_changes(Display,
+			     orient_frame(Display, Display->bmp.front));
+	pthread_mutex_unlock(&Display->io_lock);
+    }
+    pthread_mutex_unlock(&Display->front_lock);
+
+    return rc;
+}
+
+/* Refresh the area of the display w by h pixels from (x, y). In
+   PARTIAL_REFRESH mode only this area is transmitted and the fast
+   waveform is used, see EPD_set_partial_policy. Returns non-zero on
+   failure. */
+int
+EPD_refresh_area(struct Epd *Display, size_t x, size_t y, size_t w, size_t h)
+{
+    if (w == 0 || h == 0
+	|| x + w > Display->width || y + h > Display->height) {
+	errno = EINVAL;
+	log_err("Invalid area, must be within %zupxW x %zupxH.",
+		Display->width, Display->height);
+	return 1;
+    }
+
+    pthread_mutex_lock(&Display->front_lock);
+    int rc;
+    if (Display->Panels != NULL) {
+	rc = wall_refresh(Display, Display->bmp.front, x, y, w, h, 0);
+    } else {
+	pthread_mutex_lock(&Display->io_lock);
+	orient_area(Display, &x, &y, &w, &h);
+	rc = refresh_window(Display, orient_frame(Display, Display->bmp.front),
+			    x, x + w - 1, y, y + h - 1);
+	pthread_mutex_unlock(&Display->io_lock);
+    }
+    pthread_mutex_unlock(&Display->front_lock);
+
+    return rc;
+}
+
+/* Snapshot the front buffer and queue it for refresh by the background
+   worker, returning immediately. A frame still waiting when a newer
+   one is submitted is dropped. Returns a ticket for EPD_refresh_wait,
+   or 0 on failure. */
+unsigned long
+EPD_refresh_async(struct Epd *Display)
+{
+    if (initialise_worker(Display)) {
+	log_err("Failed to queue refresh.");
+	return 0;
+    }
+
+    pthread_mutex_lock(&Display->front_lock);
+    unsigned long ticket = WORKER_submit(Display->Worker, Display->bmp.front);
+    pthread_mutex_unlock(&Display->front_lock);
+
+    return ticket;
+}
+
+/* Block until the frame with ticket, or a newer one, has been
+   refreshed. Returns non-zero if that refresh failed. */
+int
+EPD_refresh_wait(struct Epd *Display, unsigned long ticket)
+{
+    if (NULL == Display->Worker) {
+	errno = EINVAL;
+	log_err("No asynchronous refresh has been queued.");
+	return 1;
+    }
+
+    return WORKER_wait(Display->Worker, ticket);
+}
+
+/* Set a function to be called from the worker thread after each
+   asynchronous refresh, with the ticket displayed and its status. */
+void
+EPD_set_refresh_callback(struct Epd *Display, EPD_REFRESH_CB cb, void *arg)
+{
+    Display->refresh_cb = cb;
+    Display->refresh_arg = arg;
+
+    if (Display->Worker)
+	WORKER_set_callback(Display->Worker, cb, arg);
+
+    return;
+}
+
+/* Wipe both buffers and apply the background colour (inverse of
    fgcolour) to the display. Returns non zero if there is a problem
    refreshing the display.  */
 int
 EPD_clear(struct Epd *Display)
 {
-    /* For full screen usage, window display set from origin to furthest
-       possible co-ordinate */
-
+    /* The back buffer is cleared and presented, then the old front
+       frame is cleared so drawing starts from a blank canvas */
     bitmap_clear(Display);
+    EPD_swap(Display);
+    bitmap_clear(Display);
+
     return EPD_refresh(Display);
 }
 
@@ -550,10 +2238,333 @@ EPD_get_write_mode(struct Epd *Display)
     return Display->write_mode;
 }
 
+/* Set the refresh mode, PARTIAL_REFRESH only takes effect while the
+   device is kept initialised (see EPD_set_idle_sleep) */
+void
+EPD_set_refresh_mode(struct Epd *Display, enum REFRESH_MODE value)
+{
+    for (size_t n = 0; n < Display->npanels; ++n)
+	EPD_set_refresh_mode(Display->Panels[n], value);
+
+    pthread_mutex_lock(&Display->io_lock);
+    Display->refresh_mode = value;
+    pthread_mutex_unlock(&Display->io_lock);
+
+    switch (value) {
+    case FULL_REFRESH: log_info("Refresh set to full.");
+	break;
+    case PARTIAL_REFRESH: log_info("Refresh set to partial.");
+	break;
+    default:
+	errno = EINVAL;
+	log_err("Invalid refresh mode provided.");
+    }
+
+    return;
+}
+
+enum REFRESH_MODE
+EPD_get_refresh_mode(struct Epd *Display)
+{
+    return Display->refresh_mode;
+}
+
+/* Force a full refresh after full_every partial refreshes, or when a
+   partial refresh would cover more than max_area_pct percent of the
+   display. */
+void
+EPD_set_partial_policy(struct Epd *Display,
+		       unsigned int full_every, unsigned int max_area_pct)
+{
+    for (size_t n = 0; n < Display->npanels; ++n)
+	EPD_set_partial_policy(Display->Panels[n], full_every, max_area_pct);
+
+    pthread_mutex_lock(&Display->io_lock);
+    Display->full_every = full_every;
+    Display->full_area_pct = max_area_pct;
+    pthread_mutex_unlock(&Display->io_lock);
+
+    log_info("Full refresh every %u partials or above %u%% area.",
+	     full_every, max_area_pct);
+
+    return;
+}
+
+/* Non-zero while the device, or any panel of a wall, is powered */
 int
 EPD_get_poweron(struct Epd *Display)
 {
-    return Display->poweron;
+    int poweron = Display->poweron;
+
+    for (size_t n = 0; n < Display->npanels; ++n)
+	poweron |= EPD_get_poweron(Display->Panels[n]);
+
+    return poweron;
+}
+
+/* Time the display was busy applying the last refresh, measured from
+   activation to the busy pin falling. For a wall, the longest of the
+   panels. */
+long
+EPD_get_busy_us(struct Epd *Display)
+{
+    long busy_us = Display->busy_us;
+
+    for (size_t n = 0; n < Display->npanels; ++n) {
+	long panel_us = EPD_get_busy_us(Display->Panels[n]);
+	if (panel_us > busy_us)
+	    busy_us = panel_us;
+    }
+
+    return busy_us;
+}
+
+/* Order displays by address, the order their locks are taken in */
+static int
+display_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(struct Epd *const *)a;
+    uintptr_t y = (uintptr_t)*(struct Epd *const *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Refresh n displays sharing one SPI bus. Each display with a changed
+   front buffer gets a full refresh; uploads to one panel are made
+   while the others are busy. Stats and panel_stats (n entries, zero
+   for skipped displays) are filled in when not NULL. The displays are
+   locked in address order, so concurrent calls with the same displays
+   cannot deadlock. Displays wired to one RST line are reset and
+   configured together when any of them needs it. Returns non-zero if
+   any display failed or appears twice. */
+int
+EPD_refresh_shared(struct Epd **Displays, size_t n,
+		   struct EPD_BUS_STATS *Stats,
+		   struct EPD_PANEL_STATS *panel_stats)
+{
+    struct SchedJob *Jobs = calloc(n ? n : 1, sizeof *Jobs);
+    size_t *index = calloc(n ? n : 1, sizeof *index);
+    struct Epd **Locked = calloc(n ? n : 1, sizeof *Locked);
+    struct Epd **Reset = calloc(n ? n : 1, sizeof *Reset);
+    size_t njobs = 0;
+    int rc = 1;
+
+    if (NULL == Jobs || NULL == index || NULL == Locked || NULL == Reset) {
+	log_err("Memory error.");
+	goto out1;
+    }
+    for (size_t i = 0; i < n; ++i) {
+	if (Displays[i]->Panels != NULL) {
+	    errno = EINVAL;
+	    log_err("Display %zu is a wall, pass its panels.", i);
+	    goto out1;
+	}
+    }
+
+    memcpy(Locked, Displays, n * sizeof *Locked);
+    qsort(Locked, n, sizeof *Locked, display_cmp);
+    for (size_t i = 1; i < n; ++i) {
+	if (Locked[i] == Locked[i - 1]) {
+	    errno = EINVAL;
+	    log_err("A display is listed more than once.");
+	    goto out1;
+	}
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+	pthread_mutex_lock(&Locked[i]->front_lock);
+	pthread_mutex_lock(&Locked[i]->io_lock);
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+	struct Epd *Display = Displays[i];
+	struct dirty Dirty;
+
+	if (panel_stats)
+	    memset(&panel_stats[i], 0, sizeof panel_stats[i]);
+
+	display_check_reset(Display);
+	const uint8_t *frame = orient_frame(Display, Display->bmp.front);
+	if (Display->bmp.shadow_valid && !bitmap_diff(Display, frame, &Dirty))
+	    continue;
+
+	struct SchedJob *Job = &Jobs[njobs];
+	index[njobs++] = i;
+	Job->Bus = Display->Bus;
+	Job->Display = Display;
+	Job->frame = frame;
+	Job->len = Display->bmp.buflen;
+	Job->reset = !Display->poweron;
+	if (Display->poweron && Display->lut != LUT_FULL) {
+	    Job->lut = lut_full_update;
+	    Job->lut_len = sizeof lut_full_update;
+	}
+	Job->sleep = (Display->idle_ms == 0 || check_signal_handler());
+
+	if (!Display->poweron) {
+	    start_signal_handler();
+	    Display->poweron = 1;
+	}
+    }
+
+    /* The reset pulse reaches every panel on the line, so a warm panel
+       sharing it with one being reset is configured again */
+    size_t nreset = 0;
+    for (size_t j = 0; j < njobs; ++j) {
+	for (size_t k = 0; k < njobs && !Jobs[j].reset; ++k) {
+	    if (Jobs[k].reset && Displays[index[k]]->Rst
+		== Displays[index[j]]->Rst) {
+		Jobs[j].reset = 1;
+		Jobs[j].lut = NULL;
+		Jobs[j].lut_len = 0;
+		Displays[index[j]]->lut = LUT_NONE;
+	    }
+	}
+	if (Jobs[j].reset)
+	    Reset[nreset++] = Displays[index[j]];
+    }
+    if (nreset)
+	rst_line_pulsed(Reset, nreset);
+
+    rc = SCHED_run(Jobs, njobs, Stats);
+
+    for (size_t j = 0; j < njobs; ++j) {
+	struct Epd *Display = Displays[index[j]];
+
+	if (Jobs[j].rc) {
+	    Display->lut = LUT_NONE;
+	    display_sleep(Display);
+	} else {
+	    struct EPD_PANEL_STATS *P = &Jobs[j].stats;
+	    STATS_record(&Display->stats.phase[PHASE_UPLOAD], P->upload_us);
+	    STATS_record(&Display->stats.phase[PHASE_BUSY], P->busy_us);
+	    STATS_record(&Display->stats.phase[PHASE_REFRESH], P->elapsed_us);
+	    ++Display->stats.full_refreshes;
+	    Display->lut = LUT_FULL;
+	    Display->partial_count = 0;
+	    Display->busy_us = Jobs[j].stats.busy_us;
+	    bitmap_update_shadow(Display, Jobs[j].frame, NULL);
+	    if (Jobs[j].sleep)
+		display_slept(Display);
+	    else
+		finish_refresh(Display);
+	}
+
+	if (panel_stats)
+	    panel_stats[index[j]] = Jobs[j].stats;
+    }
+
+    for (size_t i = n; i-- > 0; ) {
+	pthread_mutex_unlock(&Locked[i]->io_lock);
+	pthread_mutex_unlock(&Locked[i]->front_lock);
+    }
+
+ out1:
+    free(Reset);
+    free(Locked);
+    free(index);
+    free(Jobs);
+    return rc;
+}
+
+/* Refresh the panels of Wall through the bus scheduler, for panels
+   wired to one SPI bus, and refresh areas one panel at a time.
+   Otherwise each panel is refreshed on its own thread. */
+void
+EPD_set_shared_bus(struct Epd *Wall, int shared)
+{
+    Wall->shared_bus = shared;
+    log_info("Wall panels %s.", shared ? "share one bus" : "refreshed "
+	     "independently");
+
+    return;
+}
+
+/* Throughput of the last scheduled refresh of Wall */
+void
+EPD_get_bus_stats(struct Epd *Wall, struct EPD_BUS_STATS *Stats)
+{
+    pthread_mutex_lock(&Wall->io_lock);
+    *Stats = Wall->bus_stats;
+    pthread_mutex_unlock(&Wall->io_lock);
+
+    return;
+}
+
+/* Copy the statistics of Display, or the combined statistics of the
+   panels of a wall, into Stats */
+void
+EPD_get_stats(struct Epd *Display, struct EPD_STATS *Stats)
+{
+    pthread_mutex_lock(&Display->io_lock);
+    *Stats = Display->stats;
+    if (Display->Bus) {
+	Stats->spi_bytes = Display->Bus->bytes - Display->spi_bytes_base;
+	Stats->spi_transfers = Display->Bus->transfers
+	    - Display->spi_transfers_base;
+    }
+    pthread_mutex_unlock(&Display->io_lock);
+    Stats->pixels = Display->pixels;
+
+    for (size_t n = 0; n < Display->npanels; ++n) {
+	struct EPD_STATS Panel;
+	EPD_get_stats(Display->Panels[n], &Panel);
+	Panel.pixels = 0;	/* Drawn on the wall canvas */
+	STATS_merge(Stats, &Panel);
+    }
+
+    return;
+}
+
+/* Zero the statistics of Display and any panels */
+void
+EPD_reset_stats(struct Epd *Display)
+{
+    for (size_t n = 0; n < Display->npanels; ++n)
+	EPD_reset_stats(Display->Panels[n]);
+
+    pthread_mutex_lock(&Display->io_lock);
+    memset(&Display->stats, 0, sizeof Display->stats);
+    if (Display->Bus) {
+	Display->spi_bytes_base = Display->Bus->bytes;
+	Display->spi_transfers_base = Display->Bus->transfers;
+    }
+    Display->pixels = 0;
+    pthread_mutex_unlock(&Display->io_lock);
+
+    return;
+}
+
+/* Print the statistics to stream as text, returns non-zero on
+   failure */
+int
+EPD_dump_stats(struct Epd *Display, FILE *stream)
+{
+    struct EPD_STATS Stats;
+
+    EPD_get_stats(Display, &Stats);
+
+    return STATS_dump(&Stats, stream);
+}
+
+/* Number of panels in a wall, zero for a single display */
+size_t
+EPD_get_panel_count(struct Epd *Display)
+{
+    return Display->npanels;
+}
+
+/* Returns panel n of a wall, or NULL if there is no such panel */
+struct Epd *
+EPD_get_panel(struct Epd *Display, size_t n)
+{
+    if (n >= Display->npanels) {
+	errno = EINVAL;
+	log_err("No panel %zu.", n);
+	return NULL;
+    }
+
+    return Display->Panels[n];
 }
 
 int
@@ -568,6 +2579,18 @@ EPD_get_height(struct Epd *Display)
     return Display->height;
 }
 
+int
+EPD_get_physical_width(struct Epd *Display)
+{
+    return Display->phys_width;
+}
+
+int
+EPD_get_physical_height(struct Epd *Display)
+{
+    return Display->phys_height;
+}
+
 /**
    Debugging methods
  **/
@@ -609,8 +2632,8 @@ EPD_print_bmp(struct Epd *Display)
     return;
 }
 
-/* Returns a pointer to the image bitmap, or null if one is not
-   initialised. */
+/* Returns a pointer to the back buffer (the bitmap being drawn), or
+   null if one is not initialised. */
 uint8_t *
 EPD_get_bmp(struct Epd *Display)
 {
@@ -621,3 +2644,23 @@ EPD_get_bmp(struct Epd *Display)
     return Display->bmp.buf;
 }
 
+/* Returns a pointer to the front buffer (the bitmap last presented by
+   EPD_swap), or null if one is not initialised. */
+uint8_t *
+EPD_get_front(struct Epd *Display)
+{
+    if (!Display->bmp.front) {
+	log_warn("Image bitmap does not appear to be initialised.");
+    }
+
+    return Display->bmp.front;
+}
+
+/* Returns the transport driving the display, used to inspect the
+   recording backend. A wall has none, see EPD_get_panel. */
+struct Transport *
+EPD_get_transport(struct Epd *Display)
+{
+    return Display->Bus;
+}
+
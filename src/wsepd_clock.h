@@ -0,0 +1,52 @@
+/* wsepd_clock.h
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Monotonic clock helpers for deadlines and latency measurement.
+ *
+ */
+
+#ifndef WSEPD_CLOCK_H
+#define WSEPD_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Microseconds since an arbitrary fixed point, unaffected by changes
+   to the system time */
+static inline uint64_t
+clock_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Convert an absolute monotonic time in microseconds to a timespec
+   suitable for a CLOCK_MONOTONIC condition variable */
+static inline struct timespec
+clock_us_to_timespec(uint64_t us)
+{
+    struct timespec ts = { .tv_sec = us / 1000000,
+			   .tv_nsec = (us % 1000000) * 1000 };
+    return ts;
+}
+
+#endif /* WSEPD_CLOCK_H */
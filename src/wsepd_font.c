@@ -0,0 +1,685 @@
+/* wsepd_font.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * The .hex file is kept as text. Each line is "CODEPOINT:DIGITS" with
+ * 32 digits for an 8 pixel wide glyph or 64 for a 16 pixel one, a
+ * two level index (block of 256 codepoints, then codepoint) locates
+ * the digits of a glyph and decoded glyphs are kept in a small LRU
+ * cache.
+ *
+ * A pack is mapped read only and used in place, so loading costs the
+ * same whatever its size, pages are read as glyphs are first drawn
+ * and are shared by every process using the pack. All integers are
+ * little endian:
+ *
+ *   header   "WSFP", uint16 version (1), uint16 glyph height (16),
+ *            uint32 glyphs, uint32 blocks, uint32 narrow glyphs,
+ *            uint32 wide glyphs, uint32 offsets of the block tables,
+ *            narrow bitmaps and wide bitmaps, uint32 reserved
+ *   blocks   uint16 per 256 codepoint block, 0 if the block is empty
+ *            otherwise its table number plus one
+ *   tables   256 uint32 per block, 0 for a missing glyph otherwise
+ *            bit 0 set for wide glyphs and the glyph number plus one
+ *            in the bits above
+ *   glyphs   the 8 pixel wide bitmaps (16 bytes each) then the 16
+ *            pixel wide (32 bytes each), rows top down
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ert_log.h>
+
+#include "wsepd_font.h"
+
+#define FONT_CODEPOINTS 0x110000
+#define FONT_BLOCK_LEN  256
+#define FONT_BLOCKS     (FONT_CODEPOINTS / FONT_BLOCK_LEN)
+#define FONT_MAX_BYTES  (2 * FONT_HEIGHT) /* A 16 pixel wide glyph */
+
+#define FONT_PACK_HEADER_LEN 40
+#define FONT_PACK_BLOCKS_LEN (2 * FONT_BLOCKS)
+#define FONT_PACK_TABLE_LEN  (4 * FONT_BLOCK_LEN)
+
+#define FONT_CACHE_LEN     128	/* Decoded glyphs */
+#define FONT_CACHE_BUCKETS 256	/* Hash chains, a power of two */
+
+/* A decoded glyph, linked into its hash chain and the LRU list */
+struct CacheEntry {
+    uint32_t codepoint;		/* UINT32_MAX while unused */
+    uint8_t width;
+    int16_t chain;		/* Next in the hash chain, or -1 */
+    int16_t prev, next;		/* LRU list, most recent first */
+    uint8_t bitmap[FONT_MAX_BYTES];
+};
+
+struct Font {
+    size_t count;		/* Glyphs in the font */
+
+    /* A mapped pack, glyphs are used in place */
+    const uint8_t *pack;	/* NULL for a .hex file */
+    size_t pack_len;
+    const uint8_t *blocks, *tables, *narrow, *wide;
+    uint32_t ntables, nnarrow, nwide;
+
+    char *text;			/* The .hex file */
+    size_t len;
+
+    /* Index entries are the offset of a glyph's digits shifted left
+       one, with the low bit set for wide glyphs. Zero if missing. */
+    uint32_t *index[FONT_BLOCKS];
+
+    struct CacheEntry cache[FONT_CACHE_LEN];
+    int16_t buckets[FONT_CACHE_BUCKETS];
+    int16_t head, tail;
+};
+
+static int font_map(struct Font *Font, int fd, const char *path);
+static int font_read(struct Font *Font, const char *path);
+static int font_index(struct Font *Font);
+static uint32_t font_entry(struct Font *Font, uint32_t codepoint);
+static int font_cache_get(struct Font *Font, uint32_t codepoint);
+
+/* Value of hex digit c, or -1 */
+static inline int
+font_hex(char c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'A' && c <= 'F')
+	return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    return -1;
+}
+
+static void
+put_le(uint8_t *p, uint64_t v, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+	p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static uint64_t
+get_le(const uint8_t *p, size_t n)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; ++i)
+	v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+/* Map the pack open on fd and check that its sections lie within the
+   file. Returns non-zero on failure. */
+static int
+font_map(struct Font *Font, int fd, const char *path)
+{
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < FONT_PACK_HEADER_LEN) {
+	errno = EINVAL;
+	log_err("Font pack %s truncated.", path);
+	return 1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map) {
+	log_err("Failed to map font pack %s.", path);
+	return 1;
+    }
+    Font->pack = map;
+    Font->pack_len = st.st_size;
+
+    const uint8_t *h = Font->pack;
+    uint64_t tables = get_le(h + 24, 4);
+    uint64_t narrow = get_le(h + 28, 4), wide = get_le(h + 32, 4);
+    Font->count = get_le(h + 8, 4);
+    Font->ntables = get_le(h + 12, 4);
+    Font->nnarrow = get_le(h + 16, 4);
+    Font->nwide = get_le(h + 20, 4);
+
+    if (get_le(h + 4, 2) != FONT_PACK_VERSION
+	|| get_le(h + 6, 2) != FONT_HEIGHT
+	|| FONT_PACK_HEADER_LEN + FONT_PACK_BLOCKS_LEN > Font->pack_len
+	|| tables + (uint64_t)Font->ntables * FONT_PACK_TABLE_LEN
+	   > Font->pack_len
+	|| narrow + (uint64_t)Font->nnarrow * FONT_HEIGHT > Font->pack_len
+	|| wide + (uint64_t)Font->nwide * 2 * FONT_HEIGHT > Font->pack_len) {
+	errno = EINVAL;
+	log_err("Font pack %s malformed.", path);
+	return 1;
+    }
+
+    Font->blocks = Font->pack + FONT_PACK_HEADER_LEN;
+    Font->tables = Font->pack + tables;
+    Font->narrow = Font->pack + narrow;
+    Font->wide = Font->pack + wide;
+
+    return 0;
+}
+
+/* Read the whole file at path into Font->text. Returns non-zero on
+   failure. */
+static int
+font_read(struct Font *Font, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (NULL == fp) {
+	log_err("Failed to open font %s.", path);
+	return 1;
+    }
+
+    long len = -1;
+    if (fseek(fp, 0, SEEK_END) == 0)
+	len = ftell(fp);
+    if (len < 0 || (unsigned long)len >= (UINT32_MAX >> 1)
+	|| fseek(fp, 0, SEEK_SET)) {
+	errno = EFBIG;
+	log_err("Failed to size font %s.", path);
+	fclose(fp);
+	return 1;
+    }
+
+    Font->text = malloc(len + 1);
+    if (NULL == Font->text) {
+	log_err("Memory error.");
+	fclose(fp);
+	return 1;
+    }
+
+    if (fread(Font->text, 1, len, fp) != (size_t)len) {
+	log_err("Failed to read font %s.", path);
+	fclose(fp);
+	return 1;
+    }
+    Font->text[len] = '\0';
+    Font->len = len;
+    fclose(fp);
+
+    return 0;
+}
+
+/* Index every well formed line of the text. Returns non-zero on
+   memory error. */
+static int
+font_index(struct Font *Font)
+{
+    const char *p = Font->text, *end = Font->text + Font->len;
+    size_t line = 0, skipped = 0;
+
+    while (p < end) {
+	const char *eol = memchr(p, '\n', end - p);
+	if (NULL == eol)
+	    eol = end;
+	const char *stop = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+	++line;
+
+	uint32_t codepoint = 0;
+	const char *q = p;
+	int d;
+	while (q < stop && codepoint < FONT_CODEPOINTS
+	       && (d = font_hex(*q)) >= 0) {
+	    codepoint = (codepoint << 4) | d;
+	    ++q;
+	}
+
+	const char *digits = q + 1;
+	size_t n = 0;
+	while (digits + n < stop && font_hex(digits[n]) >= 0)
+	    ++n;
+
+	if (q == p || q >= stop || *q != ':' || codepoint >= FONT_CODEPOINTS
+	    || digits + n != stop || (n != 32 && n != 64)) {
+	    if (stop > p)
+		++skipped;
+	    p = eol + 1;
+	    continue;
+	}
+
+	uint32_t **Block = &Font->index[codepoint / FONT_BLOCK_LEN];
+	if (NULL == *Block) {
+	    *Block = calloc(FONT_BLOCK_LEN, sizeof **Block);
+	    if (NULL == *Block) {
+		log_err("Memory error.");
+		return 1;
+	    }
+	}
+
+	uint32_t *entry = &(*Block)[codepoint % FONT_BLOCK_LEN];
+	if (0 == *entry)
+	    ++Font->count;
+	*entry = ((uint32_t)(digits - Font->text) << 1) | (n == 64);
+
+	p = eol + 1;
+    }
+
+    if (skipped) {
+	errno = EINVAL;
+	log_warn("Skipped %zu malformed lines of %zu.", skipped, line);
+    }
+
+    return 0;
+}
+
+/* Load the GNU Unifont .hex file or font pack at path, returns NULL
+   on failure */
+struct Font *
+FONT_load(const char *path)
+{
+    struct Font *Font = calloc(1, sizeof *Font);
+    if (NULL == Font) {
+	log_err("Memory error.");
+	return NULL;
+    }
+
+    for (size_t i = 0; i < FONT_CACHE_LEN; ++i) {
+	Font->cache[i].codepoint = UINT32_MAX;
+	Font->cache[i].chain = -1;
+	Font->cache[i].prev = i - 1;
+	Font->cache[i].next = (i + 1 < FONT_CACHE_LEN) ? (int)i + 1 : -1;
+    }
+    Font->head = 0;
+    Font->tail = FONT_CACHE_LEN - 1;
+    memset(Font->buckets, 0xFF, sizeof Font->buckets);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+	log_err("Failed to open font %s.", path);
+	FONT_destroy(Font);
+	return NULL;
+    }
+
+    char magic[4];
+    int rc = (read(fd, magic, sizeof magic) == sizeof magic
+	      && !memcmp(magic, FONT_PACK_MAGIC, sizeof magic))
+	? font_map(Font, fd, path)
+	: (font_read(Font, path) || font_index(Font));
+    close(fd);
+
+    if (rc) {
+	FONT_destroy(Font);
+	return NULL;
+    }
+    log_info("Loaded %zu glyphs from %s%s.", Font->count, path,
+	     Font->pack ? " (pack)" : "");
+
+    return Font;
+}
+
+void
+FONT_destroy(struct Font *Font)
+{
+    if (NULL == Font)
+	return;
+
+    for (size_t i = 0; i < FONT_BLOCKS; ++i)
+	free(Font->index[i]);
+    free(Font->text);
+    if (Font->pack)
+	munmap((void *)Font->pack, Font->pack_len);
+    free(Font);
+
+    return;
+}
+
+/* Hash chain of codepoint */
+static inline size_t
+font_bucket(uint32_t codepoint)
+{
+    return (codepoint * 2654435761u) >> 24 & (FONT_CACHE_BUCKETS - 1);
+}
+
+/* Move entry i to the front of the LRU list */
+static void
+font_cache_touch(struct Font *Font, int16_t i)
+{
+    struct CacheEntry *E = &Font->cache[i];
+
+    if (Font->head == i)
+	return;
+
+    Font->cache[E->prev].next = E->next;
+    if (E->next >= 0)
+	Font->cache[E->next].prev = E->prev;
+    else
+	Font->tail = E->prev;
+
+    E->prev = -1;
+    E->next = Font->head;
+    Font->cache[Font->head].prev = i;
+    Font->head = i;
+
+    return;
+}
+
+/* Returns the cache entry holding codepoint, decoding it into the
+   least recently used entry on a miss, or -1 if it is not in the
+   font */
+static int
+font_cache_get(struct Font *Font, uint32_t codepoint)
+{
+    size_t b = font_bucket(codepoint);
+
+    for (int16_t i = Font->buckets[b]; i >= 0; i = Font->cache[i].chain)
+	if (Font->cache[i].codepoint == codepoint) {
+	    font_cache_touch(Font, i);
+	    return i;
+	}
+
+    uint32_t entry = font_entry(Font, codepoint);
+    if (0 == entry)
+	return -1;
+
+    /* Evict the oldest from its chain */
+    int16_t i = Font->tail;
+    struct CacheEntry *E = &Font->cache[i];
+    if (E->codepoint != UINT32_MAX) {
+	int16_t *link = &Font->buckets[font_bucket(E->codepoint)];
+	while (*link != i)
+	    link = &Font->cache[*link].chain;
+	*link = E->chain;
+    }
+
+    const char *digits = Font->text + (entry >> 1);
+    size_t bytes = (entry & 1) ? 2 * FONT_HEIGHT : FONT_HEIGHT;
+    for (size_t j = 0; j < bytes; ++j)
+	E->bitmap[j] = (font_hex(digits[2 * j]) << 4)
+	    | font_hex(digits[2 * j + 1]);
+    E->codepoint = codepoint;
+    E->width = (entry & 1) ? 16 : 8;
+
+    E->chain = Font->buckets[b];
+    Font->buckets[b] = i;
+    font_cache_touch(Font, i);
+
+    return i;
+}
+
+/* The index entry of codepoint, zero if it is missing or, in a pack,
+   numbers a glyph the pack does not hold. Bit 0 is set for wide
+   glyphs in both kinds of font. */
+static uint32_t
+font_entry(struct Font *Font, uint32_t codepoint)
+{
+    if (codepoint >= FONT_CODEPOINTS)
+	return 0;
+
+    if (NULL == Font->pack) {
+	const uint32_t *Block = Font->index[codepoint / FONT_BLOCK_LEN];
+	return Block ? Block[codepoint % FONT_BLOCK_LEN] : 0;
+    }
+
+    uint32_t table = get_le(Font->blocks + 2 * (codepoint / FONT_BLOCK_LEN), 2);
+    if (0 == table || table > Font->ntables)
+	return 0;
+
+    uint32_t entry = get_le(Font->tables + (table - 1) * FONT_PACK_TABLE_LEN
+			    + 4 * (codepoint % FONT_BLOCK_LEN), 4);
+    uint32_t n = entry >> 1;
+    if (0 == n || n > ((entry & 1) ? Font->nwide : Font->nnarrow))
+	return 0;
+
+    return entry;
+}
+
+/* Point Glyph at the bitmap of codepoint in the pack. Returns non-zero
+   if it is missing. */
+static int
+font_pack_get(struct Font *Font, uint32_t codepoint, struct FontGlyph *Glyph)
+{
+    uint32_t entry = font_entry(Font, codepoint);
+    uint32_t n = entry >> 1;
+    if (0 == n)
+	return 1;
+
+    int wide = entry & 1;
+    Glyph->width = wide ? 16 : 8;
+    Glyph->bitmap = wide ? Font->wide + (size_t)(n - 1) * 2 * FONT_HEIGHT
+	: Font->narrow + (size_t)(n - 1) * FONT_HEIGHT;
+    Glyph->codepoint = codepoint;
+    Glyph->height = FONT_HEIGHT;
+    Glyph->stride = Glyph->width / 8;
+
+    return 0;
+}
+
+/* Fill Glyph with codepoint, from the pack or through the cache.
+   Returns non-zero if it is missing. */
+static int
+font_find(struct Font *Font, uint32_t codepoint, struct FontGlyph *Glyph)
+{
+    if (Font->pack)
+	return font_pack_get(Font, codepoint, Glyph);
+
+    int i = font_cache_get(Font, codepoint);
+    if (i < 0)
+	return 1;
+
+    const struct CacheEntry *E = &Font->cache[i];
+    Glyph->codepoint = E->codepoint;
+    Glyph->width = E->width;
+    Glyph->height = FONT_HEIGHT;
+    Glyph->stride = E->width / 8;
+    Glyph->bitmap = E->bitmap;
+
+    return 0;
+}
+
+int
+FONT_get_glyph(struct Font *Font, uint32_t codepoint, struct FontGlyph *Glyph)
+{
+    if (font_find(Font, codepoint, Glyph)
+	&& font_find(Font, FONT_REPLACEMENT, Glyph)) {
+	errno = ENOENT;
+	log_debug("No glyph for U+%04X.", codepoint);
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Non-zero if codepoint is kept by the n Subset ranges */
+static int
+font_in_subset(uint32_t codepoint, const struct FontRange *Subset, size_t n)
+{
+    if (NULL == Subset || codepoint == FONT_REPLACEMENT)
+	return 1;
+
+    for (size_t i = 0; i < n; ++i)
+	if (codepoint >= Subset[i].first && codepoint <= Subset[i].last)
+	    return 1;
+
+    return 0;
+}
+
+/* The pack is built in memory, the glyphs of each width numbered in
+   codepoint order, then written out section by section */
+int
+FONT_write_pack(struct Font *Font, const char *path,
+		const struct FontRange *Subset, size_t n)
+{
+    uint8_t header[FONT_PACK_HEADER_LEN] = FONT_PACK_MAGIC;
+    uint8_t *blocks = calloc(FONT_BLOCKS, 2);
+    uint8_t *tables = NULL, *narrow = NULL, *wide = NULL;
+    uint32_t ntables = 0, nnarrow = 0, nwide = 0;
+    struct FontGlyph Glyph;
+    FILE *fp = NULL;
+    int rc = 1;
+
+    if (NULL == blocks) {
+	log_err("Memory error.");
+	return 1;
+    }
+
+    /* Size the sections */
+    for (uint32_t b = 0; b < FONT_BLOCKS; ++b) {
+	int used = 0;
+	for (uint32_t c = b * FONT_BLOCK_LEN; c < (b + 1) * FONT_BLOCK_LEN; ++c) {
+	    if (!font_in_subset(c, Subset, n) || font_find(Font, c, &Glyph))
+		continue;
+	    used = 1;
+	    if (Glyph.width == 16)
+		++nwide;
+	    else
+		++nnarrow;
+	}
+	if (used)
+	    put_le(blocks + 2 * b, ++ntables, 2);
+    }
+
+    tables = calloc(ntables ? ntables : 1, FONT_PACK_TABLE_LEN);
+    narrow = malloc((nnarrow ? nnarrow : 1) * FONT_HEIGHT);
+    wide = malloc((nwide ? nwide : 1) * 2 * FONT_HEIGHT);
+    if (NULL == tables || NULL == narrow || NULL == wide) {
+	log_err("Memory error.");
+	goto out;
+    }
+
+    /* Fill them */
+    uint32_t inarrow = 0, iwide = 0;
+    for (uint32_t b = 0; b < FONT_BLOCKS; ++b) {
+	uint32_t table = get_le(blocks + 2 * b, 2);
+	if (0 == table)
+	    continue;
+
+	uint8_t *entries = tables + (table - 1) * FONT_PACK_TABLE_LEN;
+	for (uint32_t i = 0; i < FONT_BLOCK_LEN; ++i) {
+	    uint32_t c = b * FONT_BLOCK_LEN + i;
+	    if (!font_in_subset(c, Subset, n) || font_find(Font, c, &Glyph))
+		continue;
+
+	    if (Glyph.width == 16 && iwide < nwide) {
+		memcpy(wide + iwide * 2 * FONT_HEIGHT, Glyph.bitmap,
+		       2 * FONT_HEIGHT);
+		put_le(entries + 4 * i, (++iwide << 1) | 1, 4);
+	    } else if (Glyph.width == 8 && inarrow < nnarrow) {
+		memcpy(narrow + inarrow * FONT_HEIGHT, Glyph.bitmap,
+		       FONT_HEIGHT);
+		put_le(entries + 4 * i, ++inarrow << 1, 4);
+	    }
+	}
+    }
+
+    uint32_t off_tables = FONT_PACK_HEADER_LEN + FONT_PACK_BLOCKS_LEN;
+    uint32_t off_narrow = off_tables + ntables * FONT_PACK_TABLE_LEN;
+    uint32_t off_wide = off_narrow + nnarrow * FONT_HEIGHT;
+    put_le(header + 4, FONT_PACK_VERSION, 2);
+    put_le(header + 6, FONT_HEIGHT, 2);
+    put_le(header + 8, inarrow + iwide, 4);
+    put_le(header + 12, ntables, 4);
+    put_le(header + 16, inarrow, 4);
+    put_le(header + 20, iwide, 4);
+    put_le(header + 24, off_tables, 4);
+    put_le(header + 28, off_narrow, 4);
+    put_le(header + 32, off_wide, 4);
+
+    fp = fopen(path, "wb");
+    if (NULL == fp) {
+	log_err("Failed to open %s.", path);
+	goto out;
+    }
+
+    if (fwrite(header, sizeof header, 1, fp) != 1
+	|| fwrite(blocks, FONT_PACK_BLOCKS_LEN, 1, fp) != 1
+	|| fwrite(tables, FONT_PACK_TABLE_LEN, ntables, fp) != ntables
+	|| fwrite(narrow, FONT_HEIGHT, inarrow, fp) != inarrow
+	|| fwrite(wide, 2 * FONT_HEIGHT, iwide, fp) != iwide) {
+	log_err("Failed to write %s.", path);
+	goto out;
+    }
+
+    rc = 0;
+    log_info("Packed %u glyphs in %u blocks to %s (%luB).", inarrow + iwide,
+	     ntables, path, (unsigned long)off_wide + iwide * 2 * FONT_HEIGHT);
+ out:
+    if (fp && fclose(fp) && !rc) {
+	log_err("Failed to write %s.", path);
+	rc = 1;
+    }
+    free(wide);
+    free(narrow);
+    free(tables);
+    free(blocks);
+    return rc;
+}
+
+/* From the index alone, no glyph is decoded */
+size_t
+FONT_get_advance(struct Font *Font, uint32_t codepoint)
+{
+    uint32_t entry = font_entry(Font, codepoint);
+    if (0 == entry)
+	entry = font_entry(Font, FONT_REPLACEMENT);
+    if (0 == entry)
+	return 0;
+
+    return (entry & 1) ? 16 : 8;
+}
+
+size_t
+FONT_get_count(struct Font *Font)
+{
+    return Font->count;
+}
+
+uint32_t
+FONT_utf8_next(const char **text)
+{
+    const uint8_t *s = (const uint8_t *)*text;
+    uint32_t c = s[0], min;
+    size_t n;
+
+    if (c < 0x80) {
+	*text += 1;
+	return c;
+    } else if ((c & 0xE0) == 0xC0) {
+	n = 1, c &= 0x1F, min = 0x80;
+    } else if ((c & 0xF0) == 0xE0) {
+	n = 2, c &= 0x0F, min = 0x800;
+    } else if ((c & 0xF8) == 0xF0) {
+	n = 3, c &= 0x07, min = 0x10000;
+    } else {
+	*text += 1;
+	return FONT_REPLACEMENT;
+    }
+
+    for (size_t i = 1; i <= n; ++i) {
+	if ((s[i] & 0xC0) != 0x80) {
+	    *text += 1;
+	    return FONT_REPLACEMENT;
+	}
+	c = (c << 6) | (s[i] & 0x3F);
+    }
+
+    /* Overlong forms, surrogates and beyond Unicode */
+    if (c < min || c >= FONT_CODEPOINTS || (c >= 0xD800 && c <= 0xDFFF)) {
+	*text += 1;
+	return FONT_REPLACEMENT;
+    }
+
+    *text += n + 1;
+    return c;
+}
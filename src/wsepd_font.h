@@ -0,0 +1,87 @@
+/* wsepd_font.h
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Provides a 'Font' object holding the glyphs of a GNU Unifont .hex
+ * file, 16 pixels high and 8 or 16 wide, looked up by codepoint. A
+ * font may be compiled to a binary pack, which loads by mapping the
+ * file read only.
+ *
+ */
+
+#ifndef WSEPD_FONT_H
+#define WSEPD_FONT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FONT_HEIGHT 16		/* Pixels, every glyph */
+#define FONT_REPLACEMENT 0xFFFD	/* Drawn for missing glyphs */
+#define FONT_PACK_MAGIC "WSFP"
+#define FONT_PACK_VERSION 1
+
+typedef struct Font * FONT;
+
+/* A glyph bitmap, stride bytes per row with the most significant bit
+   leftmost and set bits inked */
+struct FontGlyph {
+    uint32_t codepoint;
+    size_t width, height;
+    size_t stride;
+    const uint8_t *bitmap;
+};
+
+/* Codepoints first to last inclusive */
+struct FontRange {
+    uint32_t first, last;
+};
+
+/**
+   FONT object creation/destruction
+**/
+
+/* Load a .hex file or a font pack, told apart by the pack magic */
+FONT FONT_load(const char *path);
+void FONT_destroy(FONT Font);
+
+/* Compile Font to a pack at path, keeping only the codepoints in the n
+   Subset ranges (and the replacement glyph) unless Subset is NULL.
+   Returns non-zero on failure. */
+int FONT_write_pack(FONT Font, const char *path,
+		    const struct FontRange *Subset, size_t n);
+
+/**
+   Glyph lookup
+**/
+
+/* Fill Glyph with codepoint, or the replacement glyph if it is
+   missing. The bitmap is valid until the next lookup. Returns
+   non-zero if neither is in the font. */
+int FONT_get_glyph(FONT Font, uint32_t codepoint, struct FontGlyph *Glyph);
+/* Width in pixels of the glyph drawn for codepoint, 0 if neither it
+   nor the replacement is in the font */
+size_t FONT_get_advance(FONT Font, uint32_t codepoint);
+size_t FONT_get_count(FONT Font); /* Glyphs in the font */
+
+/* Decode the UTF-8 character at *text and advance past it. Malformed
+   sequences decode as FONT_REPLACEMENT one byte at a time. */
+uint32_t FONT_utf8_next(const char **text);
+
+#endif /* WSEPD_FONT_H */
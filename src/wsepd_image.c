@@ -0,0 +1,406 @@
+/* wsepd_image.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * The box filter works in integer ticks: across, file pixel i covers
+ * ticks i * w to (i + 1) * w and output pixel j covers j * W to (j +
+ * 1) * W, for a file W wide scaled to w, and likewise down. Each output
+ * pixel is the sum of the file pixels weighted by the ticks they share,
+ * over the W x H ticks it covers, so reduction and enlargement by any
+ * ratio are exact averages. A file row is scaled across as it is read
+ * and added into the output row it falls in, split between two where
+ * it straddles them.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <ert_log.h>
+
+#include "wsepd_image.h"
+
+struct Image {
+    FILE *fp;
+    int format;			/* n of the magic Pn */
+    size_t width, height;	/* Of the file */
+    unsigned long maxval;
+    uint8_t level[256];		/* Sample to grey, maxval < 256 */
+
+    uint8_t *raw;		/* A row of a raw file */
+    size_t raw_len;
+    uint8_t *grey;		/* A row of the file */
+    size_t rows_read;
+
+    /* Box filter, hsum is NULL when the file is not scaled */
+    size_t out_width, out_height, out_row;
+    uint32_t *hsum;		/* The last row read, scaled across */
+    uint64_t *vsum;
+    uint64_t vpos;		/* Ticks down added to rows returned */
+};
+
+/* Read a decimal number, skipping whitespace and comments before it
+   and leaving the character after it unread. Returns non-zero if
+   there is none or it exceeds max. */
+static int
+image_number(FILE *fp, unsigned long *v, unsigned long max)
+{
+    int c;
+
+    do {
+	c = getc(fp);
+	if (c == '#')
+	    while (c != '\n' && c != EOF)
+		c = getc(fp);
+    } while (c != EOF && isspace(c));
+
+    if (c == EOF || !isdigit(c))
+	return 1;
+
+    for (*v = 0; c != EOF && isdigit(c); c = getc(fp)) {
+	*v = (*v * 10) + (c - '0');
+	if (*v > max)
+	    return 1;
+    }
+    if (c != EOF)
+	ungetc(c, fp);
+
+    return 0;
+}
+
+/* Read the header, leaving fp at the first sample. Returns non-zero
+   if it is malformed. */
+static int
+image_header(struct Image *Img)
+{
+    unsigned long w, h;
+
+    if (getc(Img->fp) != 'P')
+	return 1;
+    Img->format = getc(Img->fp) - '0';
+    if (Img->format < 1 || Img->format > 6)
+	return 1;
+
+    if (image_number(Img->fp, &w, IMAGE_MAX_SIZE)
+	|| image_number(Img->fp, &h, IMAGE_MAX_SIZE) || !w || !h)
+	return 1;
+    Img->width = w;
+    Img->height = h;
+
+    Img->maxval = 1;
+    if (Img->format != 1 && Img->format != 4
+	&& (image_number(Img->fp, &Img->maxval, 65535) || !Img->maxval))
+	return 1;
+
+    /* One whitespace character ends the header */
+    return !isspace(getc(Img->fp));
+}
+
+struct Image *
+IMAGE_open(const char *path)
+{
+    struct Image *Img = calloc(1, sizeof *Img);
+    if (NULL == Img) {
+	log_err("Memory error.");
+	return NULL;
+    }
+
+    Img->fp = fopen(path, "rb");
+    if (NULL == Img->fp) {
+	log_err("Failed to open image %s.", path);
+	goto out;
+    }
+
+    if (image_header(Img)) {
+	errno = EINVAL;
+	log_err("Image %s is not a PBM, PGM or PPM file.", path);
+	goto out;
+    }
+
+    /* Samples of two bytes when maxval needs them */
+    size_t bytes = (Img->maxval > 255) ? 2 : 1;
+    if (Img->format == 4)
+	Img->raw_len = (Img->width + 7) / 8;
+    else if (Img->format == 5)
+	Img->raw_len = Img->width * bytes;
+    else if (Img->format == 6)
+	Img->raw_len = 3 * Img->width * bytes;
+
+    for (unsigned long v = 0; v < 256; ++v)
+	Img->level[v] = (v >= Img->maxval)
+	    ? 255 : ((v * 255) + (Img->maxval / 2)) / Img->maxval;
+
+    Img->raw = malloc(Img->raw_len ? Img->raw_len : 1);
+    Img->grey = malloc(Img->width);
+    if (NULL == Img->raw || NULL == Img->grey) {
+	log_err("Memory error.");
+	goto out;
+    }
+    Img->out_width = Img->width;
+    Img->out_height = Img->height;
+
+    log_debug("Image %s, P%d %zux%zu.", path, Img->format,
+	      Img->width, Img->height);
+
+    return Img;
+ out:
+    IMAGE_close(Img);
+    return NULL;
+}
+
+void
+IMAGE_close(struct Image *Img)
+{
+    if (NULL == Img)
+	return;
+
+    if (Img->fp)
+	fclose(Img->fp);
+    free(Img->vsum);
+    free(Img->hsum);
+    free(Img->grey);
+    free(Img->raw);
+    free(Img);
+
+    return;
+}
+
+size_t
+IMAGE_get_width(struct Image *Img)
+{
+    return Img->width;
+}
+
+size_t
+IMAGE_get_height(struct Image *Img)
+{
+    return Img->height;
+}
+
+int
+IMAGE_set_size(struct Image *Img, size_t w, size_t h)
+{
+    if (Img->rows_read || !w || !h || w > IMAGE_MAX_SIZE
+	|| h > IMAGE_MAX_SIZE) {
+	errno = EINVAL;
+	log_err("Invalid image size %zux%zu.", w, h);
+	return 1;
+    }
+
+    Img->out_width = w;
+    Img->out_height = h;
+    free(Img->hsum);
+    free(Img->vsum);
+    Img->hsum = NULL;
+    Img->vsum = NULL;
+    if (w == Img->width && h == Img->height)
+	return 0;
+
+    Img->hsum = malloc(w * sizeof *Img->hsum);
+    Img->vsum = malloc(w * sizeof *Img->vsum);
+    if (NULL == Img->hsum || NULL == Img->vsum) {
+	log_err("Memory error.");
+	free(Img->hsum);
+	Img->hsum = NULL;
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Grey of a sample, v being no greater than maxval */
+static inline uint8_t
+image_level(const struct Image *Img, unsigned long v)
+{
+    if (Img->maxval < 256)
+	return Img->level[v];
+    return ((v * 255) + (Img->maxval / 2)) / Img->maxval;
+}
+
+/* Luminance of a colour, weights in 256ths */
+static inline uint8_t
+image_luma(uint8_t r, uint8_t g, uint8_t b)
+{
+    return ((77 * r) + (150 * g) + (29 * b) + 128) >> 8;
+}
+
+/* Read a plain text row into grey. Returns non-zero if it is short
+   or malformed. */
+static int
+image_read_plain(struct Image *Img, uint8_t *grey)
+{
+    unsigned long v[3];
+
+    for (size_t i = 0; i < Img->width; ++i) {
+	if (Img->format == 1) {
+	    /* Bits need not be separated */
+	    int c;
+	    do {
+		c = getc(Img->fp);
+		if (c == '#')
+		    while (c != '\n' && c != EOF)
+			c = getc(Img->fp);
+	    } while (c != EOF && isspace(c));
+	    if (c != '0' && c != '1')
+		return 1;
+	    grey[i] = (c == '1') ? 0 : 255;
+	    continue;
+	}
+
+	size_t n = (Img->format == 3) ? 3 : 1;
+	for (size_t k = 0; k < n; ++k)
+	    if (image_number(Img->fp, &v[k], Img->maxval))
+		return 1;
+	grey[i] = (n == 1) ? image_level(Img, v[0])
+	    : image_luma(image_level(Img, v[0]), image_level(Img, v[1]),
+			 image_level(Img, v[2]));
+    }
+
+    return 0;
+}
+
+/* Read a raw row into grey. Returns non-zero if the file is short. */
+static int
+image_read_raw(struct Image *Img, uint8_t *grey)
+{
+    const uint8_t *p = Img->raw;
+
+    if (fread(Img->raw, 1, Img->raw_len, Img->fp) != Img->raw_len)
+	return 1;
+
+    if (Img->format == 4) {
+	for (size_t i = 0; i < Img->width; ++i)
+	    grey[i] = (p[i >> 3] & (0x80 >> (i & 7))) ? 0 : 255;
+	return 0;
+    }
+
+    if (Img->maxval < 256) {
+	if (Img->format == 5) {
+	    for (size_t i = 0; i < Img->width; ++i)
+		grey[i] = Img->level[p[i]];
+	} else {
+	    for (size_t i = 0; i < Img->width; ++i, p += 3)
+		grey[i] = image_luma(Img->level[p[0]], Img->level[p[1]],
+				     Img->level[p[2]]);
+	}
+	return 0;
+    }
+
+    /* Two byte samples, most significant first */
+    for (size_t i = 0; i < Img->width; ++i) {
+	uint8_t c[3];
+	size_t n = (Img->format == 6) ? 3 : 1;
+	for (size_t k = 0; k < n; ++k, p += 2) {
+	    unsigned long v = ((unsigned long)p[0] << 8) | p[1];
+	    c[k] = image_level(Img, (v > Img->maxval) ? Img->maxval : v);
+	}
+	grey[i] = (n == 1) ? c[0] : image_luma(c[0], c[1], c[2]);
+    }
+
+    return 0;
+}
+
+/* Read the next row of the file into grey */
+static int
+image_read_file_row(struct Image *Img, uint8_t *grey)
+{
+    int rc = (Img->format <= 3)
+	? image_read_plain(Img, grey) : image_read_raw(Img, grey);
+    if (rc) {
+	errno = EINVAL;
+	log_err("Image truncated or malformed at row %zu.", Img->rows_read);
+	return 1;
+    }
+    ++Img->rows_read;
+
+    return 0;
+}
+
+/* Scale the row in Img->grey across into Img->hsum, in ticks of
+   Img->width per output pixel */
+static void
+image_scale_across(struct Image *Img)
+{
+    const uint64_t w = Img->out_width;
+    uint64_t pos = 0;
+    size_t i = 0;
+
+    for (size_t j = 0; j < Img->out_width; ++j) {
+	const uint64_t end = (uint64_t)(j + 1) * Img->width;
+	uint32_t sum = 0;
+
+	while (pos < end) {
+	    uint64_t next = (uint64_t)(i + 1) * w;
+	    uint64_t stop = (next < end) ? next : end;
+	    sum += (stop - pos) * Img->grey[i];
+	    pos = stop;
+	    if (pos == next)
+		++i;
+	}
+	Img->hsum[j] = sum;
+    }
+
+    return;
+}
+
+int
+IMAGE_read_row(struct Image *Img, uint8_t *grey)
+{
+    if (Img->out_row == Img->out_height) {
+	errno = EINVAL;
+	log_err("Every row of the image has been read.");
+	return 1;
+    }
+
+    if (NULL == Img->hsum) {
+	if (image_read_file_row(Img, grey))
+	    return 1;
+	++Img->out_row;
+	return 0;
+    }
+
+    /* Add the file rows within this output row, reading the next one
+       each time the last is used up */
+    const uint64_t end = (uint64_t)(Img->out_row + 1) * Img->height;
+    memset(Img->vsum, 0, Img->out_width * sizeof *Img->vsum);
+    while (Img->vpos < end) {
+	uint64_t row_end = (uint64_t)Img->rows_read * Img->out_height;
+	if (Img->vpos == row_end) {
+	    if (image_read_file_row(Img, Img->grey))
+		return 1;
+	    image_scale_across(Img);
+	    row_end += Img->out_height;
+	}
+
+	uint64_t weight = ((row_end < end) ? row_end : end) - Img->vpos;
+	for (size_t j = 0; j < Img->out_width; ++j)
+	    Img->vsum[j] += weight * Img->hsum[j];
+	Img->vpos += weight;
+    }
+
+    const uint64_t area = (uint64_t)Img->width * Img->height;
+    for (size_t j = 0; j < Img->out_width; ++j)
+	grey[j] = (Img->vsum[j] + (area / 2)) / area;
+    ++Img->out_row;
+
+    return 0;
+}
@@ -0,0 +1,64 @@
+/* wsepd_image.h
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Provides an 'Image' object reading a Netpbm file (PBM, PGM or PPM,
+ * plain or raw) one row at a time as grey levels, optionally scaled
+ * by a box filter. Only a few rows are held, whatever the size of the
+ * file.
+ *
+ */
+
+#ifndef WSEPD_IMAGE_H
+#define WSEPD_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMAGE_MAX_SIZE 65535	/* Pixels across or down */
+
+typedef struct Image * IMAGE;
+
+/**
+   IMAGE object creation/destruction
+**/
+
+/* Open the image at path and read its header */
+IMAGE IMAGE_open(const char *path);
+void IMAGE_close(IMAGE Img);
+
+size_t IMAGE_get_width(IMAGE Img);  /* Of the file */
+size_t IMAGE_get_height(IMAGE Img);
+
+/**
+   Reading rows
+**/
+
+/* Scale the rows read to w x h, each pixel the average of the area of
+   the file it covers. Must be called before the first row is read.
+   Returns non-zero on memory error or an empty size. */
+int IMAGE_set_size(IMAGE Img, size_t w, size_t h);
+
+/* Read the next row into grey, one level per pixel from 0 (black) to
+   255 (white). Colour is converted to luminance. Returns non-zero if
+   the file is short or malformed, or every row has been read. */
+int IMAGE_read_row(IMAGE Img, uint8_t *grey);
+
+#endif /* WSEPD_IMAGE_H */
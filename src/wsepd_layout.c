@@ -0,0 +1,424 @@
+/* wsepd_layout.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Text is decoded once into codepoints and their advances, measured
+ * from the font index without decoding any glyph. Lines are broken
+ * greedily after the last space that fits, or between characters if a
+ * word is wider than the box, and end at each newline. Lines past the
+ * height of the box are dropped and the last kept line is truncated
+ * as a line too wide for the box would be.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ert_log.h>
+
+#include "wsepd_layout.h"
+
+#define LAYOUT_ELLIPSIS_CHAR 0x2026
+
+/* A decoded character */
+struct LayoutItem {
+    uint32_t codepoint;
+    size_t width;
+};
+
+/* Characters start to end - 1 of the text form a line */
+struct LayoutLine {
+    size_t start, end;
+    size_t width;
+    int ellipsis;
+};
+
+struct Layout {
+    FONT Font;
+    int valid;			/* Box and text hold the last layout */
+    struct LayoutBox Box;
+    char *text;
+    size_t text_cap;
+
+    struct LayoutGlyph *glyphs;
+    size_t nglyphs, glyphs_cap;
+    size_t nlines;
+    struct LayoutRect bounds;
+    unsigned long shapes;
+
+    /* Scratch space, kept between layouts */
+    struct LayoutItem *items;
+    size_t items_cap;
+    struct LayoutLine *lines;
+    size_t lines_cap;
+};
+
+static int layout_shape(struct Layout *Text, const char *text);
+
+/* Grow *array to hold n elements of size bytes. Returns non-zero on
+   memory error. */
+static int
+layout_reserve(void **array, size_t *cap, size_t n, size_t size)
+{
+    if (n <= *cap)
+	return 0;
+
+    size_t len = *cap ? *cap : 16;
+    while (len < n)
+	len *= 2;
+
+    void *grown = realloc(*array, len * size);
+    if (NULL == grown) {
+	log_err("Memory error.");
+	return 1;
+    }
+    *array = grown;
+    *cap = len;
+
+    return 0;
+}
+
+struct Layout *
+LAYOUT_create(FONT Font)
+{
+    if (NULL == Font) {
+	errno = EINVAL;
+	log_err("A layout needs a font.");
+	return NULL;
+    }
+
+    struct Layout *Text = calloc(1, sizeof *Text);
+    if (NULL == Text) {
+	log_err("Memory error.");
+	return NULL;
+    }
+    Text->Font = Font;
+
+    return Text;
+}
+
+void
+LAYOUT_destroy(struct Layout *Text)
+{
+    if (NULL == Text)
+	return;
+
+    free(Text->lines);
+    free(Text->items);
+    free(Text->glyphs);
+    free(Text->text);
+    free(Text);
+
+    return;
+}
+
+/* Non-zero if A and B lay text out identically */
+static int
+layout_same_box(const struct LayoutBox *A, const struct LayoutBox *B)
+{
+    return A->x == B->x && A->y == B->y
+	&& A->width == B->width && A->height == B->height
+	&& A->align == B->align && A->flags == B->flags
+	&& A->line_gap == B->line_gap;
+}
+
+int
+LAYOUT_set_text(struct Layout *Text, const struct LayoutBox *Box,
+		const char *text)
+{
+    if (Text->valid && layout_same_box(&Text->Box, Box)
+	&& !strcmp(Text->text, text))
+	return 0;
+
+    size_t len = strlen(text) + 1;
+    if (layout_reserve((void **)&Text->text, &Text->text_cap, len, 1)) {
+	Text->valid = 0;
+	return 1;
+    }
+    memcpy(Text->text, text, len);
+    Text->Box = *Box;
+
+    Text->valid = !layout_shape(Text, text);
+    return !Text->valid;
+}
+
+/* Decode text into Text->items, returning the number of characters or
+   (size_t)-1 on memory error. Carriage returns and other control
+   characters are dropped and tabs become spaces. */
+static size_t
+layout_decode(struct Layout *Text, const char *text)
+{
+    size_t n = 0;
+
+    if (layout_reserve((void **)&Text->items, &Text->items_cap,
+		       strlen(text), sizeof *Text->items))
+	return (size_t)-1;
+
+    while (*text) {
+	uint32_t c = FONT_utf8_next(&text);
+	if (c == '\t')
+	    c = ' ';
+	else if ((c < 0x20 && c != '\n') || c == 0x7F)
+	    continue;
+
+	Text->items[n].codepoint = c;
+	Text->items[n].width = (c == '\n') ? 0 : FONT_get_advance(Text->Font, c);
+	++n;
+    }
+
+    return n;
+}
+
+/* Append a line of items start to end - 1, returns non-zero on memory
+   error */
+static int
+layout_push_line(struct Layout *Text, size_t *nlines, size_t start,
+		 size_t end)
+{
+    if (layout_reserve((void **)&Text->lines, &Text->lines_cap, *nlines + 1,
+		       sizeof *Text->lines))
+	return 1;
+
+    Text->lines[*nlines] = (struct LayoutLine){ .start = start, .end = end };
+    ++*nlines;
+
+    return 0;
+}
+
+/* Break the n items into lines, returns the number of lines or
+   (size_t)-1 on memory error */
+static size_t
+layout_break(struct Layout *Text, size_t n)
+{
+    const struct LayoutItem *Items = Text->items;
+    const size_t limit = Text->Box.width;
+    const int wrap = (Text->Box.flags & LAYOUT_WRAP) && limit;
+    size_t nlines = 0, start = 0, width = 0, brk = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+	if (Items[i].codepoint == '\n') {
+	    if (layout_push_line(Text, &nlines, start, i))
+		return (size_t)-1;
+	    start = i + 1;
+	    width = brk = 0;
+	    continue;
+	}
+
+	/* Break after the last space, or here within a long word, and
+	   start the next line at its first non-space */
+	if (wrap && width + Items[i].width > limit && i > start
+	    && Items[i].codepoint != ' ') {
+	    size_t end = (brk > start) ? brk : i;
+	    if (layout_push_line(Text, &nlines, start, end))
+		return (size_t)-1;
+	    for (start = end; start < n && Items[start].codepoint == ' ';
+		 ++start)
+		;
+	    width = brk = 0;
+	    i = start - 1;
+	    continue;
+	}
+
+	width += Items[i].width;
+	if (Items[i].codepoint == ' ')
+	    brk = i + 1;
+    }
+
+    if (layout_push_line(Text, &nlines, start, n))
+	return (size_t)-1;
+
+    return nlines;
+}
+
+/* Trim trailing spaces from Line and measure it */
+static void
+layout_measure(const struct LayoutItem *Items, struct LayoutLine *Line)
+{
+    while (Line->end > Line->start && Items[Line->end - 1].codepoint == ' ')
+	--Line->end;
+
+    Line->width = 0;
+    for (size_t i = Line->start; i < Line->end; ++i)
+	Line->width += Items[i].width;
+
+    return;
+}
+
+/* Fit Line to the box width, dropping characters from its end and
+   adding an ellipsis if the line was cut short or is too wide */
+static void
+layout_truncate(struct Layout *Text, struct LayoutLine *Line, int cut)
+{
+    const struct LayoutItem *Items = Text->items;
+    const size_t limit = Text->Box.width;
+    size_t ellipsis = 0;
+
+    layout_measure(Items, Line);
+    if (!cut && (!limit || Line->width <= limit))
+	return;
+    if (Text->Box.flags & LAYOUT_ELLIPSIS) {
+	ellipsis = FONT_get_advance(Text->Font, LAYOUT_ELLIPSIS_CHAR);
+	Line->ellipsis = 1;
+    }
+    if (!limit)
+	return;
+
+    while (Line->end > Line->start && Line->width + ellipsis > limit) {
+	--Line->end;
+	Line->width -= Items[Line->end].width;
+    }
+    if (Line->ellipsis) {
+	layout_measure(Items, Line);
+	if (Line->width + ellipsis > limit)
+	    Line->ellipsis = 0;	/* Too narrow for even the ellipsis */
+	else
+	    Line->width += ellipsis;
+    }
+
+    return;
+}
+
+/* Append a glyph, returns non-zero on memory error */
+static int
+layout_emit(struct Layout *Text, uint32_t codepoint, long x, long y,
+	    size_t width)
+{
+    if (layout_reserve((void **)&Text->glyphs, &Text->glyphs_cap,
+		       Text->nglyphs + 1, sizeof *Text->glyphs))
+	return 1;
+
+    Text->glyphs[Text->nglyphs++] = (struct LayoutGlyph){
+	.codepoint = codepoint, .x = x, .y = y, .width = width };
+
+    return 0;
+}
+
+/* Lay text out from scratch. Returns non-zero on memory error. */
+static int
+layout_shape(struct Layout *Text, const char *text)
+{
+    const struct LayoutBox *Box = &Text->Box;
+    const size_t pitch = FONT_HEIGHT + Box->line_gap;
+
+    ++Text->shapes;
+    Text->nglyphs = 0;
+    Text->nlines = 0;
+    Text->bounds = (struct LayoutRect){ Box->x, Box->y, 0, 0 };
+
+    size_t n = layout_decode(Text, text);
+    if (n == (size_t)-1)
+	return 1;
+    size_t nlines = layout_break(Text, n);
+    if (nlines == (size_t)-1)
+	return 1;
+
+    /* Lines past the bottom of the box are dropped */
+    int cut = 0;
+    if (Box->height) {
+	size_t fit = (Box->height < FONT_HEIGHT)
+	    ? 0 : 1 + (Box->height - FONT_HEIGHT) / pitch;
+	if (nlines > fit) {
+	    nlines = fit;
+	    cut = 1;
+	}
+    }
+
+    size_t widest = 0;
+    for (size_t l = 0; l < nlines; ++l) {
+	layout_truncate(Text, &Text->lines[l], cut && l == nlines - 1);
+	if (Text->lines[l].width > widest)
+	    widest = Text->lines[l].width;
+    }
+    const size_t span = Box->width ? Box->width : widest;
+
+    long xmin = 0, xmax = 0;
+    for (size_t l = 0; l < nlines; ++l) {
+	const struct LayoutLine *Line = &Text->lines[l];
+	long x = Box->x, y = Box->y + (long)(l * pitch);
+
+	if (Box->align == ALIGN_CENTRE)
+	    x += (long)(span - Line->width) / 2;
+	else if (Box->align == ALIGN_RIGHT)
+	    x += (long)(span - Line->width);
+
+	if (Line->width) {
+	    if (!Text->nglyphs || x < xmin)
+		xmin = x;
+	    if (!Text->nglyphs || x + (long)Line->width > xmax)
+		xmax = x + Line->width;
+	}
+
+	for (size_t i = Line->start; i < Line->end; ++i) {
+	    if (layout_emit(Text, Text->items[i].codepoint, x, y,
+			    Text->items[i].width))
+		return 1;
+	    x += Text->items[i].width;
+	}
+	if (Line->ellipsis
+	    && layout_emit(Text, LAYOUT_ELLIPSIS_CHAR, x, y,
+			   FONT_get_advance(Text->Font, LAYOUT_ELLIPSIS_CHAR)))
+	    return 1;
+    }
+    Text->nlines = nlines;
+
+    /* Rows from the first line to the last holding a glyph */
+    if (Text->nglyphs) {
+	long ymax = Text->glyphs[Text->nglyphs - 1].y + FONT_HEIGHT;
+	Text->bounds.x = xmin;
+	Text->bounds.y = Text->glyphs[0].y;
+	Text->bounds.width = xmax - xmin;
+	Text->bounds.height = ymax - Text->glyphs[0].y;
+    }
+
+    return 0;
+}
+
+const struct LayoutGlyph *
+LAYOUT_get_glyphs(struct Layout *Text, size_t *n)
+{
+    *n = Text->nglyphs;
+    return Text->glyphs;
+}
+
+void
+LAYOUT_get_bounds(struct Layout *Text, struct LayoutRect *Bounds)
+{
+    *Bounds = Text->bounds;
+    return;
+}
+
+size_t
+LAYOUT_get_lines(struct Layout *Text)
+{
+    return Text->nlines;
+}
+
+FONT
+LAYOUT_get_font(struct Layout *Text)
+{
+    return Text->Font;
+}
+
+unsigned long
+LAYOUT_get_shapes(struct Layout *Text)
+{
+    return Text->shapes;
+}
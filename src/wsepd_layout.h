@@ -0,0 +1,88 @@
+/* wsepd_layout.h
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Provides a 'Layout' object placing a UTF-8 string in a text box,
+ * broken into lines, aligned and truncated. The glyph positions are
+ * kept, so a layout whose text and box are unchanged is drawn again
+ * without being laid out.
+ *
+ */
+
+#ifndef WSEPD_LAYOUT_H
+#define WSEPD_LAYOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "wsepd_font.h"
+
+#define LAYOUT_WRAP     0x01	/* Break lines between words to fit */
+#define LAYOUT_ELLIPSIS 0x02	/* Mark truncated text with U+2026 */
+
+enum LAYOUT_ALIGN { ALIGN_LEFT, ALIGN_CENTRE, ALIGN_RIGHT };
+
+/* A text box with its top left corner at (x, y). A zero width or
+   height is unlimited. line_gap pixels separate lines. */
+struct LayoutBox {
+    long x, y;
+    size_t width, height;
+    enum LAYOUT_ALIGN align;
+    int flags;
+    size_t line_gap;
+};
+
+/* A placed glyph, its top left corner at (x, y) */
+struct LayoutGlyph {
+    uint32_t codepoint;
+    long x, y;
+    size_t width;
+};
+
+struct LayoutRect {
+    long x, y;
+    size_t width, height;
+};
+
+typedef struct Layout * LAYOUT;
+
+/**
+   LAYOUT object creation/destruction
+**/
+
+LAYOUT LAYOUT_create(FONT Font);
+void LAYOUT_destroy(LAYOUT Text);
+
+/**
+   Layout and results
+**/
+
+/* Lay text out in Box, unless both are unchanged since the last call.
+   Returns non-zero on memory error. */
+int LAYOUT_set_text(LAYOUT Text, const struct LayoutBox *Box,
+		    const char *text);
+
+const struct LayoutGlyph *LAYOUT_get_glyphs(LAYOUT Text, size_t *n);
+/* Smallest rectangle holding every glyph, empty if there are none */
+void LAYOUT_get_bounds(LAYOUT Text, struct LayoutRect *Bounds);
+size_t LAYOUT_get_lines(LAYOUT Text);
+FONT LAYOUT_get_font(LAYOUT Text);
+unsigned long LAYOUT_get_shapes(LAYOUT Text); /* Times laid out */
+
+#endif /* WSEPD_LAYOUT_H */
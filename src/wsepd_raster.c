@@ -0,0 +1,730 @@
+/* wsepd_raster.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * The blitter works on 64 bit big endian words so bit n of a row is
+ * bit 63 - n of its word: each destination word is combined with the
+ * source bits shifted into line with it and a mask of the columns
+ * covered, whatever the alignment of either bitmap.
+ *
+ * Shapes are reduced to horizontal spans, which are written a byte at
+ * a time with masks at either end.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ert_log.h>
+
+#include "wsepd_raster.h"
+
+/* Load n <= 8 bytes at p as the top of a big endian word */
+static inline uint64_t
+raster_load(const uint8_t *p, size_t n)
+{
+    uint64_t v = 0;
+
+    if (n == 8) {
+	memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+	v |= (uint64_t)p[i] << (56 - 8 * i);
+    return v;
+}
+
+/* Store the top n <= 8 bytes of v at p */
+static inline void
+raster_store(uint8_t *p, uint64_t v, size_t n)
+{
+    if (n == 8) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	memcpy(p, &v, 8);
+	return;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+	p[i] = v >> (56 - 8 * i);
+}
+
+/* The 64 bits of row (len bytes) starting at bit pos, which may be
+   negative. Bits outside the row read as zero. */
+static inline uint64_t
+raster_bits(const uint8_t *row, size_t len, long pos)
+{
+    if (pos < 0) {
+	if (pos <= -64)
+	    return 0;
+	return raster_bits(row, len, 0) >> -pos;
+    }
+
+    size_t i = pos >> 3;
+    unsigned int s = pos & 7;
+    if (i >= len)
+	return 0;
+
+    size_t n = (len - i < 8) ? len - i : 8;
+    uint64_t v = raster_load(row + i, n);
+    if (s && i + 8 < len)
+	return (v << s) | (row[i + 8] >> (8 - s));
+    return v << s;
+}
+
+static inline uint64_t
+raster_rop(uint64_t d, uint64_t s, enum EPD_ROP rop)
+{
+    switch (rop) {
+    case ROP_AND:    return d & s;
+    case ROP_OR:     return d | s;
+    case ROP_XOR:    return d ^ s;
+    case ROP_INVERT: return ~s;
+    case ROP_COPY:
+    default:         return s;
+    }
+}
+
+size_t
+RASTER_blit(const struct RasterBuf *Dst, const uint8_t *Src, size_t w,
+	    size_t h, size_t stride, long x, long y, enum EPD_ROP rop)
+{
+    /* Clip to the destination, (sx, sy) is the first source pixel */
+    long sx = 0, sy = 0;
+    long x1 = x + (long)w, y1 = y + (long)h;
+
+    if (x < 0) {
+	sx = -x;
+	x = 0;
+    }
+    if (y < 0) {
+	sy = -y;
+	y = 0;
+    }
+    if (x1 > (long)Dst->width)
+	x1 = Dst->width;
+    if (y1 > (long)Dst->height)
+	y1 = Dst->height;
+    if (x >= x1 || y >= y1)
+	return 0;
+
+    const size_t src_len = (w + 7) / 8;
+    const size_t first = x >> 3, last = (x1 - 1) >> 3;
+
+    for (long row = y; row < y1; ++row) {
+	const uint8_t *src = Src + (size_t)(sy + row - y) * stride;
+	uint8_t *dst = Dst->buf + (size_t)row * Dst->stride;
+
+	for (size_t byte = first; byte <= last; byte += 8) {
+	    size_t n = (last - byte + 1 < 8) ? last - byte + 1 : 8;
+	    long bit = (long)byte * 8;	/* First column of the word */
+
+	    /* Columns x to x1 - 1 within this word */
+	    uint64_t mask = ~(uint64_t)0;
+	    if (bit < x)
+		mask >>= x - bit;
+	    if (bit + 64 > x1)
+		mask &= ~(uint64_t)0 << (bit + 64 - x1);
+
+	    uint64_t d = raster_load(dst + byte, n);
+	    uint64_t s = raster_bits(src, src_len, sx + bit - x);
+	    d = (d & ~mask) | (raster_rop(d, s, rop) & mask);
+	    raster_store(dst + byte, d, n);
+	}
+    }
+
+    return (size_t)(x1 - x) * (size_t)(y1 - y);
+}
+
+/* Apply op to the bits of d set in m */
+static inline __attribute__((always_inline)) uint64_t
+raster_op(uint64_t d, uint64_t m, const enum BITMAP_OP op)
+{
+    switch (op) {
+    case OP_SET:   return d | m;
+    case OP_UNSET: return d & ~m;
+    case OP_FLIP:
+    default:       return d ^ m;
+    }
+}
+
+/* A stencil of whole bytes landing on byte boundaries inside the
+   destination, applied a byte at a time. Inlined for each op. */
+static inline __attribute__((always_inline)) size_t
+raster_stencil_aligned(const struct RasterBuf *Dst, const enum BITMAP_OP op,
+		       const uint8_t *Src, size_t bytes, size_t h,
+		       size_t stride, long x, long y)
+{
+    uint8_t *dst = Dst->buf + (size_t)y * Dst->stride + (x >> 3);
+    size_t n = 0;
+
+    for (size_t row = 0; row < h; ++row) {
+	for (size_t i = 0; i < bytes; ++i) {
+	    dst[i] = raster_op(dst[i], Src[i], op);
+	    n += __builtin_popcount(Src[i]);
+	}
+	Src += stride;
+	dst += Dst->stride;
+    }
+
+    return n;
+}
+
+size_t
+RASTER_stencil(const struct RasterBuf *Dst, enum BITMAP_OP op,
+	       const uint8_t *Src, size_t w, size_t h, size_t stride,
+	       long x, long y)
+{
+    /* Glyphs mostly land whole on byte boundaries */
+    if (!(x & 7) && !(w & 7) && x >= 0 && y >= 0
+	&& x + (long)w <= (long)Dst->width && y + (long)h <= (long)Dst->height) {
+	switch (op) {
+	case OP_SET:
+	    return raster_stencil_aligned(Dst, OP_SET, Src, w / 8, h,
+					  stride, x, y);
+	case OP_UNSET:
+	    return raster_stencil_aligned(Dst, OP_UNSET, Src, w / 8, h,
+					  stride, x, y);
+	case OP_FLIP:
+	    return raster_stencil_aligned(Dst, OP_FLIP, Src, w / 8, h,
+					  stride, x, y);
+	}
+    }
+
+    /* Otherwise by words as the blitter */
+    long sx = 0, sy = 0;
+    long x1 = x + (long)w, y1 = y + (long)h;
+
+    if (x < 0) {
+	sx = -x;
+	x = 0;
+    }
+    if (y < 0) {
+	sy = -y;
+	y = 0;
+    }
+    if (x1 > (long)Dst->width)
+	x1 = Dst->width;
+    if (y1 > (long)Dst->height)
+	y1 = Dst->height;
+    if (x >= x1 || y >= y1)
+	return 0;
+
+    const size_t src_len = (w + 7) / 8;
+    const size_t first = x >> 3, last = (x1 - 1) >> 3;
+    size_t n = 0;
+
+    for (long row = y; row < y1; ++row) {
+	const uint8_t *src = Src + (size_t)(sy + row - y) * stride;
+	uint8_t *dst = Dst->buf + (size_t)row * Dst->stride;
+
+	for (size_t byte = first; byte <= last; byte += 8) {
+	    size_t len = (last - byte + 1 < 8) ? last - byte + 1 : 8;
+	    long bit = (long)byte * 8;
+
+	    uint64_t mask = ~(uint64_t)0;
+	    if (bit < x)
+		mask >>= x - bit;
+	    if (bit + 64 > x1)
+		mask &= ~(uint64_t)0 << (bit + 64 - x1);
+
+	    uint64_t s = raster_bits(src, src_len, sx + bit - x) & mask;
+	    if (!s)
+		continue;
+	    uint64_t d = raster_load(dst + byte, len);
+	    raster_store(dst + byte, raster_op(d, s, op), len);
+	    n += __builtin_popcountll(s);
+	}
+    }
+
+    return n;
+}
+
+size_t
+RASTER_span(const struct RasterBuf *Dst, enum BITMAP_OP op,
+	    const uint8_t *stipple, long x0, long x1, long y)
+{
+    if (x0 > x1) {
+	long t = x0; x0 = x1; x1 = t;
+    }
+    if (y < 0 || y >= (long)Dst->height || x1 < 0 || x0 >= (long)Dst->width)
+	return 0;
+    if (x0 < 0)
+	x0 = 0;
+    if (x1 >= (long)Dst->width)
+	x1 = Dst->width - 1;
+
+    uint8_t *row = Dst->buf + (size_t)y * Dst->stride;
+    size_t first = x0 >> 3, last = x1 >> 3;
+    uint8_t pattern = stipple ? stipple[y & 7] : 0xFF;
+    uint8_t head = (0xFF >> (x0 & 7)) & pattern;
+    uint8_t tail = (0xFF << (7 - (x1 & 7))) & pattern;
+
+    if (first == last)
+	head &= tail;
+
+    switch (op) {
+    case OP_SET:
+	row[first] |= head;
+	if (first != last) {
+	    if (pattern == 0xFF)
+		memset(row + first + 1, 0xFF, last - first - 1);
+	    else
+		for (size_t i = first + 1; i < last; ++i)
+		    row[i] |= pattern;
+	    row[last] |= tail;
+	}
+	break;
+    case OP_UNSET:
+	row[first] &= ~head;
+	if (first != last) {
+	    if (pattern == 0xFF)
+		memset(row + first + 1, 0x00, last - first - 1);
+	    else
+		for (size_t i = first + 1; i < last; ++i)
+		    row[i] &= ~pattern;
+	    row[last] &= ~tail;
+	}
+	break;
+    case OP_FLIP:
+	row[first] ^= head;
+	if (first != last) {
+	    for (size_t i = first + 1; i < last; ++i)
+		row[i] ^= pattern;
+	    row[last] ^= tail;
+	}
+	break;
+    }
+
+    return (size_t)(x1 - x0 + 1);
+}
+
+size_t
+RASTER_rect(const struct RasterBuf *Dst, enum BITMAP_OP op,
+	    const uint8_t *stipple, long x, long y, long w, long h, int fill)
+{
+    const long height = Dst->height;
+    size_t n = 0;
+
+    if (w <= 0 || h <= 0)
+	return 0;
+
+    /* Only the rows of Dst, y + h may be beyond the range of long */
+    long first = (y > 0) ? y : 0;
+    int bottom = (y <= height - h);
+    long last = bottom ? y + h - 1 : height - 1;
+
+    for (long row = first; row <= last; ++row) {
+	if (fill || row == y || (bottom && row == last)) {
+	    n += RASTER_span(Dst, op, stipple, x, x + w - 1, row);
+	} else {
+	    n += RASTER_span(Dst, op, stipple, x, x, row);
+	    if (w > 1)
+		n += RASTER_span(Dst, op, stipple, x + w - 1, x + w - 1, row);
+	}
+    }
+
+    return n;
+}
+
+/* Largest product of the diameters of an ellipse, the square of
+   which fits in int64_t */
+#define RASTER_ELLIPSE_MAX 3037000499
+
+/* Half widths of rows lo to hi of an ellipse with squared diameters a
+   and b, ext[dy - lo] is the largest dx with (dx, dy) inside the
+   ellipse grown by half a pixel, so the outline passes through pixel
+   centres. The first row is bisected and the boundary then tracked
+   incrementally in integers. */
+static void
+raster_ellipse_extents(int64_t a, int64_t b, long rx, long lo, long hi,
+		       long *ext)
+{
+    const int64_t ab = a * b;
+    int64_t room = ab - 4 * (int64_t)lo * lo * a;
+    long dx = 0, top = rx;
+
+    while (dx < top) {
+	long mid = top - (top - dx) / 2;
+	if (4 * (int64_t)mid * mid * b <= room)
+	    dx = mid;
+	else
+	    top = mid - 1;
+    }
+
+    for (long dy = lo; dy <= hi; ++dy) {
+	room = ab - 4 * (int64_t)dy * dy * a;
+	while (dx > 0 && 4 * (int64_t)dx * dx * b > room)
+	    --dx;
+	ext[dy - lo] = dx;
+    }
+}
+
+size_t
+RASTER_ellipse(const struct RasterBuf *Dst, enum BITMAP_OP op,
+	       const uint8_t *stipple, long cx, long cy, long rx, long ry,
+	       int fill)
+{
+    const long height = Dst->height;
+    size_t n = 0;
+
+    if (rx < 0 || ry < 0)
+	return 0;
+    if (rx > RASTER_ELLIPSE_MAX / 2 || ry > RASTER_ELLIPSE_MAX / 2
+	|| (2 * (int64_t)rx + 1) * (2 * (int64_t)ry + 1)
+	> RASTER_ELLIPSE_MAX) {
+	errno = EINVAL;
+	log_err("Ellipse radii %ld and %ld are too large.", rx, ry);
+	return 0;
+    }
+
+    /* Only the rows of Dst, dy0 to dy1 */
+    long dy0 = (cy > ry) ? -ry : -cy;
+    long dy1 = (cy < height - 1 - ry) ? ry : height - 1 - cy;
+    if (dy0 > dy1)
+	return 0;
+
+    /* The half widths of |dy| from lo to hi, and the rows either side
+       the outline compares them with */
+    long lo = (dy0 > 0) ? dy0 : (dy1 < 0) ? -dy1 : 0;
+    long hi = (-dy0 > dy1) ? -dy0 : dy1;
+    if (lo > 0)
+	--lo;
+    long *ext = malloc((hi - lo + 2) * sizeof *ext);
+    if (NULL == ext) {
+	log_err("Memory error.");
+	return 0;
+    }
+    const int64_t a = (2 * (int64_t)rx + 1) * (2 * (int64_t)rx + 1);
+    const int64_t b = (2 * (int64_t)ry + 1) * (2 * (int64_t)ry + 1);
+    raster_ellipse_extents(a, b, rx, lo, (hi < ry) ? hi + 1 : ry, ext);
+    if (hi == ry)
+	ext[hi - lo + 1] = -1;	/* Beyond the last row */
+
+    for (long dy = dy0; dy <= dy1; ++dy) {
+	long i = labs(dy) - lo, e = ext[i];
+
+	/* The outline is the pixels with a neighbour outside, those
+	   with |dx| <= inner are surrounded */
+	long inner = -1;
+	if (!fill) {
+	    inner = e - 1;
+	    if (ext[i + 1] < inner)
+		inner = ext[i + 1];
+	    if (i > 0 && ext[i - 1] < inner)
+		inner = ext[i - 1];
+	}
+
+	if (inner < 0) {
+	    n += RASTER_span(Dst, op, stipple, cx - e, cx + e, cy + dy);
+	} else {
+	    n += RASTER_span(Dst, op, stipple, cx - e, cx - inner - 1, cy + dy);
+	    n += RASTER_span(Dst, op, stipple, cx + inner + 1, cx + e, cy + dy);
+	}
+    }
+
+    free(ext);
+    return n;
+}
+
+/* An edge crossing a scanline, at x in 1/256 pixels */
+struct Crossing {
+    long x;
+    int winding;
+};
+
+/* Smallest integer not less than a / 256 */
+static long
+raster_ceil256(long a)
+{
+    return (a >= 0) ? (a + 255) / 256 : -((-a) / 256);
+}
+
+int
+RASTER_polygon(const struct RasterBuf *Dst, enum BITMAP_OP op,
+	       const uint8_t *stipple, const struct Coordinate *Vertices,
+	       size_t n, enum FILL_RULE rule, size_t *pixels)
+{
+    *pixels = 0;
+    if (n < 3)
+	return 0;
+
+    struct Crossing *X = malloc(n * sizeof *X);
+    if (NULL == X) {
+	log_err("Memory error.");
+	return 1;
+    }
+
+    long ymin = Vertices[0].y, ymax = Vertices[0].y;
+    for (size_t i = 1; i < n; ++i) {
+	if ((long)Vertices[i].y < ymin)
+	    ymin = Vertices[i].y;
+	if ((long)Vertices[i].y > ymax)
+	    ymax = Vertices[i].y;
+    }
+    if (ymin < 0)
+	ymin = 0;
+    if (ymax >= (long)Dst->height)
+	ymax = Dst->height - 1;
+
+    for (long y = ymin; y <= ymax; ++y) {
+	const long yc2 = 2 * y + 1;	/* Doubled row centre */
+	size_t nx = 0;
+
+	/* Edges whose half open span of rows contains the centre */
+	for (size_t i = 0; i < n; ++i) {
+	    const struct Coordinate *A = &Vertices[i];
+	    const struct Coordinate *B = &Vertices[(i + 1) % n];
+	    long ay2 = 2 * (long)A->y, by2 = 2 * (long)B->y;
+	    int winding = (by2 > ay2) ? 1 : -1;
+
+	    if (ay2 == by2)
+		continue;
+	    if (winding < 0) {
+		const struct Coordinate *T = A; A = B; B = T;
+		long t = ay2; ay2 = by2; by2 = t;
+	    }
+	    if (yc2 < ay2 || yc2 >= by2)
+		continue;
+
+	    long dx = (long)B->x - (long)A->x;
+	    X[nx].x = (long)A->x * 256 + (yc2 - ay2) * dx * 256 / (by2 - ay2);
+	    X[nx].winding = winding;
+	    ++nx;
+	}
+
+	/* Few crossings per row, insertion sort */
+	for (size_t i = 1; i < nx; ++i) {
+	    struct Crossing c = X[i];
+	    size_t j = i;
+	    for (; j > 0 && X[j - 1].x > c.x; --j)
+		X[j] = X[j - 1];
+	    X[j] = c;
+	}
+
+	/* Pixels with centres in [left, right) are inside */
+	int count = 0;
+	for (size_t i = 0; i + 1 < nx; ++i) {
+	    count += (rule == NON_ZERO_FILL) ? X[i].winding : 1;
+	    int inside = (rule == NON_ZERO_FILL) ? (count != 0) : (count & 1);
+	    if (!inside)
+		continue;
+
+	    long left = raster_ceil256(X[i].x - 128);
+	    long right = raster_ceil256(X[i + 1].x - 128) - 1;
+	    if (left <= right)
+		*pixels += RASTER_span(Dst, op, stipple, left, right, y);
+	}
+    }
+
+    free(X);
+    return 0;
+}
+
+/* 8x8 Bayer matrix, the rank of each pixel in the ordered dither */
+static const uint8_t raster_bayer[8][8] =
+    { {  0, 32,  8, 40,  2, 34, 10, 42 },
+      { 48, 16, 56, 24, 50, 18, 58, 26 },
+      { 12, 44,  4, 36, 14, 46,  6, 38 },
+      { 60, 28, 52, 20, 62, 30, 54, 22 },
+      {  3, 35, 11, 43,  1, 33,  9, 41 },
+      { 51, 19, 59, 27, 49, 17, 57, 25 },
+      { 15, 47,  7, 39, 13, 45,  5, 37 },
+      { 63, 31, 55, 23, 61, 29, 53, 21 } };
+
+void
+RASTER_grey_stipple(uint8_t pattern[8], unsigned int level)
+{
+    /* A pixel is set when its rank is below level */
+    for (size_t y = 0; y < 8; ++y) {
+	pattern[y] = 0;
+	for (size_t x = 0; x < 8; ++x)
+	    if (raster_bayer[y][x] < level)
+		pattern[y] |= 0x80 >> x;
+    }
+}
+
+/* Floyd-Steinberg error diffusion of a row, errors are kept in 16ths
+   of a level so the weights divide exactly */
+static void
+raster_diffuse(uint8_t *bits, const uint8_t *grey, size_t n, size_t y,
+	       int16_t *err)
+{
+    const int16_t *cur = err + ((y & 1) * (n + 2));
+    int16_t *next = err + ((~y & 1) * (n + 2));
+    int right = 0;
+
+    memset(next, 0, (n + 2) * sizeof *next);
+    memset(bits, 0, (n + 7) / 8);
+
+    for (size_t i = 0; i < n; ++i) {
+	int v = (grey[i] * 16) + cur[i + 1] + right;
+	int white = (v >= 128 * 16);
+	int e = v - (white ? 255 * 16 : 0);
+
+	if (white)
+	    bits[i >> 3] |= 0x80 >> (i & 7);
+	right = (e * 7) / 16;
+	next[i] += (e * 3) / 16;
+	next[i + 1] += (e * 5) / 16;
+	next[i + 2] += e / 16;
+    }
+
+    return;
+}
+
+void
+RASTER_dither(uint8_t *bits, const uint8_t *grey, size_t n, size_t y,
+	      enum EPD_DITHER mode, int16_t *err)
+{
+    uint8_t t[8];
+    size_t i;
+
+    if (mode == DITHER_DIFFUSION) {
+	raster_diffuse(bits, grey, n, y, err);
+	return;
+    }
+
+    /* Levels from 0 to 255 span the 64 ranks, 4 apiece */
+    for (size_t k = 0; k < 8; ++k)
+	t[k] = (mode == DITHER_ORDERED) ? (raster_bayer[y % 8][k] * 4) + 2
+	    : 128;
+
+    /* A byte of 8 branchless comparisons at a time */
+    for (i = 0; i + 8 <= n; i += 8) {
+	uint8_t b = 0;
+	for (size_t k = 0; k < 8; ++k)
+	    b |= (uint8_t)(grey[i + k] >= t[k]) << (7 - k);
+	bits[i >> 3] = b;
+    }
+    if (i < n) {
+	uint8_t b = 0;
+	for (size_t k = 0; i + k < n; ++k)
+	    b |= (uint8_t)(grey[i + k] >= t[k]) << (7 - k);
+	bits[i >> 3] = b;
+    }
+
+    return;
+}
+
+/* Reverse the bits within each byte of v */
+static inline uint64_t
+raster_reverse_bits(uint64_t v)
+{
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return v;
+}
+
+/* Transpose the 8x8 bit matrix held with row r in byte r of the big
+   endian word v, exchanging bits across the diagonal in 2x2, 4x4 then
+   8x8 blocks */
+static inline uint64_t
+raster_transpose8(uint64_t v)
+{
+    uint64_t t;
+
+    t = (v ^ (v >> 7)) & 0x00AA00AA00AA00AAULL;
+    v ^= t ^ (t << 7);
+    t = (v ^ (v >> 14)) & 0x0000CCCC0000CCCCULL;
+    v ^= t ^ (t << 14);
+    t = (v ^ (v >> 28)) & 0x00000000F0F0F0F0ULL;
+    v ^= t ^ (t << 28);
+    return v;
+}
+
+/* Copy the n byte row s to d, reversing its pixels if flip. The
+   invert mask is the same in every byte, so words are moved in native
+   order. */
+static void
+raster_orient_row(uint8_t *d, const uint8_t *s, size_t n, int flip,
+		  uint64_t invert)
+{
+    size_t i = 0;
+    uint64_t v;
+
+    if (!flip) {
+	for (; i + 8 <= n; i += 8) {
+	    memcpy(&v, s + i, 8);
+	    v ^= invert;
+	    memcpy(d + i, &v, 8);
+	}
+	for (; i < n; ++i)
+	    d[i] = s[i] ^ invert;
+	return;
+    }
+
+    /* Byte i of the reversed row is byte n - 1 - i with its bits
+       reversed */
+    for (; i + 8 <= n; i += 8) {
+	memcpy(&v, s + n - i - 8, 8);
+	v = raster_reverse_bits(__builtin_bswap64(v)) ^ invert;
+	memcpy(d + i, &v, 8);
+    }
+    for (; i < n; ++i)
+	d[i] = raster_reverse_bits(s[n - 1 - i]) ^ invert;
+}
+
+void
+RASTER_orient(const struct RasterBuf *Dst, const uint8_t *Src,
+	      size_t stride, int ops)
+{
+    const uint64_t invert = (ops & RASTER_INVERT) ? ~0ULL : 0;
+
+    if (!(ops & RASTER_TRANSPOSE)) {
+	for (size_t y = 0; y < Dst->height; ++y) {
+	    size_t v = (ops & RASTER_FLIP_Y) ? Dst->height - 1 - y : y;
+	    raster_orient_row(Dst->buf + (y * Dst->stride), Src + (v * stride),
+			      Dst->stride, ops & RASTER_FLIP_X, invert);
+	}
+	return;
+    }
+
+    /* Each 8x8 block of Dst is the transpose of a block of Src, which
+       is reflected first: flipping its rows reverses the bytes of the
+       word and flipping its columns the bits of each byte */
+    const size_t cols = Dst->width / 8, rows = Dst->height / 8;
+    for (size_t by = 0; by < rows; ++by) {
+	size_t u = (ops & RASTER_FLIP_X) ? rows - 1 - by : by;
+	for (size_t bx = 0; bx < cols; ++bx) {
+	    size_t v = 8 * ((ops & RASTER_FLIP_Y) ? cols - 1 - bx : bx);
+	    const uint8_t *s = Src + (v * stride) + u;
+	    uint64_t w = 0;
+
+	    for (size_t r = 0; r < 8; ++r)
+		w |= (uint64_t)s[r * stride] << (56 - 8 * r);
+	    if (ops & RASTER_FLIP_Y)
+		w = __builtin_bswap64(w);
+	    if (ops & RASTER_FLIP_X)
+		w = raster_reverse_bits(w);
+	    w = raster_transpose8(w) ^ invert;
+
+	    uint8_t *d = Dst->buf + (8 * by * Dst->stride) + bx;
+	    for (size_t r = 0; r < 8; ++r)
+		d[r * Dst->stride] = w >> (56 - 8 * r);
+	}
+    }
+}
@@ -0,0 +1,113 @@
+/* wsepd_raster.h
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Raster kernels on 1bpp buffers, independent of the display object.
+ * Rows are stored most significant bit first, a set bit is white.
+ *
+ */
+
+#ifndef WSEPD_RASTER_H
+#define WSEPD_RASTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libwsepd.h"
+
+/* Pixel operation of a write mode */
+enum BITMAP_OP { OP_SET, OP_UNSET, OP_FLIP };
+
+/* A 1bpp buffer */
+struct RasterBuf {
+    uint8_t *buf;
+    size_t stride;		/* Bytes per row */
+    size_t width, height;	/* Pixels */
+};
+
+/* Combine the w x h source at Src (stride bytes per row) into Dst
+   with its top left corner at (x, y), clipped to Dst. Returns the
+   number of destination pixels written. */
+size_t RASTER_blit(const struct RasterBuf *Dst, const uint8_t *Src,
+		   size_t w, size_t h, size_t stride, long x, long y,
+		   enum EPD_ROP rop);
+
+/* Apply op to the destination pixels under the set bits of the w x h
+   stencil at Src (stride bytes per row) placed at (x, y), clipped to
+   Dst. Returns the number of pixels drawn. */
+size_t RASTER_stencil(const struct RasterBuf *Dst, enum BITMAP_OP op,
+		      const uint8_t *Src, size_t w, size_t h, size_t stride,
+		      long x, long y);
+
+/* The functions below apply op to the pixels they cover, clipped to
+   Dst, and return the number of pixels drawn. Where stipple is not
+   NULL only pixels whose bit is set in the 8x8 pattern (row y % 8,
+   bit x % 8 from the most significant) are drawn. */
+
+/* Pixels x0 to x1 (inclusive) of row y */
+size_t RASTER_span(const struct RasterBuf *Dst, enum BITMAP_OP op,
+		   const uint8_t *stipple, long x0, long x1, long y);
+
+/* The w x h rectangle at (x, y), filled or as a one pixel outline */
+size_t RASTER_rect(const struct RasterBuf *Dst, enum BITMAP_OP op,
+		   const uint8_t *stipple, long x, long y, long w, long h,
+		   int fill);
+
+/* The ellipse centred on (cx, cy) with radii rx and ry, filled or as
+   a connected one pixel outline. Each pixel is drawn once, so toggled
+   shapes have no seams. Radii whose diameters multiply to more than
+   3037000499, a circle of radius above 27553, are refused. */
+size_t RASTER_ellipse(const struct RasterBuf *Dst, enum BITMAP_OP op,
+		      const uint8_t *stipple, long cx, long cy,
+		      long rx, long ry, int fill);
+
+/* Scanline fill of the closed polygon through the n vertices, pixels
+   whose centres are inside by rule. Returns non-zero on memory
+   error. */
+int RASTER_polygon(const struct RasterBuf *Dst, enum BITMAP_OP op,
+		   const uint8_t *stipple, const struct Coordinate *Vertices,
+		   size_t n, enum FILL_RULE rule, size_t *pixels);
+
+/* The 8x8 ordered dither pattern with level of its 64 pixels set */
+void RASTER_grey_stipple(uint8_t pattern[8], unsigned int level);
+
+/* Pack the n grey levels of row y (0 black to 255 white) into 1bpp
+   bits, set for white, by mode. Ordered dithering thresholds pixel x
+   of the row by the 8x8 Bayer matrix at (x % 8, y % 8). Diffusion
+   carries error between rows in err, 2 * (n + 2) values zeroed before
+   row 0. */
+void RASTER_dither(uint8_t *bits, const uint8_t *grey, size_t n, size_t y,
+		   enum EPD_DITHER mode, int16_t *err);
+
+/* Orientation of a whole frame as bit matrix operations */
+#define RASTER_TRANSPOSE 0x01
+#define RASTER_FLIP_X    0x02
+#define RASTER_FLIP_Y    0x04
+#define RASTER_INVERT    0x08
+
+/* Fill Dst from Src (stride bytes per row) by ops. Src is Dst's size,
+   or its transpose with RASTER_TRANSPOSE. Pixel (x, y) of Dst is pixel
+   (u, v) of Src, where (u, v) is (x, y) or (y, x) if transposed, then
+   reflected in the flipped axes of Src, then inverted with
+   RASTER_INVERT. Rows of Src must be whole bytes if flipped in x, and
+   rows of both if transposed. */
+void RASTER_orient(const struct RasterBuf *Dst, const uint8_t *Src,
+		   size_t stride, int ops);
+
+#endif /* WSEPD_RASTER_H */
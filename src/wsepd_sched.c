@@ -0,0 +1,221 @@
+/* wsepd_sched.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Shared bus scheduler, a single thread owns the bus. Each job moves
+ * through the steps below, the transmit step (setup, upload and
+ * activation) is the only one that occupies the bus for long and runs
+ * while earlier panels wait on their busy pin.
+ *
+ *   RESET -> TRANSMIT -> BUSY -> (SLEEP) -> DONE
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ert_log.h>
+
+#include "wsepd_sched.h"
+#include "wsepd_transport.h"
+#include "wsepd_clock.h"
+#include "waveshare2.9.h"
+
+/* Position of a job in its sequence, the sleep step is taken as soon
+   as the panel leaves STEP_BUSY */
+enum SCHED_STEP { STEP_TRANSMIT, STEP_BUSY, STEP_DONE };
+
+/* Pulse the reset line of every job that needs it together, so the
+   reset delays are paid once however many panels are reset. The
+   pulse reaches every panel on a line, so jobs sharing one are all
+   marked for reset by the caller. */
+static void
+sched_reset(struct SchedJob *Jobs, size_t n)
+{
+    static const int levels[] = { GPIO_HIGH, GPIO_LOW, GPIO_HIGH };
+    struct Transport *Timer = NULL;
+
+    for (size_t l = 0; l < sizeof levels / sizeof *levels; ++l) {
+	for (size_t i = 0; i < n; ++i) {
+	    if (!Jobs[i].reset)
+		continue;
+	    bus_gpio_write(Jobs[i].Bus, Jobs[i].Bus->pins.rst, levels[l]);
+	    Timer = Jobs[i].Bus;
+	}
+	if (Timer)
+	    bus_delay(Timer, RST_DELAY_MS);
+    }
+
+    return;
+}
+
+/* Setup, upload and activate one job, leaving its panel busy. Returns
+   non-zero on failure. */
+static int
+sched_transmit(struct SchedJob *Job)
+{
+    uint64_t start = clock_now_us();
+
+    if (Job->reset && configure_epd(Job->Bus, Job->Display))
+	return 1;
+    if (Job->lut && run_script(Job->Bus, Job->lut, Job->lut_len))
+	return 1;
+
+    if (set_display_window(Job->Bus, Job->Display, NULL)
+	|| write_ram_frame(Job->Bus, Job->frame, Job->len)
+	|| activate_display(Job->Bus))
+	return 1;
+
+    uint64_t end = clock_now_us();
+    Job->stats.bytes = Job->len;
+    Job->stats.upload_us = end - start;
+    Job->busy_start_us = end;
+
+    return 0;
+}
+
+/* Returns non-zero once the busy pin of Job has fallen, or it has been
+   busy for longer than BUSY_TIMEOUT_MS (setting rc) */
+static int
+sched_ready(struct SchedJob *Job, uint64_t now)
+{
+    if (bus_gpio_read(Job->Bus, Job->Bus->pins.busy) != GPIO_HIGH) {
+	Job->stats.busy_us = now - Job->busy_start_us;
+	return 1;
+    }
+
+    if (now - Job->busy_start_us > (uint64_t)BUSY_TIMEOUT_MS * 1000) {
+	errno = EBUSY;
+	log_err("Device not leaving busy state. Is power connected?");
+	Job->rc = 1;
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Run every job to completion. The bus is given to the first job
+   waiting to transmit, between transmissions the busy pins are
+   checked and finished panels put to sleep. With nothing to do the
+   busy pins are polled every BUSY_POLL_MS. */
+int
+SCHED_run(struct SchedJob *Jobs, size_t n, struct EPD_BUS_STATS *Stats)
+{
+    size_t remaining = n;
+    uint64_t start = clock_now_us(), bus_us = 0;
+    int rc = 0;
+
+    if (n == 0) {
+	if (Stats)
+	    *Stats = (struct EPD_BUS_STATS){ 0 };
+	return 0;
+    }
+
+    enum SCHED_STEP *steps = malloc(n * sizeof *steps);
+    if (NULL == steps) {
+	log_err("Memory error.");
+	return 1;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+	steps[i] = STEP_TRANSMIT;
+	Jobs[i].rc = 0;
+	Jobs[i].stats = (struct EPD_PANEL_STATS){ 0 };
+    }
+
+    sched_reset(Jobs, n);
+
+    while (remaining > 0) {
+	int progressed = 0;
+	uint64_t now = clock_now_us();
+
+	/* Short steps first, panels that finished are slept at once */
+	for (size_t i = 0; i < n; ++i) {
+	    if (steps[i] != STEP_BUSY || !sched_ready(&Jobs[i], now))
+		continue;
+
+	    if (Jobs[i].sleep && !Jobs[i].rc && sleep_epd(Jobs[i].Bus))
+		Jobs[i].rc = 1;
+	    Jobs[i].stats.elapsed_us = clock_now_us() - start;
+	    steps[i] = STEP_DONE;
+	    --remaining;
+	    progressed = 1;
+	}
+
+	/* Then the bus to the next panel waiting to transmit */
+	for (size_t i = 0; i < n; ++i) {
+	    if (steps[i] != STEP_TRANSMIT)
+		continue;
+
+	    if (sched_transmit(&Jobs[i])) {
+		log_err("Failed to transmit to panel %zu.", i);
+		Jobs[i].rc = 1;
+		Jobs[i].stats.elapsed_us = clock_now_us() - start;
+		steps[i] = STEP_DONE;
+		--remaining;
+	    } else {
+		bus_us += Jobs[i].stats.upload_us;
+		steps[i] = STEP_BUSY;
+	    }
+	    progressed = 1;
+	    break;
+	}
+
+	if (!progressed)
+	    for (size_t i = 0; i < n; ++i)
+		if (steps[i] == STEP_BUSY) {
+		    bus_delay(Jobs[i].Bus, BUSY_POLL_MS);
+		    break;
+		}
+    }
+
+    /* Throughput */
+    size_t bytes = 0;
+    uint64_t busy_us = 0;
+    for (size_t i = 0; i < n; ++i) {
+	struct EPD_PANEL_STATS *P = &Jobs[i].stats;
+	P->bytes_per_s = P->upload_us
+	    ? (double)P->bytes * 1e6 / P->upload_us : 0;
+	bytes += P->bytes;
+	if (P->busy_us > busy_us)
+	    busy_us = P->busy_us;
+	if (Jobs[i].rc)
+	    rc = 1;
+	log_debug("Panel %zu: %zuB in %lluus (%.0fB/s), busy %lluus.", i,
+		  P->bytes, (unsigned long long)P->upload_us, P->bytes_per_s,
+		  (unsigned long long)P->busy_us);
+    }
+
+    uint64_t elapsed = clock_now_us() - start;
+    if (Stats) {
+	Stats->panels = n;
+	Stats->bytes = bytes;
+	Stats->elapsed_us = elapsed;
+	Stats->bus_us = bus_us;
+	Stats->busy_us = busy_us;
+	Stats->bytes_per_s = elapsed ? (double)bytes * 1e6 / elapsed : 0;
+	Stats->panels_per_s = elapsed ? (double)n * 1e6 / elapsed : 0;
+    }
+    log_info("%zu panels, %zuB in %lluus (bus active %lluus).", n, bytes,
+	     (unsigned long long)elapsed, (unsigned long long)bus_us);
+
+    free(steps);
+    return rc;
+}
@@ -0,0 +1,61 @@
+/* wsepd_sched.h
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Shared bus scheduler. Panels on one SPI bus spend most of a refresh
+ * with the bus idle while their busy pin is high. The scheduler
+ * queues the init, upload, activate and sleep steps of many panels and
+ * transmits to one panel while the others are busy, so N panels take
+ * roughly one refresh plus N uploads.
+ *
+ */
+
+#ifndef WSEPD_SCHED_H
+#define WSEPD_SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libwsepd.h"
+
+struct Transport;
+
+/* One panel's full refresh. The caller fills in the request, the
+   scheduler the results. */
+struct SchedJob {
+    struct Transport *Bus;
+    EPD Display;		/* Geometry for the controller setup */
+    const uint8_t *frame;
+    size_t len;
+    int reset;			/* Reset and configure the controller,
+				   set for all jobs on one RST line */
+    const uint8_t *lut;		/* LUT script to load first, or NULL */
+    size_t lut_len;
+    int sleep;			/* Deep sleep once displayed */
+
+    int rc;			/* Non-zero if any step failed */
+    uint64_t busy_start_us;	/* Activation time */
+    struct EPD_PANEL_STATS stats;
+};
+
+/* Runs every job to completion, filling Stats (when not NULL) with
+   the aggregate throughput. Returns non-zero if any job failed. */
+int SCHED_run(struct SchedJob *Jobs, size_t n, struct EPD_BUS_STATS *Stats);
+
+#endif /* WSEPD_SCHED_H */
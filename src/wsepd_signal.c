@@ -29,58 +29,111 @@
 
 #include <signal.h>
 #include <string.h>
+#include <pthread.h>
 #include "libwsepd.h"
 #include "ert_log.h"
 
-volatile sig_atomic_t done = 0;
+/* Signal dispositions belong to the process, this state is private to
+   the module and shared by every display through the powered count */
+static volatile sig_atomic_t done = 0;
+static volatile sig_atomic_t received = 0; /* Signal number caught */
 static struct sigaction action;
 
+/* Number of powered devices, the handler is installed while any
+   device is powered */
+static int powered = 0;
+static pthread_mutex_t powered_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Handler sets done to one, should be called when signal is recieved */
 static void
-set_signal_received(__attribute__((unused)) int signum)
+set_signal_received(int signum)
 {
+  received = signum;
   done = 1;
   return;
 }
 
-/* Blocks SIGINT and SIGTERM */
-int
-create_signal_handler(void)
+/* Install the current action for SIGINT and SIGTERM */
+static int
+apply_signal_action(void)
 {
-  if (NULL == memset(&action, 0, sizeof action))
-    goto out;
   if (0 != sigaction(SIGINT, &action, NULL))
-    goto out;
+    return 1;
   if (0 != sigaction(SIGTERM, &action, NULL))
-    goto out;
+    return 1;
 
   return 0;
- out:
-  log_err("Failed to start signal handler.");
-  return 1;
 }
 
-void
-start_signal_handler(void)
+/* Prepares the SIGINT and SIGTERM action, defaults until a device is
+   powered */
+int
+create_signal_handler(void)
 {
-  action.sa_handler = &set_signal_received;
-  return;
+  pthread_mutex_lock(&powered_lock);
+  int rc = 0;
+
+  if (powered == 0) {
+    if (NULL == memset(&action, 0, sizeof action))
+      rc = 1;
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = SIG_DFL;
+  }
+
+  pthread_mutex_unlock(&powered_lock);
+
+  if (rc)
+    log_err("Failed to start signal handler.");
+  return rc;
 }
 
+/* Called as a device is powered, SIGINT and SIGTERM only set done
+   while any device is powered */
 void
-stop_signal_handler(void)
+start_signal_handler(void)
 {
-  action.sa_handler = SIG_DFL;
+  pthread_mutex_lock(&powered_lock);
+
+  if (powered++ == 0) {
+    action.sa_handler = &set_signal_received;
+    if (apply_signal_action())
+      log_err("Failed to install signal handler.");
+  }
+
+  pthread_mutex_unlock(&powered_lock);
   return;
 }
 
+/* Called once a device is in deep sleep. When no device remains
+   powered the default actions are restored, and a signal deferred in
+   the meantime is raised again so the process exits as it would
+   have. */
 void
-check_signal_handler(struct Epd *Display)
+stop_signal_handler(void)
 {
-  if (done) {
-    log_err("Signal recieved, cleaning up....");
-    EPD_destroy(Display);
+  pthread_mutex_lock(&powered_lock);
+
+  if (powered > 0 && --powered == 0) {
+    action.sa_handler = SIG_DFL;
+    if (apply_signal_action())
+      log_err("Failed to restore signal defaults.");
+
+    if (done) {
+      log_err("Signal recieved, devices sleeping, exiting....");
+      pthread_mutex_unlock(&powered_lock);
+      raise(received);
+      return;
+    }
   }
 
+  pthread_mutex_unlock(&powered_lock);
   return;
 }
+
+/* Returns non-zero once a signal has been deferred, the caller should
+   put its device into deep sleep */
+int
+check_signal_handler(void)
+{
+  return done;
+}
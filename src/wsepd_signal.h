@@ -29,13 +29,12 @@
 
 #include <signal.h>
 
-extern volatile sig_atomic_t done;
-
 int create_signal_handler(void); /* Returns non zero on failure */
-void start_signal_handler(void); /* Block SIGINT and SIGTERM */
-void stop_signal_handler(void);	 /* Revert to defaults */
+void start_signal_handler(void); /* Device powered, defer SIGINT/SIGTERM */
+void stop_signal_handler(void);	 /* Device asleep, revert to defaults */
 
-/* Sets done to 1 when signal received */
-void check_signal_handler(struct Epd *Display);
+/* Returns non zero when a signal has been received, the device should
+   be put to sleep */
+int check_signal_handler(void);
 
 #endif
@@ -0,0 +1,133 @@
+/* wsepd_stats.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Latency histograms and the text dump of the statistics.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <ert_log.h>
+
+#include "wsepd_stats.h"
+
+static const char *phase_names[EPD_PHASES] =
+    { [PHASE_RESET]   = "reset",
+      [PHASE_INIT]    = "init",
+      [PHASE_UPLOAD]  = "upload",
+      [PHASE_BUSY]    = "busy",
+      [PHASE_SETTLE]  = "settle",
+      [PHASE_SLEEP]   = "sleep",
+      [PHASE_REFRESH] = "refresh" };
+
+/* Histogram bucket of us, the position of its highest set bit */
+static unsigned int
+stats_bucket(uint64_t us)
+{
+    unsigned int k = 0;
+
+    while (us > 1 && k < EPD_HIST_BUCKETS - 1) {
+	us >>= 1;
+	++k;
+    }
+
+    return k;
+}
+
+void
+STATS_record(struct EPD_PHASE_STATS *Phase, uint64_t us)
+{
+    if (Phase->count == 0 || us < Phase->min_us)
+	Phase->min_us = us;
+    if (us > Phase->max_us)
+	Phase->max_us = us;
+
+    ++Phase->count;
+    Phase->total_us += us;
+    ++Phase->hist[stats_bucket(us)];
+
+    return;
+}
+
+void
+STATS_merge(struct EPD_STATS *To, const struct EPD_STATS *From)
+{
+    for (int p = 0; p < EPD_PHASES; ++p) {
+	struct EPD_PHASE_STATS *T = &To->phase[p];
+	const struct EPD_PHASE_STATS *F = &From->phase[p];
+
+	if (F->count == 0)
+	    continue;
+	if (T->count == 0 || F->min_us < T->min_us)
+	    T->min_us = F->min_us;
+	if (F->max_us > T->max_us)
+	    T->max_us = F->max_us;
+	T->count += F->count;
+	T->total_us += F->total_us;
+	for (int k = 0; k < EPD_HIST_BUCKETS; ++k)
+	    T->hist[k] += F->hist[k];
+    }
+
+    To->spi_bytes += From->spi_bytes;
+    To->spi_transfers += From->spi_transfers;
+    To->pixels += From->pixels;
+    To->full_refreshes += From->full_refreshes;
+    To->partial_refreshes += From->partial_refreshes;
+    To->skipped_refreshes += From->skipped_refreshes;
+
+    return;
+}
+
+/* One line of counters, then per phase the count, min/mean/max and
+   the non-empty histogram buckets as "<lower bound>us:<count>" */
+int
+STATS_dump(const struct EPD_STATS *Stats, FILE *stream)
+{
+    fprintf(stream, "refreshes full=%lu partial=%lu skipped=%lu "
+	    "pixels=%llu spi_bytes=%llu spi_transfers=%llu\n",
+	    Stats->full_refreshes, Stats->partial_refreshes,
+	    Stats->skipped_refreshes, (unsigned long long)Stats->pixels,
+	    (unsigned long long)Stats->spi_bytes,
+	    (unsigned long long)Stats->spi_transfers);
+
+    for (int p = 0; p < EPD_PHASES; ++p) {
+	const struct EPD_PHASE_STATS *P = &Stats->phase[p];
+	if (P->count == 0)
+	    continue;
+
+	fprintf(stream, "%-8s n=%lu min=%lluus mean=%lluus max=%lluus",
+		phase_names[p], P->count, (unsigned long long)P->min_us,
+		(unsigned long long)(P->total_us / P->count),
+		(unsigned long long)P->max_us);
+	for (int k = 0; k < EPD_HIST_BUCKETS; ++k)
+	    if (P->hist[k])
+		fprintf(stream, " %lluus:%lu",
+			k ? 1ULL << k : 0ULL, P->hist[k]);
+	fprintf(stream, "\n");
+    }
+
+    if (ferror(stream)) {
+	log_err("Failed to write statistics.");
+	return 1;
+    }
+
+    return 0;
+}
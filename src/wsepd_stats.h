@@ -0,0 +1,44 @@
+/* wsepd_stats.h
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Latency histograms and counters behind EPD_get_stats. Latencies are
+ * binned by powers of two of microseconds, so recording is a few
+ * instructions and a histogram is a fixed size.
+ *
+ */
+
+#ifndef WSEPD_STATS_H
+#define WSEPD_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "libwsepd.h"
+
+/* Add one latency of us to Phase */
+void STATS_record(struct EPD_PHASE_STATS *Phase, uint64_t us);
+
+/* Add every phase and counter of From into To */
+void STATS_merge(struct EPD_STATS *To, const struct EPD_STATS *From);
+
+/* Print Stats as text, returns non-zero on write failure */
+int STATS_dump(const struct EPD_STATS *Stats, FILE *stream);
+
+#endif /* WSEPD_STATS_H */
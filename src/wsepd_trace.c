@@ -0,0 +1,333 @@
+/* wsepd_trace.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ * Description:
+ *
+ * SPI trace ring buffer, dump and replay. Writers reserve a run of
+ * slots with a single atomic add and fill them in, so tracing costs a
+ * clock read and a copy per transfer and never blocks the bus. Once
+ * the ring is full the oldest records are overwritten.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <ert_log.h>
+
+#include "wsepd_trace.h"
+#include "wsepd_transport.h"
+#include "wsepd_clock.h"
+#include "waveshare2.9.h"
+#include "libwsepd.h"
+
+#define TRACE_HEADER_LEN 16
+#define TRACE_RECORD_LEN 8
+
+/* Capture buffer, capacity is a power of two */
+struct TraceRing {
+    size_t mask;
+    uint64_t start_us;		/* Capture start time */
+    atomic_uint_fast64_t head;	/* Records ever reserved */
+    struct TraceRecord records[];
+};
+
+/* The ring being written to (NULL when stopped) and the last ring
+   used, which is kept for EPD_trace_dump */
+static _Atomic(struct TraceRing *) Active;
+static struct TraceRing *Ring;
+
+void
+TRACE_spi(struct Transport *Bus, int dc, const uint8_t *buf, size_t len)
+{
+    struct TraceRing *R = atomic_load_explicit(&Active, memory_order_acquire);
+    if (NULL == R || len == 0)
+	return;
+
+    uint32_t t = (uint32_t)(clock_now_us() - R->start_us);
+    uint64_t slot = atomic_fetch_add_explicit(&R->head, len,
+					      memory_order_relaxed);
+    uint8_t flags = (dc ? TRACE_DC_FLAG : 0) | TRACE_START_FLAG;
+
+    for (size_t i = 0; i < len; ++i) {
+	struct TraceRecord *Rec = &R->records[(slot + i) & R->mask];
+	Rec->time_us = t;
+	Rec->byte = buf[i];
+	Rec->flags = flags;
+	Rec->bus = Bus->id;
+	flags &= ~TRACE_START_FLAG;
+    }
+
+    return;
+}
+
+/* Start capturing into a ring of at least records entries, discarding
+   any earlier capture. Must not be called while a refresh is in
+   progress. Returns non-zero on failure. */
+int
+EPD_trace_start(size_t records)
+{
+    if (atomic_load(&Active) != NULL) {
+	errno = EBUSY;
+	log_err("SPI trace already running.");
+	return 1;
+    }
+
+    size_t cap = 1;
+    while (cap < records)
+	cap <<= 1;
+
+    if (NULL == Ring || Ring->mask + 1 != cap) {
+	free(Ring);
+	Ring = malloc(sizeof *Ring + cap * sizeof *Ring->records);
+	if (NULL == Ring) {
+	    log_err("Memory error.");
+	    return 1;
+	}
+	Ring->mask = cap - 1;
+    }
+
+    Ring->start_us = clock_now_us();
+    atomic_store(&Ring->head, 0);
+    atomic_store_explicit(&Active, Ring, memory_order_release);
+    log_info("SPI trace started, %zu records.", cap);
+
+    return 0;
+}
+
+/* Stop capturing, the records are kept until the next start */
+void
+EPD_trace_stop(void)
+{
+    atomic_store_explicit(&Active, NULL, memory_order_release);
+    return;
+}
+
+static void
+put_le(uint8_t *p, uint64_t v, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+	p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static uint64_t
+get_le(const uint8_t *p, size_t n)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; ++i)
+	v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+/* Write the captured records to path, oldest first. Records still
+   being written by another thread may be torn, stop the trace first
+   for an exact copy. Returns non-zero on failure. */
+int
+EPD_trace_dump(const char *path)
+{
+    int rc = 1;
+
+    if (NULL == Ring) {
+	errno = ENODATA;
+	log_err("No SPI trace captured.");
+	return 1;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (NULL == fp) {
+	log_err("Failed to open %s.", path);
+	return 1;
+    }
+
+    uint64_t head = atomic_load(&Ring->head);
+    uint64_t count = (head > Ring->mask + 1) ? Ring->mask + 1 : head;
+    if (head > count)
+	log_warn("SPI trace overflowed, %llu records lost.",
+		 (unsigned long long)(head - count));
+
+    uint8_t header[TRACE_HEADER_LEN] = TRACE_MAGIC;
+    put_le(header + 4, TRACE_VERSION, 2);
+    put_le(header + 6, TRACE_RECORD_LEN, 2);
+    put_le(header + 8, count, 8);
+    if (fwrite(header, sizeof header, 1, fp) != 1)
+	goto out;
+
+    for (uint64_t i = head - count; i < head; ++i) {
+	const struct TraceRecord *Rec = &Ring->records[i & Ring->mask];
+	uint8_t out[TRACE_RECORD_LEN];
+
+	put_le(out, Rec->time_us, 4);
+	out[4] = Rec->byte;
+	out[5] = Rec->flags;
+	put_le(out + 6, Rec->bus, 2);
+	if (fwrite(out, sizeof out, 1, fp) != 1)
+	    goto out;
+    }
+
+    rc = 0;
+    log_info("Dumped %llu SPI trace records to %s.",
+	     (unsigned long long)count, path);
+ out:
+    if (rc)
+	log_err("Failed to write %s.", path);
+    if (fclose(fp) && !rc) {
+	log_err("Failed to write %s.", path);
+	rc = 1;
+    }
+    return rc;
+}
+
+/**
+   Replay
+**/
+
+/* Send one transfer, the DC and CS lines are driven as the library
+   would. Returns non-zero on failure. */
+static int
+replay_transfer(struct Transport *Bus, int dc, const uint8_t *buf, size_t len)
+{
+    bus_gpio_write(Bus, Bus->pins.dc, dc ? GPIO_HIGH : GPIO_LOW);
+    bus_gpio_write(Bus, Bus->pins.cs, GPIO_LOW);
+    int rc = spi_comms(Bus, dc, buf, len);
+    bus_gpio_write(Bus, Bus->pins.cs, GPIO_HIGH);
+
+    return rc;
+}
+
+/* Read the next record of fp, returns 1 at the end of the file, -1 on
+   failure */
+static int
+replay_read(FILE *fp, struct TraceRecord *Rec)
+{
+    uint8_t in[TRACE_RECORD_LEN];
+
+    if (fread(in, sizeof in, 1, fp) != 1)
+	return ferror(fp) ? -1 : 1;
+
+    Rec->time_us = get_le(in, 4);
+    Rec->byte = in[4];
+    Rec->flags = in[5];
+    Rec->bus = get_le(in + 6, 2);
+
+    return 0;
+}
+
+/* Transfers are rebuilt from the start flags and sent through Bus.
+   The controller is reset before the first command and whenever a
+   command follows deep sleep, as the library does. After each master
+   activation the busy pin is waited on, in timed mode the captured
+   gaps between transfers are also kept. */
+int
+TRACE_replay(struct Transport *Bus, const char *path, uint16_t bus, int flags)
+{
+    int rc = 1;
+    uint8_t *buf = NULL;
+
+    FILE *fp = fopen(path, "rb");
+    if (NULL == fp) {
+	log_err("Failed to open %s.", path);
+	return 1;
+    }
+
+    uint8_t header[TRACE_HEADER_LEN];
+    if (fread(header, sizeof header, 1, fp) != 1
+	|| memcmp(header, TRACE_MAGIC, 4)
+	|| get_le(header + 4, 2) != TRACE_VERSION
+	|| get_le(header + 6, 2) != TRACE_RECORD_LEN) {
+	errno = EINVAL;
+	log_err("%s is not an SPI trace.", path);
+	goto out;
+    }
+
+    buf = malloc(SPI_BUF_MAX);
+    if (NULL == buf) {
+	log_err("Memory error.");
+	goto out;
+    }
+
+    struct TraceRecord Rec;
+    size_t len = 0, bytes = 0;
+    int dc = 0, asleep = 1, end = 0;
+    uint64_t start = clock_now_us(), first_us = 0, bus_us = 0;
+    int first = 1;
+
+    while (!end) {
+	int r = replay_read(fp, &Rec);
+	if (r < 0) {
+	    log_err("Failed to read %s.", path);
+	    goto out;
+	}
+	end = r;
+	if (!end && !(flags & TRACE_ANY_BUS) && Rec.bus != bus)
+	    continue;
+
+	/* Flush the pending transfer at a boundary */
+	if (len > 0 && (end || (Rec.flags & TRACE_START_FLAG)
+			|| len == SPI_BUF_MAX)) {
+	    uint64_t t = clock_now_us();
+	    if (replay_transfer(Bus, dc, buf, len))
+		goto out;
+	    bus_us += clock_now_us() - t;
+	    bytes += len;
+
+	    if (!dc && buf[len - 1] == DEEP_SLEEP_MODE)
+		asleep = 1;
+	    if (!dc && buf[len - 1] == MASTER_ACTIVATION
+		&& wait_while_busy(Bus) < 0)
+		goto out;
+	    len = 0;
+	}
+	if (end)
+	    break;
+
+	if (Rec.flags & TRACE_START_FLAG) {
+	    if (first) {
+		first_us = Rec.time_us;
+		first = 0;
+	    }
+	    if (flags & TRACE_TIMED) {
+		uint64_t due = start + (uint32_t)(Rec.time_us - first_us);
+		uint64_t now = clock_now_us();
+		if (due > now + 1000)
+		    bus_delay(Bus, (due - now) / 1000);
+	    }
+
+	    int is_dc = (Rec.flags & TRACE_DC_FLAG) ? 1 : 0;
+	    if (!is_dc && asleep) {
+		reset_epd(Bus);
+		asleep = 0;
+	    }
+	    dc = is_dc;
+	}
+	buf[len++] = Rec.byte;
+    }
+
+    uint64_t elapsed = clock_now_us() - start;
+    log_info("Replayed %zuB in %lluus (bus active %lluus, %.0fB/s).", bytes,
+	     (unsigned long long)elapsed, (unsigned long long)bus_us,
+	     bus_us ? (double)bytes * 1e6 / bus_us : 0);
+    rc = 0;
+ out:
+    free(buf);
+    fclose(fp);
+    return rc;
+}
@@ -0,0 +1,77 @@
+/* wsepd_trace.h
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * SPI trace capture. Every byte sent to a controller is recorded in a
+ * process wide, lock-free ring buffer along with the data/command
+ * level, the transport it was sent on and a timestamp. The ring can
+ * be dumped to a compact binary file and replayed through any
+ * transport.
+ *
+ * File format, all integers little endian:
+ *
+ *   header  "WSTR", uint16 version (1), uint16 record size (8),
+ *           uint64 record count
+ *   record  uint32 time (us since capture start), uint8 byte,
+ *           uint8 flags (bit 0: data/command level, bit 1: first
+ *           byte of a transfer), uint16 bus id
+ *
+ */
+
+#ifndef WSEPD_TRACE_H
+#define WSEPD_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Transport;
+
+#define TRACE_MAGIC "WSTR"
+#define TRACE_VERSION 1
+#define TRACE_DC_FLAG 0x01
+
+#define TRACE_START_FLAG 0x02	/* First byte of a transfer */
+
+/* One traced byte */
+struct TraceRecord {
+    uint32_t time_us;
+    uint8_t byte;
+    uint8_t flags;
+    uint16_t bus;
+};
+
+/* Replay options */
+enum TRACE_REPLAY_FLAGS {
+    TRACE_TIMED = 0x01,		/* Keep the captured gaps between transfers */
+    TRACE_ANY_BUS = 0x02	/* Ignore the bus id filter */
+};
+
+/* Record len bytes sent on Bus with the data/command level dc. Does
+   nothing unless a capture is running. */
+void TRACE_spi(struct Transport *Bus, int dc, const uint8_t *buf, size_t len);
+
+/* Send the records of the trace file at path captured on bus (every
+   bus with TRACE_ANY_BUS) through Bus. The controller is reset before
+   the first command and after deep sleep, and the busy period after
+   each activation is waited out. Returns non-zero on failure. */
+int TRACE_replay(struct Transport *Bus, const char *path, uint16_t bus,
+		 int flags);
+
+#endif /* WSEPD_TRACE_H */
@@ -0,0 +1,102 @@
+/* wsepd_transport.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Selection, creation and destruction of transport backends.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <ert_log.h>
+
+#include "wsepd_transport.h"
+#include "waveshare2.9.h"
+
+/* Create a transport using the requested backend and open it. Pins
+   defaults to the Waveshare HAT wiring when NULL. Returns NULL on
+   failure. */
+struct Transport *
+TRANSPORT_create(enum EPD_BACKEND backend, int channel, uint32_t speed_hz,
+		 const struct TransportPins *pins)
+{
+    static const struct TransportPins hat_pins =
+	{ .rst = RST_PIN, .dc = DC_PIN, .cs = CS_PIN, .busy = BUSY_PIN };
+
+    const struct TransportOps *ops;
+
+    switch (backend) {
+    case WIRINGPI_BACKEND: ops = &wiringpi_ops;
+	break;
+    case NATIVE_BACKEND: ops = &native_ops;
+	break;
+    case RECORD_BACKEND: ops = &record_ops;
+	break;
+    case EMULATE_BACKEND: ops = &emulate_ops;
+	break;
+    default:
+	errno = EINVAL;
+	log_err("Invalid EPD_BACKEND enum value.");
+	return NULL;
+    }
+
+    static atomic_uint next_id;
+
+    struct Transport *Bus = malloc(sizeof *Bus);
+    if (NULL == Bus) {
+	log_err("Memory error.");
+	return NULL;
+    }
+
+    Bus->ops = ops;
+    Bus->backend = backend;
+    Bus->channel = channel;
+    Bus->speed_hz = speed_hz;
+    Bus->pins = (pins != NULL) ? *pins : hat_pins;
+    Bus->id = (uint16_t)atomic_fetch_add(&next_id, 1);
+    Bus->bytes = 0;
+    Bus->transfers = 0;
+    Bus->ctx = NULL;
+
+    if (Bus->ops->open(Bus)) {
+	log_err("Failed to open %s transport.", Bus->ops->name);
+	free(Bus);
+	return NULL;
+    }
+    log_info("Using %s transport.", Bus->ops->name);
+
+    return Bus;
+}
+
+/* Close the backend and free the transport */
+void
+TRANSPORT_destroy(struct Transport *Bus)
+{
+    if (NULL == Bus) {
+	log_warn("Attempted to destroy invalid transport");
+	return;
+    }
+
+    Bus->ops->close(Bus);
+    free(Bus);
+
+    return;
+}
@@ -0,0 +1,184 @@
+/* wsepd_transport.h
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Transport layer between the device commands and the hardware. Each
+ * backend provides a table of GPIO, SPI and delay operations, one is
+ * selected when the display object is created.
+ *
+ */
+
+#ifndef WSEPD_TRANSPORT_H
+#define WSEPD_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libwsepd.h"
+
+/* GPIO pin direction */
+enum GPIO_PIN_MODE { GPIO_INPUT, GPIO_OUTPUT };
+
+struct Transport;
+
+/* Backend operations, every member must be provided */
+struct TransportOps {
+    const char *name;
+    int  (*open)(struct Transport *Bus);  /* Returns non-zero on failure */
+    void (*close)(struct Transport *Bus);
+    int  (*pin_mode)(struct Transport *Bus, int pin, enum GPIO_PIN_MODE mode);
+    void (*gpio_write)(struct Transport *Bus, int pin, int level);
+    int  (*gpio_read)(struct Transport *Bus, int pin);
+    /* Block until pin reads level, driven by GPIO edge events. Returns
+       0 once reached, 1 on timeout or -1 if edges are unavailable. */
+    int  (*wait_level)(struct Transport *Bus, int pin, int level,
+		       unsigned int timeout_ms);
+    int  (*spi_write)(struct Transport *Bus, const uint8_t *buf, size_t len);
+    void (*delay_ms)(struct Transport *Bus, unsigned int ms);
+};
+
+/* GPIO lines wired to one display (BCM numbering) */
+struct TransportPins {
+    int rst, dc, cs, busy;
+};
+
+/* A transport instance, one per display */
+struct Transport {
+    const struct TransportOps *ops;
+    enum EPD_BACKEND backend;
+    int channel;		/* SPI channel (chip enable) */
+    uint32_t speed_hz;		/* SPI clock speed */
+    struct TransportPins pins;
+    uint16_t id;		/* Unique per process, tags traced bytes */
+    uint64_t bytes;		/* Bytes written to the SPI bus */
+    uint64_t transfers;		/* Number of SPI writes */
+    void *ctx;			/* Backend private state */
+};
+
+/* Backend operation tables */
+extern const struct TransportOps wiringpi_ops;
+extern const struct TransportOps native_ops;
+extern const struct TransportOps record_ops;
+extern const struct TransportOps emulate_ops;
+
+/**
+   Transport creation/destruction
+**/
+
+/* Selects and opens a backend wired to pins (the default wiring if
+   NULL), returns NULL on failure */
+struct Transport *TRANSPORT_create(enum EPD_BACKEND backend,
+				   int channel, uint32_t speed_hz,
+				   const struct TransportPins *pins);
+void TRANSPORT_destroy(struct Transport *Bus);
+
+/**
+   Operation wrappers
+**/
+
+static inline int
+bus_pin_mode(struct Transport *Bus, int pin, enum GPIO_PIN_MODE mode)
+{
+    return Bus->ops->pin_mode(Bus, pin, mode);
+}
+
+static inline void
+bus_gpio_write(struct Transport *Bus, int pin, int level)
+{
+    Bus->ops->gpio_write(Bus, pin, level);
+}
+
+static inline int
+bus_gpio_read(struct Transport *Bus, int pin)
+{
+    return Bus->ops->gpio_read(Bus, pin);
+}
+
+static inline int
+bus_wait_level(struct Transport *Bus, int pin, int level,
+	       unsigned int timeout_ms)
+{
+    return Bus->ops->wait_level(Bus, pin, level, timeout_ms);
+}
+
+static inline int
+bus_spi_write(struct Transport *Bus, const uint8_t *buf, size_t len)
+{
+    Bus->bytes += len;
+    ++Bus->transfers;
+    return Bus->ops->spi_write(Bus, buf, len);
+}
+
+static inline void
+bus_delay(struct Transport *Bus, unsigned int ms)
+{
+    Bus->ops->delay_ms(Bus, ms);
+}
+
+/**
+   Recording backend inspection
+**/
+
+/* One entry per byte written to the SPI bus, dc is the level of the
+   data/command pin when the byte was sent. */
+struct RecordEntry {
+    uint8_t dc;
+    uint8_t byte;
+};
+
+const struct RecordEntry *RECORD_get_entries(struct Transport *Bus, size_t *n);
+size_t RECORD_get_transfers(struct Transport *Bus);
+unsigned long RECORD_get_delay_ms(struct Transport *Bus);
+void RECORD_reset(struct Transport *Bus);
+
+/**
+   Emulated controller
+**/
+
+/* Busy time model, an activation keeps the busy pin high for
+   overhead_us plus frame_us for every frame of the loaded LUT. In
+   realtime mode delays sleep and busy follows the wall clock,
+   otherwise every emulator shares a virtual clock advanced by delays
+   and busy waits, so refreshes complete instantly. */
+struct EmulateTiming {
+    uint32_t frame_us;
+    uint32_t overhead_us;
+    int realtime;
+};
+
+/* Controller state and protocol counters */
+struct EmulateState {
+    int asleep;			/* In deep sleep, waiting for a reset */
+    size_t width, height;	/* Panel image in pixels */
+    unsigned long resets;	/* Hardware and software resets */
+    unsigned long activations;	/* Display updates */
+    unsigned long ignored;	/* Bytes sent while asleep */
+    unsigned long errors;	/* Malformed or unsupported commands */
+    uint64_t busy_us;		/* Total modelled busy time */
+    uint64_t last_busy_us;	/* Busy time of the last activation */
+};
+
+void EMULATE_set_timing(struct Transport *Bus,
+			const struct EmulateTiming *Timing);
+void EMULATE_get_state(struct Transport *Bus, struct EmulateState *State);
+/* The image on the panel, one bit per pixel with rows of width / 8
+   bytes, as EPD_get_front */
+const uint8_t *EMULATE_get_image(struct Transport *Bus);
+
+#endif /* WSEPD_TRANSPORT_H */
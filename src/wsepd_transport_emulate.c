@@ -0,0 +1,504 @@
+/* wsepd_transport_emulate.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ * Description:
+ *
+ * Emulated 2.9" controller transport backend. The command stream is
+ * interpreted as the controller would: window and counter registers,
+ * RAM writes with auto increment in the data entry mode, LUT loads,
+ * activation and deep sleep. The busy pin follows a timing model and
+ * the resulting panel image can be inspected, so the whole library
+ * runs on any Linux host.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <ert_log.h>
+
+#include "wsepd_transport.h"
+#include "wsepd_clock.h"
+#include "waveshare2.9.h"
+
+#define EMULATE_RAM_X 32	/* RAM columns (bytes of 8 pixels) */
+#define EMULATE_RAM_Y 512	/* RAM rows */
+#define EMULATE_SOURCES 128	/* Source lines, the panel width */
+#define EMULATE_GATES 296	/* Gate lines after reset */
+#define EMULATE_LUT_LEN 30
+#define EMULATE_PARAM_MAX EMULATE_LUT_LEN
+#define EMULATE_FRAME_US 25000	/* Default duration of a LUT frame */
+
+/* Command register state */
+struct Emulate {
+    /* Host interface */
+    uint8_t dc, rst;		/* Pin levels */
+    int cmd;			/* Current command, -1 for none */
+    size_t nparam;		/* Parameter bytes received */
+    uint8_t param[EMULATE_PARAM_MAX];
+
+    /* Registers */
+    uint16_t gates;		/* Gate lines in use */
+    uint8_t entry_mode;		/* DATA_ENTRY_MODE_SETTING */
+    uint8_t update_ctrl;	/* DISPLAY_UPDATE_CONTROL_2 */
+    uint16_t xs, xe, ys, ye;	/* RAM window, inclusive */
+    uint16_t x, y;		/* RAM address counters */
+    uint8_t lut[EMULATE_LUT_LEN];
+    int lut_loaded;
+
+    uint64_t busy_until;	/* Busy pin falls at this time */
+    struct EmulateTiming timing;
+    struct EmulateState state;
+
+    uint8_t ram[EMULATE_RAM_Y][EMULATE_RAM_X];
+    uint8_t image[EMULATE_RAM_Y * EMULATE_SOURCES / 8];
+};
+
+/* Virtual clock shared by every emulator not in realtime mode */
+static atomic_uint_fast64_t virtual_us;
+
+/* Expected parameter bytes of each supported command, -1 for a
+   stream (WRITE_RAM) and 0 for an unsupported opcode */
+static int
+emulate_params(uint8_t cmd)
+{
+    switch (cmd) {
+    case DRIVER_OUTPUT_CONTROL:			return 3;
+    case BOOSTER_SOFT_START_CONTROL:		return 3;
+    case GATE_SCAN_START_POSITION:		return 2;
+    case DEEP_SLEEP_MODE:			return 1;
+    case DATA_ENTRY_MODE_SETTING:		return 1;
+    case TEMPERATURE_SENSOR_CONTROL:		return 2;
+    case DISPLAY_UPDATE_CONTROL_1:		return 1;
+    case DISPLAY_UPDATE_CONTROL_2:		return 1;
+    case WRITE_RAM:				return -1;
+    case WRITE_VCOM_REGISTER:			return 1;
+    case WRITE_LUT_REGISTER:			return EMULATE_LUT_LEN;
+    case SET_DUMMY_LINE_PERIOD:			return 1;
+    case SET_GATE_TIME:				return 1;
+    case BORDER_WAVEFORM_CONTROL:		return 1;
+    case SET_RAM_X_ADDRESS_START_END_POSITION:	return 2;
+    case SET_RAM_Y_ADDRESS_START_END_POSITION:	return 4;
+    case SET_RAM_X_ADDRESS_COUNTER:		return 1;
+    case SET_RAM_Y_ADDRESS_COUNTER:		return 2;
+    default:					return 0;
+    }
+}
+
+static uint64_t
+emulate_now(struct Emulate *E)
+{
+    return E->timing.realtime ? clock_now_us() : atomic_load(&virtual_us);
+}
+
+/* Move the virtual clock forward to at least t */
+static void
+emulate_advance_to(uint64_t t)
+{
+    uint_fast64_t now = atomic_load(&virtual_us);
+    while (now < t && !atomic_compare_exchange_weak(&virtual_us, &now, t))
+	;
+}
+
+static void
+emulate_sleep_us(uint64_t us)
+{
+    struct timespec ts = { .tv_sec = us / 1000000,
+			   .tv_nsec = (us % 1000000) * 1000 };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+	;
+}
+
+/* Register values after a hardware or software reset, RAM is kept */
+static void
+emulate_reset(struct Emulate *E)
+{
+    E->cmd = -1;
+    E->nparam = 0;
+    E->gates = EMULATE_GATES;
+    E->entry_mode = 0x03;
+    E->update_ctrl = 0xFF;
+    E->xs = 0;
+    E->xe = EMULATE_RAM_X - 1;
+    E->ys = 0;
+    E->ye = EMULATE_RAM_Y - 1;
+    E->x = 0;
+    E->y = 0;
+    E->lut_loaded = 0;
+    E->state.asleep = 0;
+    ++E->state.resets;
+}
+
+/* Counter v moved by d, wrapping within the n addresses of RAM */
+static inline uint16_t
+emulate_next(uint16_t v, int d, int n)
+{
+    return (uint16_t)((v + d + n) % n);
+}
+
+/* Step the address counters after a RAM write. The counter named by
+   bit 2 of the entry mode moves first, in the direction given by bits
+   0 (x) and 1 (y), and wraps to the window start after the window end
+   carrying into the other counter. */
+static void
+emulate_step(struct Emulate *E)
+{
+    int x_first = !(E->entry_mode & 0x04);
+    int dx = (E->entry_mode & 0x01) ? 1 : -1;
+    int dy = (E->entry_mode & 0x02) ? 1 : -1;
+    int carry;
+
+    if (x_first) {
+	carry = (E->x == E->xe);
+	E->x = carry ? E->xs : emulate_next(E->x, dx, EMULATE_RAM_X);
+	if (carry)
+	    E->y = (E->y == E->ye) ? E->ys
+		: emulate_next(E->y, dy, EMULATE_RAM_Y);
+    } else {
+	carry = (E->y == E->ye);
+	E->y = carry ? E->ys : emulate_next(E->y, dy, EMULATE_RAM_Y);
+	if (carry)
+	    E->x = (E->x == E->xe) ? E->xs
+		: emulate_next(E->x, dx, EMULATE_RAM_X);
+    }
+}
+
+/* Busy time of an activation, the LUT ends with ten bytes each
+   holding the frame counts of two waveform phases */
+static uint64_t
+emulate_busy_us(struct Emulate *E)
+{
+    unsigned int frames = 0;
+
+    for (size_t i = 20; i < EMULATE_LUT_LEN; ++i)
+	frames += (E->lut[i] & 0x0F) + (E->lut[i] >> 4);
+
+    return E->timing.overhead_us + (uint64_t)frames * E->timing.frame_us;
+}
+
+/* Copy RAM to the panel and raise the busy pin */
+static void
+emulate_activate(struct Emulate *E)
+{
+    if (!E->lut_loaded) {
+	log_warn("Emulated display activated without a LUT.");
+	++E->state.errors;
+    }
+
+    if (E->update_ctrl & 0x04) {
+	size_t stride = EMULATE_SOURCES / 8;
+	for (size_t y = 0; y < E->gates; ++y)
+	    memcpy(E->image + y * stride, E->ram[y], stride);
+    }
+
+    uint64_t busy = emulate_busy_us(E);
+    E->busy_until = emulate_now(E) + busy;
+    E->state.busy_us += busy;
+    E->state.last_busy_us = busy;
+    ++E->state.activations;
+}
+
+/* Apply a command once all of its parameters have arrived */
+static void
+emulate_execute(struct Emulate *E)
+{
+    const uint8_t *p = E->param;
+
+    switch (E->cmd) {
+    case DRIVER_OUTPUT_CONTROL:
+	E->gates = (p[0] | (p[1] << 8)) + 1;
+	if (E->gates > EMULATE_RAM_Y) {
+	    ++E->state.errors;
+	    E->gates = EMULATE_RAM_Y;
+	}
+	E->state.height = E->gates;
+	break;
+    case DEEP_SLEEP_MODE:
+	if (p[0] & 0x01)
+	    E->state.asleep = 1;
+	break;
+    case DATA_ENTRY_MODE_SETTING:
+	E->entry_mode = p[0] & 0x07;
+	break;
+    case SW_RESET:
+	emulate_reset(E);
+	break;
+    case MASTER_ACTIVATION:
+	emulate_activate(E);
+	break;
+    case DISPLAY_UPDATE_CONTROL_2:
+	E->update_ctrl = p[0];
+	break;
+    case WRITE_LUT_REGISTER:
+	memcpy(E->lut, p, EMULATE_LUT_LEN);
+	E->lut_loaded = 1;
+	break;
+    case SET_RAM_X_ADDRESS_START_END_POSITION:
+	E->xs = p[0] % EMULATE_RAM_X;
+	E->xe = p[1] % EMULATE_RAM_X;
+	break;
+    case SET_RAM_Y_ADDRESS_START_END_POSITION:
+	E->ys = (p[0] | (p[1] << 8)) % EMULATE_RAM_Y;
+	E->ye = (p[2] | (p[3] << 8)) % EMULATE_RAM_Y;
+	break;
+    case SET_RAM_X_ADDRESS_COUNTER:
+	E->x = p[0] % EMULATE_RAM_X;
+	break;
+    case SET_RAM_Y_ADDRESS_COUNTER:
+	E->y = (p[0] | (p[1] << 8)) % EMULATE_RAM_Y;
+	break;
+    default:			/* Analogue settings, no visible effect */
+	break;
+    }
+}
+
+/* Interpret one byte of the command stream */
+static void
+emulate_byte(struct Emulate *E, uint8_t byte)
+{
+    if (!E->dc) {
+	E->cmd = byte;
+	E->nparam = 0;
+	if (emulate_params(byte) == 0) {
+	    if (byte == SW_RESET || byte == MASTER_ACTIVATION)
+		emulate_execute(E);
+	    else if (byte != TERMINATE_FRAME_READ_WRITE)
+		++E->state.errors;
+	    E->cmd = -1;
+	}
+	return;
+    }
+
+    if (E->cmd < 0) {		/* Data without a command */
+	++E->state.errors;
+	return;
+    }
+
+    int expected = emulate_params(E->cmd);
+    if (expected < 0) {		/* WRITE_RAM */
+	E->ram[E->y][E->x] = byte;
+	emulate_step(E);
+	return;
+    }
+
+    E->param[E->nparam++] = byte;
+    if (E->nparam == (size_t)expected) {
+	emulate_execute(E);
+	E->cmd = -1;
+    }
+}
+
+static int
+emulate_open(struct Transport *Bus)
+{
+    struct Emulate *E = calloc(1, sizeof *E);
+    if (NULL == E) {
+	log_err("Memory error.");
+	return 1;
+    }
+
+    E->rst = GPIO_HIGH;
+    E->timing = (struct EmulateTiming){ .frame_us = EMULATE_FRAME_US };
+    E->state.width = EMULATE_SOURCES;
+    E->state.height = EMULATE_GATES;
+    memset(E->ram, 0xFF, sizeof E->ram);
+    memset(E->image, 0xFF, sizeof E->image);
+    emulate_reset(E);
+    E->state.resets = 0;
+
+    Bus->ctx = E;
+
+    return 0;
+}
+
+static void
+emulate_close(struct Transport *Bus)
+{
+    free(Bus->ctx);
+    Bus->ctx = NULL;
+
+    return;
+}
+
+static int
+emulate_pin_mode(__attribute__((unused)) struct Transport *Bus,
+		 __attribute__((unused)) int pin,
+		 __attribute__((unused)) enum GPIO_PIN_MODE mode)
+{
+    return 0;
+}
+
+/* The controller resets on the rising edge of the reset line and
+   latches the data/command level */
+static void
+emulate_gpio_write(struct Transport *Bus, int pin, int level)
+{
+    struct Emulate *E = Bus->ctx;
+
+    if (pin == Bus->pins.dc) {
+	E->dc = level ? 1 : 0;
+    } else if (pin == Bus->pins.rst) {
+	if (level && !E->rst)
+	    emulate_reset(E);
+	E->rst = level ? 1 : 0;
+    }
+
+    return;
+}
+
+static int
+emulate_gpio_read(struct Transport *Bus, int pin)
+{
+    struct Emulate *E = Bus->ctx;
+
+    if (pin != Bus->pins.busy)
+	return GPIO_LOW;
+
+    return (emulate_now(E) < E->busy_until) ? GPIO_HIGH : GPIO_LOW;
+}
+
+/* Only the busy pin changes by itself. The virtual clock jumps to the
+   falling edge, in realtime mode the remaining busy time is slept. */
+static int
+emulate_wait_level(struct Transport *Bus, int pin, int level,
+		   unsigned int timeout_ms)
+{
+    struct Emulate *E = Bus->ctx;
+
+    if (emulate_gpio_read(Bus, pin) == level)
+	return 0;
+    if (pin != Bus->pins.busy || level != GPIO_LOW)
+	return 1;
+
+    uint64_t now = emulate_now(E);
+    uint64_t wait = E->busy_until - now;
+    if (wait > (uint64_t)timeout_ms * 1000)
+	wait = (uint64_t)timeout_ms * 1000;
+
+    if (E->timing.realtime)
+	emulate_sleep_us(wait);
+    else
+	emulate_advance_to(now + wait);
+
+    return (emulate_gpio_read(Bus, pin) == level) ? 0 : 1;
+}
+
+/* Feed the bytes to the controller. Bytes sent while asleep or in
+   reset are dropped as the hardware would, as are those sent while
+   busy other than the no-op TERMINATE_FRAME_READ_WRITE. */
+static int
+emulate_spi_write(struct Transport *Bus, const uint8_t *buf, size_t len)
+{
+    struct Emulate *E = Bus->ctx;
+    uint64_t now = emulate_now(E);
+    int warned = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+	if (E->state.asleep || !E->rst) {
+	    ++E->state.ignored;
+	} else if (now < E->busy_until
+		   && (E->dc || buf[i] != TERMINATE_FRAME_READ_WRITE)) {
+	    if (!warned++)
+		log_warn("Emulated display written while busy.");
+	    ++E->state.ignored;
+	    ++E->state.errors;
+	} else {
+	    emulate_byte(E, buf[i]);
+	}
+    }
+
+    return 0;
+}
+
+static void
+emulate_delay_ms(struct Transport *Bus, unsigned int ms)
+{
+    struct Emulate *E = Bus->ctx;
+
+    if (E->timing.realtime)
+	emulate_sleep_us((uint64_t)ms * 1000);
+    else
+	atomic_fetch_add(&virtual_us, (uint64_t)ms * 1000);
+
+    return;
+}
+
+const struct TransportOps emulate_ops =
+    { .name       = "emulated controller",
+      .open       = emulate_open,
+      .close      = emulate_close,
+      .pin_mode   = emulate_pin_mode,
+      .gpio_write = emulate_gpio_write,
+      .gpio_read  = emulate_gpio_read,
+      .wait_level = emulate_wait_level,
+      .spi_write  = emulate_spi_write,
+      .delay_ms   = emulate_delay_ms };
+
+/**
+   Inspection methods
+**/
+
+/* Replace the busy time model */
+void
+EMULATE_set_timing(struct Transport *Bus, const struct EmulateTiming *Timing)
+{
+    if (Bus->backend != EMULATE_BACKEND) {
+	errno = EINVAL;
+	log_err("Transport is not an emulator.");
+	return;
+    }
+
+    ((struct Emulate *)Bus->ctx)->timing = *Timing;
+
+    return;
+}
+
+/* Copy the controller state and counters to State */
+void
+EMULATE_get_state(struct Transport *Bus, struct EmulateState *State)
+{
+    if (Bus->backend != EMULATE_BACKEND) {
+	errno = EINVAL;
+	log_err("Transport is not an emulator.");
+	*State = (struct EmulateState){ 0 };
+	return;
+    }
+
+    *State = ((struct Emulate *)Bus->ctx)->state;
+
+    return;
+}
+
+/* Returns the panel image, white until the first activation */
+const uint8_t *
+EMULATE_get_image(struct Transport *Bus)
+{
+    if (Bus->backend != EMULATE_BACKEND) {
+	errno = EINVAL;
+	log_err("Transport is not an emulator.");
+	return NULL;
+    }
+
+    return ((struct Emulate *)Bus->ctx)->image;
+}
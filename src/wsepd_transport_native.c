@@ -0,0 +1,387 @@
+/* wsepd_transport_native.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Transport backend using the Linux kernel interfaces directly: the
+ * spidev driver (SPI_IOC_MESSAGE) and the GPIO character device. No
+ * userspace GPIO library is required.
+ *
+ * A GPIO line can only be requested once, so the requests are shared
+ * by every transport in the process: panels wired to common DC and
+ * RST lines drive the same request.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include <linux/spi/spidev.h>
+#include <ert_log.h>
+
+#include "wsepd_transport.h"
+#include "wsepd_clock.h"
+
+#define GPIOCHIP_PATH "/dev/gpiochip0"
+#define SPIDEV_PATH   "/dev/spidev0.%d"
+#define NATIVE_MAX_LINES 8	/* GPIO lines per transport */
+
+/* A requested GPIO line, shared by the transports using it */
+struct NativeLine {
+    int pin;			/* BCM offset on the gpiochip */
+    int fd;			/* Line request file descriptor */
+    enum GPIO_PIN_MODE mode;
+    unsigned int refs;		/* Transports holding the request */
+    struct NativeLine *Next;
+};
+
+/* Backend private state */
+struct Native {
+    int chip_fd;
+    int spi_fd;
+    size_t nlines;
+    struct NativeLine *lines[NATIVE_MAX_LINES];
+};
+
+/* Line requests of the process */
+static struct NativeLine *native_lines = NULL;
+static pthread_mutex_t native_lines_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the line request for pin, or NULL if it was never set up
+   (e.g. chip select owned by the spidev driver). */
+static struct NativeLine *
+native_find_line(struct Native *Dev, int pin)
+{
+    for (size_t i = 0; i < Dev->nlines; ++i)
+	if (Dev->lines[i]->pin == pin)
+	    return Dev->lines[i];
+
+    return NULL;
+}
+
+/* Drop a reference to Line, releasing the request with the last */
+static void
+native_put_line(struct NativeLine *Line)
+{
+    pthread_mutex_lock(&native_lines_lock);
+    if (--Line->refs == 0) {
+	for (struct NativeLine **Link = &native_lines; *Link;
+	     Link = &(*Link)->Next) {
+	    if (*Link == Line) {
+		*Link = Line->Next;
+		break;
+	    }
+	}
+	close(Line->fd);
+	free(Line);
+    }
+    pthread_mutex_unlock(&native_lines_lock);
+
+    return;
+}
+
+/* Open the gpiochip and spidev devices and configure the SPI mode
+   and clock. Returns non-zero on failure. */
+static int
+native_open(struct Transport *Bus)
+{
+    struct Native *Dev = calloc(1, sizeof *Dev);
+    if (NULL == Dev) {
+	log_err("Memory error.");
+	return 1;
+    }
+    Dev->spi_fd = -1;
+
+    Dev->chip_fd = open(GPIOCHIP_PATH, O_RDWR | O_CLOEXEC);
+    if (Dev->chip_fd < 0) {
+	log_err("Failed to open %s.", GPIOCHIP_PATH);
+	goto out;
+    }
+
+    char path[32];
+    snprintf(path, sizeof path, SPIDEV_PATH, Bus->channel);
+    Dev->spi_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (Dev->spi_fd < 0) {
+	log_err("Failed to open %s.", path);
+	goto out;
+    }
+
+    uint8_t mode = SPI_MODE_0, bits = 8;
+    uint32_t speed = Bus->speed_hz;
+    if (ioctl(Dev->spi_fd, SPI_IOC_WR_MODE, &mode) < 0
+	|| ioctl(Dev->spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0
+	|| ioctl(Dev->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+	log_err("Failed to configure %s.", path);
+	goto out;
+    }
+
+    Bus->ctx = Dev;
+    log_info("GPIO initialised.");
+
+    return 0;
+ out:
+    if (Dev->spi_fd >= 0)
+	close(Dev->spi_fd);
+    if (Dev->chip_fd >= 0)
+	close(Dev->chip_fd);
+    free(Dev);
+    return 1;
+}
+
+/* Release every line request and close the devices */
+static void
+native_close(struct Transport *Bus)
+{
+    struct Native *Dev = Bus->ctx;
+    if (NULL == Dev)
+	return;
+
+    for (size_t i = 0; i < Dev->nlines; ++i)
+	native_put_line(Dev->lines[i]);
+    close(Dev->spi_fd);
+    close(Dev->chip_fd);
+    free(Dev);
+    Bus->ctx = NULL;
+
+    return;
+}
+
+/* Request pin from the gpiochip as an input or output, or share the
+   request another transport holds. Outputs start high, the inactive
+   level of RST and CS. Inputs also report edge events, which wake
+   native_wait_level. A chip select claimed by the spidev driver
+   (EBUSY) is left to it, any other line must be ours. Returns non-zero
+   on failure. */
+static int
+native_pin_mode(struct Transport *Bus, int pin, enum GPIO_PIN_MODE mode)
+{
+    struct Native *Dev = Bus->ctx;
+    struct NativeLine *Line;
+    int rc = 1;
+
+    if (native_find_line(Dev, pin)) {
+	errno = EALREADY;
+	log_warn("GPIO%d already configured.", pin);
+	return 0;
+    }
+    if (Dev->nlines == NATIVE_MAX_LINES) {
+	errno = ENOSPC;
+	log_err("No free GPIO line slots.");
+	return 1;
+    }
+
+    pthread_mutex_lock(&native_lines_lock);
+    for (Line = native_lines; Line; Line = Line->Next)
+	if (Line->pin == pin)
+	    break;
+
+    if (Line) {
+	if (Line->mode != mode) {
+	    errno = EBUSY;
+	    log_err("GPIO%d is in use in the other direction.", pin);
+	    goto out;
+	}
+	log_debug("Sharing the request for GPIO%d.", pin);
+	++Line->refs;
+	Dev->lines[Dev->nlines++] = Line;
+	rc = 0;
+	goto out;
+    }
+
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof req);
+    req.offsets[0] = pin;
+    req.num_lines = 1;
+    snprintf(req.consumer, sizeof req.consumer, "libwsepd");
+    if (mode == GPIO_OUTPUT) {
+	req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	req.config.num_attrs = 1;
+	req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	req.config.attrs[0].attr.values = 1;
+	req.config.attrs[0].mask = 1;
+    } else {
+	req.config.flags = GPIO_V2_LINE_FLAG_INPUT
+	    | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    }
+
+    if (ioctl(Dev->chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+	if (errno == EBUSY && pin == Bus->pins.cs) {
+	    log_info("GPIO%d owned by the spidev driver, leaving it "
+		     "there.", pin);
+	    errno = 0;
+	    rc = 0;
+	    goto out;
+	}
+	log_err("Failed to request GPIO%d.", pin);
+	goto out;
+    }
+
+    Line = malloc(sizeof *Line);
+    if (NULL == Line) {
+	log_err("Memory error.");
+	close(req.fd);
+	goto out;
+    }
+
+    /* Edge events are drained without blocking */
+    if (mode == GPIO_INPUT)
+	fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+
+    *Line = (struct NativeLine){ .pin = pin, .fd = req.fd, .mode = mode,
+				 .refs = 1, .Next = native_lines };
+    native_lines = Line;
+    Dev->lines[Dev->nlines++] = Line;
+    rc = 0;
+ out:
+    pthread_mutex_unlock(&native_lines_lock);
+    return rc;
+}
+
+static void
+native_gpio_write(struct Transport *Bus, int pin, int level)
+{
+    struct NativeLine *Line = native_find_line(Bus->ctx, pin);
+    if (NULL == Line)
+	return;
+
+    struct gpio_v2_line_values values = { .bits = level ? 1 : 0,
+					  .mask = 1 };
+    if (ioctl(Line->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0)
+	log_err("Failed to write GPIO%d.", pin);
+
+    return;
+}
+
+/* Returns the pin level, or -1 on failure */
+static int
+native_gpio_read(struct Transport *Bus, int pin)
+{
+    struct NativeLine *Line = native_find_line(Bus->ctx, pin);
+    if (NULL == Line) {
+	errno = ENODEV;
+	log_err("GPIO%d not configured.", pin);
+	return -1;
+    }
+
+    struct gpio_v2_line_values values = { .bits = 0, .mask = 1 };
+    if (ioctl(Line->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+	log_err("Failed to read GPIO%d.", pin);
+	return -1;
+    }
+
+    return (values.bits & 1) ? 1 : 0;
+}
+
+/* Discard queued edge events on a line */
+static void
+native_drain_events(struct NativeLine *Line)
+{
+    struct gpio_v2_line_event events[16];
+
+    while (read(Line->fd, events, sizeof events) > 0)
+	;
+
+    return;
+}
+
+/* Sleep in poll() until an edge brings pin to level or the timeout
+   expires. The level is re-read after draining events so an edge
+   between reading and polling is not missed. Returns 0 once the level
+   is reached, 1 on timeout or -1 on failure. */
+static int
+native_wait_level(struct Transport *Bus, int pin, int level,
+		  unsigned int timeout_ms)
+{
+    struct NativeLine *Line = native_find_line(Bus->ctx, pin);
+    if (NULL == Line)
+	return -1;
+
+    uint64_t deadline = clock_now_us() + (uint64_t)timeout_ms * 1000;
+
+    for (;;) {
+	native_drain_events(Line);
+
+	int now = native_gpio_read(Bus, pin);
+	if (now < 0)
+	    return -1;
+	if (now == level)
+	    return 0;
+
+	uint64_t t = clock_now_us();
+	if (t >= deadline)
+	    return 1;
+
+	struct pollfd pfd = { .fd = Line->fd, .events = POLLIN };
+	int wait_ms = (deadline - t + 999) / 1000;
+	if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR) {
+	    log_err("Failed to wait for GPIO%d edge.", pin);
+	    return -1;
+	}
+    }
+}
+
+/* Write only transfer straight from the caller's buffer (the kernel
+   limits a message to the spidev bufsiz). Returns non-zero on
+   failure. */
+static int
+native_spi_write(struct Transport *Bus, const uint8_t *buf, size_t len)
+{
+    struct Native *Dev = Bus->ctx;
+    struct spi_ioc_transfer xfer;
+
+    memset(&xfer, 0, sizeof xfer);
+    xfer.tx_buf = (uintptr_t)buf;
+    xfer.len = len;
+    xfer.speed_hz = Bus->speed_hz;
+    xfer.bits_per_word = 8;
+
+    return (ioctl(Dev->spi_fd, SPI_IOC_MESSAGE(1), &xfer) < 0) ? 1 : 0;
+}
+
+static void
+native_delay_ms(__attribute__((unused)) struct Transport *Bus,
+		unsigned int ms)
+{
+    struct timespec ts = { .tv_sec = ms / 1000,
+			   .tv_nsec = (ms % 1000) * 1000000L };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+	;
+
+    return;
+}
+
+const struct TransportOps native_ops =
+    { .name       = "native spidev/gpiochip",
+      .open       = native_open,
+      .close      = native_close,
+      .pin_mode   = native_pin_mode,
+      .gpio_write = native_gpio_write,
+      .gpio_read  = native_gpio_read,
+      .wait_level = native_wait_level,
+      .spi_write  = native_spi_write,
+      .delay_ms   = native_delay_ms };
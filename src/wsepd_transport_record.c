@@ -0,0 +1,230 @@
+/* wsepd_transport_record.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * In-memory recording transport backend. No hardware is touched, each
+ * byte written to the SPI bus is stored along with the state of the
+ * data/command pin. The busy pin always reads low and delays return
+ * immediately, so the library can be run on any Linux host.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ert_log.h>
+
+#include "wsepd_transport.h"
+#include "waveshare2.9.h"
+
+#define RECORD_INITIAL_LEN 8192	/* Initial entry capacity */
+
+/* Backend private state */
+struct Record {
+    struct RecordEntry *entries;
+    size_t length;		/* Entries used */
+    size_t capacity;		/* Entries allocated */
+    size_t transfers;		/* Number of spi_write calls */
+    unsigned long delay_ms;	/* Total requested delay */
+    uint8_t dc;			/* Current data/command pin level */
+};
+
+static int
+record_open(struct Transport *Bus)
+{
+    struct Record *Rec = calloc(1, sizeof *Rec);
+    if (NULL == Rec) {
+	log_err("Memory error.");
+	return 1;
+    }
+
+    Rec->entries = malloc(RECORD_INITIAL_LEN * sizeof *Rec->entries);
+    if (NULL == Rec->entries) {
+	log_err("Memory error.");
+	free(Rec);
+	return 1;
+    }
+    Rec->capacity = RECORD_INITIAL_LEN;
+
+    Bus->ctx = Rec;
+
+    return 0;
+}
+
+static void
+record_close(struct Transport *Bus)
+{
+    struct Record *Rec = Bus->ctx;
+    if (NULL == Rec)
+	return;
+
+    free(Rec->entries);
+    free(Rec);
+    Bus->ctx = NULL;
+
+    return;
+}
+
+static int
+record_pin_mode(__attribute__((unused)) struct Transport *Bus,
+		__attribute__((unused)) int pin,
+		__attribute__((unused)) enum GPIO_PIN_MODE mode)
+{
+    return 0;
+}
+
+/* Only the data/command level is of interest */
+static void
+record_gpio_write(struct Transport *Bus, int pin, int level)
+{
+    struct Record *Rec = Bus->ctx;
+
+    if (pin == Bus->pins.dc)
+	Rec->dc = level ? 1 : 0;
+
+    return;
+}
+
+/* The recorded device is never busy */
+static int
+record_gpio_read(__attribute__((unused)) struct Transport *Bus,
+		 __attribute__((unused)) int pin)
+{
+    return GPIO_LOW;
+}
+
+/* Already at the requested level (never busy) */
+static int
+record_wait_level(__attribute__((unused)) struct Transport *Bus,
+		  __attribute__((unused)) int pin,
+		  __attribute__((unused)) int level,
+		  __attribute__((unused)) unsigned int timeout_ms)
+{
+    return (level == GPIO_LOW) ? 0 : 1;
+}
+
+/* Append each byte to the record, growing it as required. Returns
+   non-zero on memory error. */
+static int
+record_spi_write(struct Transport *Bus, const uint8_t *buf, size_t len)
+{
+    struct Record *Rec = Bus->ctx;
+
+    if (Rec->length + len > Rec->capacity) {
+	size_t capacity = Rec->capacity;
+	while (Rec->length + len > capacity)
+	    capacity *= 2;
+
+	struct RecordEntry *entries =
+	    realloc(Rec->entries, capacity * sizeof *entries);
+	if (NULL == entries) {
+	    log_err("Memory error.");
+	    return 1;
+	}
+	Rec->entries = entries;
+	Rec->capacity = capacity;
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+	Rec->entries[Rec->length + i].dc = Rec->dc;
+	Rec->entries[Rec->length + i].byte = buf[i];
+    }
+    Rec->length += len;
+    ++Rec->transfers;
+
+    return 0;
+}
+
+/* Delays are accounted for but not performed */
+static void
+record_delay_ms(struct Transport *Bus, unsigned int ms)
+{
+    struct Record *Rec = Bus->ctx;
+    Rec->delay_ms += ms;
+    return;
+}
+
+const struct TransportOps record_ops =
+    { .name       = "in-memory recorder",
+      .open       = record_open,
+      .close      = record_close,
+      .pin_mode   = record_pin_mode,
+      .gpio_write = record_gpio_write,
+      .gpio_read  = record_gpio_read,
+      .wait_level = record_wait_level,
+      .spi_write  = record_spi_write,
+      .delay_ms   = record_delay_ms };
+
+/**
+   Inspection methods
+**/
+
+/* Returns the recorded bytes, storing the number of entries in n */
+const struct RecordEntry *
+RECORD_get_entries(struct Transport *Bus, size_t *n)
+{
+    if (Bus->backend != RECORD_BACKEND) {
+	errno = EINVAL;
+	log_err("Transport is not a recorder.");
+	*n = 0;
+	return NULL;
+    }
+
+    struct Record *Rec = Bus->ctx;
+    *n = Rec->length;
+
+    return Rec->entries;
+}
+
+/* Returns the number of SPI transfers made */
+size_t
+RECORD_get_transfers(struct Transport *Bus)
+{
+    if (Bus->backend != RECORD_BACKEND)
+	return 0;
+
+    return ((struct Record *)Bus->ctx)->transfers;
+}
+
+/* Returns the total delay requested in ms */
+unsigned long
+RECORD_get_delay_ms(struct Transport *Bus)
+{
+    if (Bus->backend != RECORD_BACKEND)
+	return 0;
+
+    return ((struct Record *)Bus->ctx)->delay_ms;
+}
+
+/* Discard everything recorded so far */
+void
+RECORD_reset(struct Transport *Bus)
+{
+    if (Bus->backend != RECORD_BACKEND)
+	return;
+
+    struct Record *Rec = Bus->ctx;
+    Rec->length = 0;
+    Rec->transfers = 0;
+    Rec->delay_ms = 0;
+
+    return;
+}
@@ -0,0 +1,254 @@
+/* wsepd_transport_wiringpi.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Transport backend using the wiringPi library. Only functional when
+ * built with WIRINGPI=1, otherwise opening the backend fails.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ert_log.h>
+
+#include "wsepd_transport.h"
+
+#ifndef WIRINGPI
+#define WIRINGPI 1
+#endif
+
+#if WIRINGPI
+
+#include <pthread.h>
+#include <wiringPi.h>
+#include <wiringPiSPI.h>
+
+#include "wsepd_clock.h"
+
+#define WIRINGPI_BUF_MAX 4096	/* Largest single transfer (bytes) */
+
+/* wiringPi interrupt service routines take no arguments, so edge
+   detection is available on a single pin per process. isr_pin is
+   guarded by isr_lock, displays refreshing on parallel threads may
+   set it up at once. */
+static int isr_pin = -1;
+static pthread_mutex_t isr_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t isr_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t isr_edge;
+
+static void
+wiringpi_isr(void)
+{
+    pthread_mutex_lock(&isr_lock);
+    pthread_cond_broadcast(&isr_edge);
+    pthread_mutex_unlock(&isr_lock);
+}
+
+/* Deadlines are on the monotonic clock */
+static void
+wiringpi_isr_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&isr_edge, &attr);
+    pthread_condattr_destroy(&attr);
+    return;
+}
+
+/* Register the interrupt handler for pin on first use. Returns
+   non-zero if edges cannot be reported for pin. */
+static int
+wiringpi_isr_setup(int pin)
+{
+    int rc = 0;
+
+    pthread_once(&isr_once, wiringpi_isr_init);
+
+    pthread_mutex_lock(&isr_lock);
+    if (isr_pin == pin)
+	goto out;
+    rc = 1;
+    if (isr_pin >= 0)
+	goto out;
+
+    /* wiringPiISR does not wait on the handler, which blocks on
+       isr_lock for any edge arriving before this returns */
+    if (wiringPiISR(pin, INT_EDGE_BOTH, wiringpi_isr) < 0) {
+	log_warn("GPIO%d interrupts unavailable, polling instead.", pin);
+	goto out;
+    }
+    isr_pin = pin;
+    rc = 0;
+ out:
+    pthread_mutex_unlock(&isr_lock);
+    return rc;
+}
+
+/* Initialise GPIO and SPI on raspberry pi, the private state is the
+   transfer scratch buffer */
+static int
+wiringpi_open(struct Transport *Bus)
+{
+    uint8_t *chunk = malloc(WIRINGPI_BUF_MAX);
+    if (NULL == chunk) {
+	log_err("Memory error.");
+	return 1;
+    }
+
+    wiringPiSetupGpio();	/* fatal on failure */
+    switch (errno) {
+    case EACCES:
+    /* warning resets errno set by wiringPi */
+	log_warn("Running without root privileges,\n\t"
+		 "this may work dependant on hardware configuration.");
+    case 0:
+	break;
+    default:
+	log_warn("GPIO error");
+    }
+
+    if (wiringPiSPISetup(Bus->channel, Bus->speed_hz) == -1) {
+	log_err("Failed to initialise SPI comms.");
+	free(chunk);
+	return 1;
+    }
+
+    Bus->ctx = chunk;
+    log_info("GPIO initialised.");
+
+    return 0;
+}
+
+static void
+wiringpi_close(struct Transport *Bus)
+{
+    free(Bus->ctx);
+    Bus->ctx = NULL;
+    return;
+}
+
+static int
+wiringpi_pin_mode(__attribute__((unused)) struct Transport *Bus,
+		  int pin, enum GPIO_PIN_MODE mode)
+{
+    pinMode(pin, (mode == GPIO_OUTPUT) ? OUTPUT : INPUT);
+    return 0;
+}
+
+static void
+wiringpi_gpio_write(__attribute__((unused)) struct Transport *Bus,
+		    int pin, int level)
+{
+    digitalWrite(pin, level);
+    return;
+}
+
+static int
+wiringpi_gpio_read(__attribute__((unused)) struct Transport *Bus, int pin)
+{
+    return digitalRead(pin);
+}
+
+/* Block on the interrupt handler until pin reads level. The level is
+   read with isr_lock held, so an edge cannot be lost between reading
+   and waiting. Returns 0 once reached, 1 on timeout, or -1 if
+   interrupts are unavailable for pin. */
+static int
+wiringpi_wait_level(__attribute__((unused)) struct Transport *Bus,
+		    int pin, int level, unsigned int timeout_ms)
+{
+    if (wiringpi_isr_setup(pin))
+	return -1;
+
+    struct timespec deadline =
+	clock_us_to_timespec(clock_now_us() + (uint64_t)timeout_ms * 1000);
+    int rc = 0;
+
+    pthread_mutex_lock(&isr_lock);
+    while (digitalRead(pin) != level) {
+	if (pthread_cond_timedwait(&isr_edge, &isr_lock, &deadline)
+	    == ETIMEDOUT) {
+	    rc = (digitalRead(pin) == level) ? 0 : 1;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&isr_lock);
+
+    return rc;
+}
+
+/* wiringPiSPIDataRW overwrites the buffer it is given with the data
+   clocked in, so the outgoing data is copied to the transport's
+   scratch buffer first. Returns non-zero on failure. */
+static int
+wiringpi_spi_write(struct Transport *Bus, const uint8_t *buf, size_t len)
+{
+    uint8_t *chunk = Bus->ctx;
+
+    while (len > 0) {
+	size_t n = (len < WIRINGPI_BUF_MAX) ? len : WIRINGPI_BUF_MAX;
+	memcpy(chunk, buf, n);
+	if (wiringPiSPIDataRW(Bus->channel, chunk, n) < 0)
+	    return 1;
+	buf += n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+static void
+wiringpi_delay_ms(__attribute__((unused)) struct Transport *Bus,
+		  unsigned int ms)
+{
+    delay(ms);
+    return;
+}
+
+const struct TransportOps wiringpi_ops =
+    { .name       = "wiringPi",
+      .open       = wiringpi_open,
+      .close      = wiringpi_close,
+      .pin_mode   = wiringpi_pin_mode,
+      .gpio_write = wiringpi_gpio_write,
+      .gpio_read  = wiringpi_gpio_read,
+      .wait_level = wiringpi_wait_level,
+      .spi_write  = wiringpi_spi_write,
+      .delay_ms   = wiringpi_delay_ms };
+
+#else  /* !WIRINGPI */
+
+/* Library built without wiringPi, the backend cannot be opened */
+static int
+wiringpi_open(__attribute__((unused)) struct Transport *Bus)
+{
+    errno = ENOTSUP;
+    log_err("libwsepd was built without wiringPi (WIRINGPI=0).");
+    return 1;
+}
+
+const struct TransportOps wiringpi_ops =
+    { .name = "wiringPi",
+      .open = wiringpi_open };
+
+#endif /* WIRINGPI */
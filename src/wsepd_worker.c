@@ -0,0 +1,224 @@
+/* wsepd_worker.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Background refresh worker with latest-wins frame coalescing. The
+ * worker lock is only held to exchange buffers, never while the
+ * display is being refreshed, so producers do not block on the panel.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ert_log.h>
+
+#include "wsepd_worker.h"
+
+struct Worker {
+    EPD Display;
+    WORKER_FN refresh;
+    EPD_REFRESH_CB callback;
+    void *arg;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;	/* Signalled when a frame is pending */
+    pthread_cond_t completed;	/* Broadcast after each refresh */
+
+    size_t framelen;
+    uint8_t *pending;		/* Newest submitted frame */
+    uint8_t *active;		/* Frame being refreshed */
+    int has_pending;
+    int stop;
+
+    unsigned long next_ticket;	/* Ticket of the next submission */
+    unsigned long pending_ticket;
+    unsigned long done_ticket;	/* Newest ticket refreshed */
+    int done_rc;		/* Status of that refresh */
+};
+
+/* Worker thread, refreshes the pending frame until asked to stop and
+   nothing is left pending */
+static void *
+worker_run(void *data)
+{
+    struct Worker *W = data;
+
+    pthread_mutex_lock(&W->lock);
+    for (;;) {
+	while (!W->has_pending && !W->stop)
+	    pthread_cond_wait(&W->submitted, &W->lock);
+
+	if (!W->has_pending)	/* stop requested and nothing to do */
+	    break;
+
+	/* Take the newest frame, later submissions refill pending */
+	uint8_t *frame = W->pending;
+	W->pending = W->active;
+	W->active = frame;
+	W->has_pending = 0;
+	unsigned long ticket = W->pending_ticket;
+	EPD_REFRESH_CB callback = W->callback;
+	void *arg = W->arg;
+	pthread_mutex_unlock(&W->lock);
+
+	int rc = W->refresh(W->Display, frame);
+	if (callback)
+	    callback(W->Display, ticket, rc, arg);
+
+	pthread_mutex_lock(&W->lock);
+	W->done_ticket = ticket;
+	W->done_rc = rc;
+	pthread_cond_broadcast(&W->completed);
+    }
+    pthread_mutex_unlock(&W->lock);
+
+    return NULL;
+}
+
+/* Allocates the frame buffers and starts the worker thread. Returns
+   NULL on failure. */
+struct Worker *
+WORKER_create(EPD Display, size_t framelen, WORKER_FN refresh)
+{
+    struct Worker *W = calloc(1, sizeof *W);
+    if (NULL == W) {
+	log_err("Memory error.");
+	return NULL;
+    }
+
+    W->Display = Display;
+    W->refresh = refresh;
+    W->framelen = framelen;
+    W->next_ticket = 1;
+
+    W->pending = malloc(framelen);
+    W->active = malloc(framelen);
+    if (NULL == W->pending || NULL == W->active) {
+	log_err("Memory error.");
+	goto out1;
+    }
+
+    pthread_mutex_init(&W->lock, NULL);
+    pthread_cond_init(&W->submitted, NULL);
+    pthread_cond_init(&W->completed, NULL);
+
+    if (pthread_create(&W->thread, NULL, worker_run, W)) {
+	log_err("Failed to start refresh worker.");
+	goto out2;
+    }
+    log_debug("Refresh worker started.");
+
+    return W;
+ out2:
+    pthread_cond_destroy(&W->completed);
+    pthread_cond_destroy(&W->submitted);
+    pthread_mutex_destroy(&W->lock);
+ out1:
+    free(W->active);
+    free(W->pending);
+    free(W);
+    return NULL;
+}
+
+/* Refreshes any pending frame, stops the worker and frees it */
+void
+WORKER_destroy(struct Worker *W)
+{
+    if (NULL == W) {
+	log_warn("Attempted to destroy invalid worker");
+	return;
+    }
+
+    pthread_mutex_lock(&W->lock);
+    W->stop = 1;
+    pthread_cond_signal(&W->submitted);
+    pthread_mutex_unlock(&W->lock);
+
+    pthread_join(W->thread, NULL);
+    log_debug("Refresh worker stopped.");
+
+    pthread_cond_destroy(&W->completed);
+    pthread_cond_destroy(&W->submitted);
+    pthread_mutex_destroy(&W->lock);
+    free(W->active);
+    free(W->pending);
+    free(W);
+
+    return;
+}
+
+/* Copies frame into the pending slot, replacing any frame not yet
+   taken by the worker. Returns the ticket for the frame. */
+unsigned long
+WORKER_submit(struct Worker *W, const uint8_t *frame)
+{
+    pthread_mutex_lock(&W->lock);
+
+    if (W->has_pending)
+	log_debug("Coalescing frame %lu.", W->pending_ticket);
+
+    memcpy(W->pending, frame, W->framelen);
+    W->pending_ticket = W->next_ticket++;
+    W->has_pending = 1;
+    unsigned long ticket = W->pending_ticket;
+
+    pthread_cond_signal(&W->submitted);
+    pthread_mutex_unlock(&W->lock);
+
+    return ticket;
+}
+
+/* Block until ticket has been refreshed, or superseded by a newer
+   frame that has. Returns the status of that refresh. */
+int
+WORKER_wait(struct Worker *W, unsigned long ticket)
+{
+    pthread_mutex_lock(&W->lock);
+
+    if (ticket >= W->next_ticket) {
+	pthread_mutex_unlock(&W->lock);
+	errno = EINVAL;
+	log_err("No frame has been submitted with ticket %lu.", ticket);
+	return 1;
+    }
+
+    while (W->done_ticket < ticket)
+	pthread_cond_wait(&W->completed, &W->lock);
+    int rc = W->done_rc;
+
+    pthread_mutex_unlock(&W->lock);
+
+    return rc;
+}
+
+/* Set the function called after each refresh completes */
+void
+WORKER_set_callback(struct Worker *W, EPD_REFRESH_CB cb, void *arg)
+{
+    pthread_mutex_lock(&W->lock);
+    W->callback = cb;
+    W->arg = arg;
+    pthread_mutex_unlock(&W->lock);
+
+    return;
+}
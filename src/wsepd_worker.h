@@ -0,0 +1,56 @@
+/* wsepd_worker.h
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Background refresh worker. Frames are copied on submission and
+ * refreshed by a worker thread. Frames submitted while a refresh is in
+ * flight are coalesced, only the newest reaches the display.
+ *
+ */
+
+#ifndef WSEPD_WORKER_H
+#define WSEPD_WORKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libwsepd.h"
+
+/* Refreshes the display with frame, returns non-zero on failure */
+typedef int (*WORKER_FN)(EPD Display, const uint8_t *frame);
+
+struct Worker;
+
+/* Starts the worker thread, returns NULL on failure */
+struct Worker *WORKER_create(EPD Display, size_t framelen, WORKER_FN refresh);
+
+/* Refreshes any pending frame then stops the worker thread */
+void WORKER_destroy(struct Worker *W);
+
+/* Copy frame for refresh, returns its ticket (never 0) */
+unsigned long WORKER_submit(struct Worker *W, const uint8_t *frame);
+
+/* Block until the frame with ticket, or a newer frame, is refreshed.
+   Returns the status of that refresh. */
+int WORKER_wait(struct Worker *W, unsigned long ticket);
+
+/* Called from the worker thread after each refresh */
+void WORKER_set_callback(struct Worker *W, EPD_REFRESH_CB cb, void *arg);
+
+#endif /* WSEPD_WORKER_H */
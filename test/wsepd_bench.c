@@ -0,0 +1,541 @@
+/* wsepd_bench.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Micro and macro benchmarks of the raster and transmit paths, run by
+ * `make bench` against an optimised build of the library. Transfers
+ * go to the in-memory recording backend. Each benchmark runs a fixed
+ * workload BENCH_RUNS times and the fastest run is reported, one CSV
+ * row per benchmark on stdout:
+ *
+ *   name,ops,ns_per_op,pixels_per_s,bytes_per_transfer
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ert_log.h>
+
+#include "libwsepd.h"
+#include "wsepd_path.h"
+#include "wsepd_transport.h"
+
+#define WIDTH  128
+#define HEIGHT 296
+#define BENCH_RUNS 5
+#define PATH_POINTS 1000
+
+/* One benchmark workload, returning the number of operations done */
+typedef size_t (*BENCH_FN)(EPD Display, void *arg);
+
+/* Result of the fastest run */
+struct Result {
+    size_t ops;
+    uint64_t ns;
+    uint64_t pixels;
+    uint64_t bytes;
+    uint64_t transfers;
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Run fn BENCH_RUNS times and print the fastest as a CSV row. setup,
+   when given, runs untimed before each run. */
+static void
+bench(const char *name, EPD Display, BENCH_FN fn, void *arg,
+      void (*setup)(void *arg))
+{
+    struct Transport *Bus = EPD_get_transport(Display);
+    struct Result Best = { .ns = UINT64_MAX };
+
+    for (int run = 0; run < BENCH_RUNS; ++run) {
+	struct EPD_STATS Before, After;
+
+	if (setup)
+	    setup(arg);
+	RECORD_reset(Bus);
+	EPD_get_stats(Display, &Before);
+	uint64_t bytes = Bus->bytes, transfers = Bus->transfers;
+
+	uint64_t start = now_ns();
+	size_t ops = fn(Display, arg);
+	uint64_t ns = now_ns() - start;
+
+	EPD_get_stats(Display, &After);
+	if (ns < Best.ns)
+	    Best = (struct Result){ .ops = ops, .ns = ns,
+				    .pixels = After.pixels - Before.pixels,
+				    .bytes = Bus->bytes - bytes,
+				    .transfers = Bus->transfers - transfers };
+    }
+
+    double ns = Best.ns ? (double)Best.ns : 1;
+    printf("%s,%zu,%.1f,%.0f,%.1f\n", name, Best.ops,
+	   Best.ops ? ns / Best.ops : 0, Best.pixels * 1e9 / ns,
+	   Best.transfers ? (double)Best.bytes / Best.transfers : 0);
+    fflush(stdout);
+}
+
+/* Every pixel of the canvas, 16 times */
+static size_t
+bench_set_px(EPD Display, __attribute__((unused)) void *arg)
+{
+    for (int i = 0; i < 16; ++i)
+	for (size_t y = 0; y < HEIGHT; ++y)
+	    for (size_t x = 0; x < WIDTH; ++x)
+		EPD_set_px(Display, x, y);
+
+    return 16 * WIDTH * HEIGHT;
+}
+
+/* A fixed scatter of points */
+static struct Coordinate Scatter[1 << 16];
+
+static void
+scatter_setup(void)
+{
+    uint32_t seed = 4242;
+
+    for (size_t i = 0; i < sizeof Scatter / sizeof *Scatter; ++i) {
+	seed = seed * 1103515245 + 12345;
+	Scatter[i].x = (seed >> 8) % WIDTH;
+	seed = seed * 1103515245 + 12345;
+	Scatter[i].y = (seed >> 8) % HEIGHT;
+    }
+}
+
+/* The scatter through EPD_set_px, EPD_set_pixels and the raster */
+static size_t
+bench_scatter_px(EPD Display, __attribute__((unused)) void *arg)
+{
+    for (size_t i = 0; i < sizeof Scatter / sizeof *Scatter; ++i)
+	EPD_set_px(Display, Scatter[i].x, Scatter[i].y);
+
+    return sizeof Scatter / sizeof *Scatter;
+}
+
+static size_t
+bench_scatter_batch(EPD Display, __attribute__((unused)) void *arg)
+{
+    EPD_set_pixels(Display, Scatter, sizeof Scatter / sizeof *Scatter);
+
+    return sizeof Scatter / sizeof *Scatter;
+}
+
+static size_t
+bench_scatter_raster(EPD Display, __attribute__((unused)) void *arg)
+{
+    struct EPD_RASTER Raster;
+
+    EPD_get_raster(Display, &Raster);
+    for (size_t i = 0; i < sizeof Scatter / sizeof *Scatter; ++i)
+	EPD_raster_px(&Raster, Scatter[i].x, Scatter[i].y);
+
+    return sizeof Scatter / sizeof *Scatter;
+}
+
+/* A 40 x 40 icon composited over the canvas at every alignment */
+static uint8_t Icon[40 * 5];
+
+static size_t
+bench_blit(EPD Display, void *arg)
+{
+    enum EPD_ROP rop = *(enum EPD_ROP *)arg;
+    size_t ops = 0;
+
+    for (int i = 0; i < 16; ++i)
+	for (long y = -20; y < HEIGHT; y += 13)
+	    for (long x = -20; x < WIDTH; x += 7, ++ops)
+		EPD_blit(Display, Icon, 40, 40, 5, x, y, rop);
+
+    return ops;
+}
+
+/* A full panel bar chart, 16 bars of varying height each drawn
+   filled with an outline around it */
+static size_t
+bench_bars(EPD Display, __attribute__((unused)) void *arg)
+{
+    size_t ops = 0;
+
+    for (int i = 0; i < 64; ++i)
+	for (long b = 0; b < 16; ++b, ++ops) {
+	    long h = 20 + ((b * 37 + i) % (HEIGHT - 20));
+	    EPD_fill_rect(Display, b * 8, HEIGHT - h, 7, h);
+	    EPD_draw_rect(Display, b * 8, HEIGHT - h, 7, h);
+	}
+
+    return ops;
+}
+
+/* Filled and outlined circles over the canvas */
+static size_t
+bench_circles(EPD Display, void *arg)
+{
+    int fill = *(int *)arg;
+    size_t ops = 0;
+
+    for (long r = 4; r < 64; r += 4)
+	for (long y = 0; y < HEIGHT; y += 37, ++ops)
+	    if (fill)
+		EPD_fill_circle(Display, WIDTH / 2, y, r);
+	    else
+		EPD_draw_circle(Display, WIDTH / 2, y, r);
+
+    return ops;
+}
+
+static FONT bench_font;
+
+/* A screen of text, 18 lines of 16 characters */
+static size_t
+bench_text(EPD Display, __attribute__((unused)) void *arg)
+{
+    static const char line[] = "The quick brown fox jumps over the lazy dog";
+    size_t ops = 0;
+
+    for (int i = 0; i < 16; ++i, ++ops)
+	for (long y = 0; y + FONT_HEIGHT <= HEIGHT; y += FONT_HEIGHT) {
+	    char text[17];
+	    memcpy(text, line + (y / FONT_HEIGHT) % (sizeof line - 17), 16);
+	    text[16] = '\0';
+	    EPD_draw_text(Display, 0, y, text);
+	}
+
+    return ops;
+}
+
+/* Wrapping a paragraph into the panel, laid out afresh each time
+   unless arg is set */
+static size_t
+bench_layout(EPD Display, void *arg)
+{
+    static const char text[] = "Lorem ipsum dolor sit amet, consectetur "
+	"adipiscing elit, sed do eiusmod tempor incididunt ut labore et "
+	"dolore magna aliqua. Ut enim ad minim veniam, quis nostrud "
+	"exercitation ullamco laboris nisi ut aliquip ex ea commodo.";
+    struct LayoutBox Box = { .width = WIDTH, .height = HEIGHT,
+			     .align = ALIGN_CENTRE,
+			     .flags = LAYOUT_WRAP | LAYOUT_ELLIPSIS };
+    LAYOUT Text = LAYOUT_create(bench_font);
+    size_t ops = 0;
+
+    for (int i = 0; i < 256; ++i, ++ops) {
+	if (!arg)
+	    Box.x = i & 1;
+	LAYOUT_set_text(Text, &Box, text);
+	EPD_draw_layout(Display, Text);
+    }
+
+    LAYOUT_destroy(Text);
+    return ops;
+}
+
+/* Loading the font at path */
+static size_t
+bench_font_load(__attribute__((unused)) EPD Display, void *arg)
+{
+    FONT Font = FONT_load(arg);
+    if (Font)
+	FONT_destroy(Font);
+
+    return 1;
+}
+
+/* An image file drawn over the canvas */
+struct ImageJob {
+    const char *path;
+    size_t w, h;		/* Scaled size, 0 for the file's */
+    enum EPD_DITHER dither;
+};
+
+/* Write a w x h PGM of diagonal gradients to path */
+static int
+image_write(const char *path, size_t w, size_t h)
+{
+    FILE *fp = fopen(path, "wb");
+    if (NULL == fp)
+	return 1;
+
+    fprintf(fp, "P5 %zu %zu 255\n", w, h);
+    for (size_t y = 0; y < h; ++y)
+	for (size_t x = 0; x < w; ++x)
+	    putc(((x + y) * 255) / (w + h), fp);
+
+    return fclose(fp);
+}
+
+static size_t
+bench_image(EPD Display, void *arg)
+{
+    const struct ImageJob *Job = arg;
+
+    for (int i = 0; i < 4; ++i)
+	EPD_draw_image(Display, Job->path, 0, 0, Job->w, Job->h, Job->dither);
+
+    return 4;
+}
+
+/* Paths consumed by one run, traversal cannot be rewound so each run
+   draws freshly built paths */
+struct PathSet {
+    PATH *Routes;
+    size_t n;
+    size_t (*build)(PATH Route, size_t i);
+};
+
+static void
+paths_setup(void *arg)
+{
+    struct PathSet *Set = arg;
+
+    for (size_t i = 0; i < Set->n; ++i) {
+	if (PATH_get_length(Set->Routes[i]) > 0)
+	    PATH_clear_coordinates(Set->Routes[i]);
+	Set->build(Set->Routes[i], i);
+    }
+}
+
+static size_t
+bench_paths(EPD Display, void *arg)
+{
+    struct PathSet *Set = arg;
+    size_t ops = 0;
+
+    for (size_t i = 0; i < Set->n; ++i) {
+	EPD_draw_path(Display, Set->Routes[i]);
+	ops += PATH_get_length(Set->Routes[i]) - 1;
+    }
+
+    return ops;
+}
+
+/* Lines across the canvas at a fixed slope, stepped along the other
+   axis */
+static size_t slope_dx, slope_dy;
+
+static size_t
+build_slope(PATH Route, size_t i)
+{
+    size_t x = (slope_dx == 0) ? i % WIDTH : 0;
+    size_t y = (slope_dy == 0) ? i % HEIGHT : 0;
+
+    if (slope_dx && slope_dy) {
+	x = i % (WIDTH - slope_dx);
+	y = i % (HEIGHT - slope_dy);
+    }
+    PATH_append_coordinate(Route, x, y);
+    PATH_append_coordinate(Route, x + (slope_dx ? slope_dx : 0),
+			   y + (slope_dy ? slope_dy : 0));
+    return 2;
+}
+
+/* A long random walk, the same for every run */
+static size_t
+build_walk(PATH Route, size_t i)
+{
+    uint32_t seed = 12345 + i;
+
+    for (size_t p = 0; p < PATH_POINTS; ++p) {
+	seed = seed * 1103515245 + 12345;
+	size_t x = (seed >> 8) % WIDTH;
+	seed = seed * 1103515245 + 12345;
+	size_t y = (seed >> 8) % HEIGHT;
+	PATH_append_coordinate(Route, x, y);
+    }
+    return PATH_POINTS;
+}
+
+/* Clear and present the canvas, the refresh finds the frame unchanged
+   after the first run so this is dominated by the buffer fills */
+static size_t
+bench_clear(EPD Display, __attribute__((unused)) void *arg)
+{
+    for (int i = 0; i < 64; ++i)
+	EPD_clear(Display);
+
+    return 64;
+}
+
+/* Full refreshes of a cold controller: reset, configuration, frame
+   upload, activation and sleep */
+static size_t
+bench_refresh(EPD Display, __attribute__((unused)) void *arg)
+{
+    for (int i = 0; i < 64; ++i) {
+	EPD_set_px(Display, i, i);
+	EPD_swap(Display);
+	EPD_refresh(Display);
+	RECORD_reset(EPD_get_transport(Display));
+    }
+
+    return 64;
+}
+
+int
+main(int argc, char *argv[])
+{
+    log_debug("Benchmarking %s (argc == %d).", argv[0], argc);
+
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	return 1;
+
+    printf("name,ops,ns_per_op,pixels_per_s,bytes_per_transfer\n");
+
+    static const struct {
+	const char *name;
+	enum WRITE_MODE mode;
+    } modes[] = { { "set_px_toggle", TOGGLEMODE },
+		  { "set_px_fg", FGMODE },
+		  { "set_px_bg", BGMODE } };
+    for (size_t i = 0; i < sizeof modes / sizeof *modes; ++i) {
+	EPD_set_write_mode(Display, modes[i].mode);
+	bench(modes[i].name, Display, bench_set_px, NULL, NULL);
+    }
+    EPD_set_write_mode(Display, TOGGLEMODE);
+
+    scatter_setup();
+    bench("scatter_set_px", Display, bench_scatter_px, NULL, NULL);
+    bench("scatter_set_pixels", Display, bench_scatter_batch, NULL, NULL);
+    bench("scatter_raster", Display, bench_scatter_raster, NULL, NULL);
+
+    memset(Icon, 0xA5, sizeof Icon);
+    enum EPD_ROP rop = ROP_COPY;
+    bench("blit_copy_40x40", Display, bench_blit, &rop, NULL);
+    rop = ROP_XOR;
+    bench("blit_xor_40x40", Display, bench_blit, &rop, NULL);
+
+    bench("bar_chart", Display, bench_bars, NULL, NULL);
+
+    FONT Font = FONT_load("font/unifont-12.0.01.hex");
+    if (NULL == Font)
+	return 1;
+    EPD_set_font(Display, Font);
+    bench_font = Font;
+    bench("text_screen", Display, bench_text, NULL, NULL);
+    bench("layout_paragraph", Display, bench_layout, NULL, NULL);
+    bench("layout_cached", Display, bench_layout, Display, NULL);
+
+    char pack[] = "/tmp/wsepd_benchXXXXXX";
+    int fd = mkstemp(pack);
+    if (fd < 0 || FONT_write_pack(Font, pack, NULL, 0))
+	return 1;
+    close(fd);
+    bench("font_load_hex", Display, bench_font_load,
+	  "font/unifont-12.0.01.hex", NULL);
+    bench("font_load_pack", Display, bench_font_load, pack, NULL);
+
+    FONT Packed = FONT_load(pack);
+    if (NULL == Packed)
+	return 1;
+    EPD_set_font(Display, Packed);
+    bench("text_screen_pack", Display, bench_text, NULL, NULL);
+    EPD_set_font(Display, Font);
+    /* A canvas sized file and a photo sized one scaled down */
+    char small[] = "/tmp/wsepd_benchXXXXXX", large[] = "/tmp/wsepd_benchXXXXXX";
+    int sfd = mkstemp(small), lfd = mkstemp(large);
+    if (sfd < 0 || lfd < 0 || image_write(small, WIDTH, HEIGHT)
+	|| image_write(large, 1600, 1200))
+	return 1;
+    close(sfd);
+    close(lfd);
+    static const struct {
+	const char *name;
+	enum EPD_DITHER dither;
+    } dithers[] = { { "threshold", DITHER_THRESHOLD },
+		    { "ordered", DITHER_ORDERED },
+		    { "diffusion", DITHER_DIFFUSION } };
+    for (size_t i = 0; i < sizeof dithers / sizeof *dithers; ++i) {
+	char name[64];
+	struct ImageJob Job = { small, 0, 0, dithers[i].dither };
+	snprintf(name, sizeof name, "image_%s", dithers[i].name);
+	bench(name, Display, bench_image, &Job, NULL);
+	Job = (struct ImageJob){ large, WIDTH, HEIGHT, dithers[i].dither };
+	snprintf(name, sizeof name, "image_scaled_%s", dithers[i].name);
+	bench(name, Display, bench_image, &Job, NULL);
+    }
+    unlink(small);
+    unlink(large);
+
+    int fill = 1;
+    bench("circle_fill", Display, bench_circles, &fill, NULL);
+    fill = 0;
+    bench("circle_outline", Display, bench_circles, &fill, NULL);
+
+    static const struct {
+	const char *name;
+	size_t dx, dy;
+    } slopes[] = { { "line_horizontal", WIDTH - 1, 0 },
+		   { "line_vertical", 0, HEIGHT - 1 },
+		   { "line_shallow", WIDTH - 1, 20 },
+		   { "line_diagonal", WIDTH - 1, WIDTH - 1 },
+		   { "line_steep", 20, HEIGHT - 1 } };
+
+    struct PathSet Set = { .n = 256 };
+    Set.Routes = calloc(Set.n, sizeof *Set.Routes);
+    if (NULL == Set.Routes)
+	return 1;
+    for (size_t i = 0; i < Set.n; ++i)
+	if (NULL == (Set.Routes[i] = PATH_create(WIDTH, HEIGHT)))
+	    return 1;
+
+    Set.build = build_slope;
+    for (size_t i = 0; i < sizeof slopes / sizeof *slopes; ++i) {
+	slope_dx = slopes[i].dx;
+	slope_dy = slopes[i].dy;
+	bench(slopes[i].name, Display, bench_paths, &Set, paths_setup);
+    }
+
+    Set.build = build_walk;
+    Set.n = 8;
+    bench("path_long", Display, bench_paths, &Set, paths_setup);
+
+    bench("clear", Display, bench_clear, NULL, NULL);
+    bench("refresh_full", Display, bench_refresh, NULL, NULL);
+
+    /* The same with the frame turned onto the panel */
+    if (EPD_set_orientation(Display, ROTATE_90, 0))
+	return 1;
+    bench("refresh_full_rotate_90", Display, bench_refresh, NULL, NULL);
+    if (EPD_set_orientation(Display, ROTATE_180, EPD_INVERT))
+	return 1;
+    bench("refresh_full_rotate_180", Display, bench_refresh, NULL, NULL);
+
+    for (size_t i = 0; i < 256; ++i)
+	PATH_destroy(Set.Routes[i]);
+    free(Set.Routes);
+    EPD_destroy(Display);
+    FONT_destroy(Packed);
+    FONT_destroy(Font);
+    unlink(pack);
+
+    return 0;
+}
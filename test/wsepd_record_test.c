@@ -0,0 +1,2108 @@
+/* wsepd_record_test.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Checks the SPI byte stream produced by libwsepd.a against the
+ * expected controller commands, using the in-memory recording
+ * backend. No hardware is required.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ert_log.h>
+
+#include "libwsepd.h"
+#include "waveshare2.9.h"
+#include "wsepd_transport.h"
+#include "wsepd_trace.h"
+
+#define WIDTH  128
+#define HEIGHT 296
+
+/* Position in a recorded stream */
+struct Stream {
+    const struct RecordEntry *entries;
+    size_t length;
+    size_t pos;
+};
+
+/* Consume the next entry if it is the command byte cmd followed by
+   exactly len data bytes matching data. Returns non-zero on
+   mismatch. */
+static int
+expect_command(struct Stream *S, uint8_t cmd, const uint8_t *data, size_t len)
+{
+    if (S->pos + 1 + len > S->length) {
+	log_err("Stream ended, expected command 0x%02X.", cmd);
+	return 1;
+    }
+
+    if (S->entries[S->pos].dc != 0 || S->entries[S->pos].byte != cmd) {
+	log_err("Entry %zu: expected command 0x%02X, got %s 0x%02X.",
+		S->pos, cmd, S->entries[S->pos].dc ? "data" : "command",
+		S->entries[S->pos].byte);
+	return 1;
+    }
+    ++S->pos;
+
+    for (size_t i = 0; i < len; ++i, ++S->pos) {
+	if (S->entries[S->pos].dc != 1 || S->entries[S->pos].byte != data[i]) {
+	    log_err("Entry %zu: command 0x%02X data byte %zu mismatch.",
+		    S->pos, cmd, i);
+	    return 1;
+	}
+    }
+
+    if (S->pos < S->length && S->entries[S->pos].dc == 1) {
+	log_err("Entry %zu: unexpected data after command 0x%02X.",
+		S->pos, cmd);
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Skip forward to the next occurrence of command byte cmd */
+static int
+seek_command(struct Stream *S, uint8_t cmd)
+{
+    while (S->pos < S->length) {
+	if (S->entries[S->pos].dc == 0 && S->entries[S->pos].byte == cmd)
+	    return 0;
+	++S->pos;
+    }
+
+    log_err("Command 0x%02X not found in stream.", cmd);
+    return 1;
+}
+
+/* A full refresh sets the cursor once and streams the entire bitmap
+   in a single WRITE_RAM. */
+static int
+test_full_frame(void)
+{
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	return 1;
+
+    struct Transport *Bus = EPD_get_transport(Display);
+    EPD_set_px(Display, 0, 0);
+    EPD_set_px(Display, WIDTH-1, HEIGHT-1);
+    EPD_swap(Display);
+
+    RECORD_reset(Bus);
+    int rc = EPD_refresh(Display);
+
+    struct Stream S;
+    S.entries = RECORD_get_entries(Bus, &S.length);
+    S.pos = 0;
+
+    const uint8_t window_x[] = { 0x00, (WIDTH - 1) >> 3 };
+    const uint8_t window_y[] = { 0x00, 0x00,
+				 (HEIGHT - 1) & 0xFF, (HEIGHT - 1) >> 8 };
+    const uint8_t origin_x[] = { 0x00 };
+    const uint8_t origin_y[] = { 0x00, 0x00 };
+
+    rc = rc
+	|| seek_command(&S, SET_RAM_X_ADDRESS_START_END_POSITION)
+	|| expect_command(&S, SET_RAM_X_ADDRESS_START_END_POSITION,
+			  window_x, sizeof window_x)
+	|| expect_command(&S, SET_RAM_Y_ADDRESS_START_END_POSITION,
+			  window_y, sizeof window_y)
+	|| expect_command(&S, SET_RAM_X_ADDRESS_COUNTER,
+			  origin_x, sizeof origin_x)
+	|| expect_command(&S, SET_RAM_Y_ADDRESS_COUNTER,
+			  origin_y, sizeof origin_y)
+	|| expect_command(&S, WRITE_RAM, EPD_get_front(Display),
+			  (WIDTH / 8) * HEIGHT)
+	|| expect_command(&S, DISPLAY_UPDATE_CONTROL_2,
+			  (const uint8_t []){ 0xC4 }, 1);
+
+    /* Only one WRITE_RAM for the whole frame */
+    size_t writes = 0;
+    for (size_t i = 0; i < S.length; ++i)
+	if (S.entries[i].dc == 0 && S.entries[i].byte == WRITE_RAM)
+	    ++writes;
+    if (!rc && writes != 1) {
+	log_err("%zu WRITE_RAM commands in a full refresh.", writes);
+	rc = 1;
+    }
+
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* A windowed write sets the window, then the cursor and WRITE_RAM
+   for each row of the window only. */
+static int
+test_window(void)
+{
+    struct Transport *Bus = TRANSPORT_create(RECORD_BACKEND, 0, 0, NULL);
+    if (Bus == NULL)
+	return 1;
+
+    const size_t stride = 4;
+    uint8_t buf[4 * 4];
+    for (size_t i = 0; i < sizeof buf; ++i)
+	buf[i] = i;
+
+    /* Pixels 9 to 20 span bytes 1 and 2 */
+    int rc = write_ram_window(Bus, buf, stride, 9, 20, 1, 2);
+
+    struct Stream S;
+    S.entries = RECORD_get_entries(Bus, &S.length);
+    S.pos = 0;
+
+    const uint8_t window_x[] = { 1, 2 };
+    const uint8_t window_y[] = { 1, 0, 2, 0 };
+    rc = rc
+	|| expect_command(&S, SET_RAM_X_ADDRESS_START_END_POSITION,
+			  window_x, sizeof window_x)
+	|| expect_command(&S, SET_RAM_Y_ADDRESS_START_END_POSITION,
+			  window_y, sizeof window_y);
+
+    for (uint8_t y = 1; y <= 2 && !rc; ++y) {
+	const uint8_t cursor_x[] = { 1 };
+	const uint8_t cursor_y[] = { y, 0 };
+	rc = expect_command(&S, SET_RAM_X_ADDRESS_COUNTER,
+			    cursor_x, sizeof cursor_x)
+	    || expect_command(&S, SET_RAM_Y_ADDRESS_COUNTER,
+			      cursor_y, sizeof cursor_y)
+	    || expect_command(&S, WRITE_RAM, buf + (y * stride) + 1, 2);
+    }
+
+    if (!rc && S.pos != S.length) {
+	log_err("%zu unexpected trailing entries.", S.length - S.pos);
+	rc = 1;
+    }
+
+    TRANSPORT_destroy(Bus);
+    return rc;
+}
+
+/* Frames are refreshed in the background, the newest frame queued is
+   the last written to RAM. */
+static void
+count_refresh(__attribute__((unused)) EPD Display,
+	      __attribute__((unused)) unsigned long ticket,
+	      __attribute__((unused)) int rc, void *arg)
+{
+    ++*(int *)arg;
+}
+
+static int
+test_async(void)
+{
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	return 1;
+
+    struct Transport *Bus = EPD_get_transport(Display);
+    int refreshes = 0;
+    EPD_set_refresh_callback(Display, count_refresh, &refreshes);
+    RECORD_reset(Bus);
+
+    unsigned long ticket = 0;
+    for (size_t y = 0; y < 8; ++y) {
+	EPD_set_px(Display, y, y);
+	EPD_swap(Display);
+	ticket = EPD_refresh_async(Display);
+    }
+
+    int rc = (ticket == 0) || EPD_refresh_wait(Display, ticket);
+
+    /* Last WRITE_RAM must carry the final frame */
+    size_t n, last = 0;
+    const struct RecordEntry *entries = RECORD_get_entries(Bus, &n);
+    for (size_t i = 0; i < n; ++i)
+	if (entries[i].dc == 0 && entries[i].byte == WRITE_RAM)
+	    last = i;
+
+    struct Stream S = { entries, n, last };
+    rc = rc || expect_command(&S, WRITE_RAM, EPD_get_front(Display),
+			      (WIDTH / 8) * HEIGHT);
+
+    if (!rc && (refreshes < 1 || refreshes > 8)) {
+	log_err("%d refreshes for 8 queued frames.", refreshes);
+	rc = 1;
+    }
+    log_debug("8 asynchronous frames coalesced into %d refreshes.",
+	      refreshes);
+
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* Count command bytes cmd in the recorded stream */
+static size_t
+count_command(struct Transport *Bus, uint8_t cmd)
+{
+    size_t n, count = 0;
+    const struct RecordEntry *entries = RECORD_get_entries(Bus, &n);
+
+    for (size_t i = 0; i < n; ++i)
+	if (entries[i].dc == 0 && entries[i].byte == cmd)
+	    ++count;
+
+    return count;
+}
+
+/* With an idle window the device stays initialised between refreshes
+   and is put to sleep by the timer once idle. */
+static int
+test_warm(void)
+{
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	return 1;
+
+    struct Transport *Bus = EPD_get_transport(Display);
+    EPD_set_idle_sleep(Display, 50);
+    RECORD_reset(Bus);
+
+    EPD_set_px(Display, 0, 0);
+    EPD_swap(Display);
+    int rc = EPD_refresh(Display);
+    EPD_set_px(Display, 1, 1);
+    EPD_swap(Display);
+    rc = rc || EPD_refresh(Display);
+
+    if (!rc && (count_command(Bus, WRITE_LUT_REGISTER) != 1
+		|| count_command(Bus, DEEP_SLEEP_MODE) != 0
+		|| !EPD_get_poweron(Display))) {
+	log_err("Warm refresh re-initialised or slept the device.");
+	rc = 1;
+    }
+
+    /* Idle timer puts the device to sleep */
+    for (int i = 0; i < 100 && EPD_get_poweron(Display); ++i)
+	usleep(10000);
+
+    if (!rc && (EPD_get_poweron(Display)
+		|| count_command(Bus, DEEP_SLEEP_MODE) != 1)) {
+	log_err("Device not put to sleep once idle.");
+	rc = 1;
+    }
+
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* Partial refreshes write only the window, twice, with the partial
+   LUT, until the policy forces a full refresh. */
+static int
+test_partial(void)
+{
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	return 1;
+
+    struct Transport *Bus = EPD_get_transport(Display);
+    EPD_set_idle_sleep(Display, 60000);
+    EPD_set_refresh_mode(Display, PARTIAL_REFRESH);
+    EPD_set_partial_policy(Display, 2, 50);
+
+    /* Sleeping device, always a full refresh */
+    int rc = EPD_refresh_area(Display, 8, 8, 16, 16);
+    RECORD_reset(Bus);
+
+    rc = rc || EPD_refresh_area(Display, 8, 8, 16, 16);
+    if (!rc && (count_command(Bus, WRITE_LUT_REGISTER) != 1
+		|| count_command(Bus, WRITE_RAM) != 2 * 16
+		|| count_command(Bus, MASTER_ACTIVATION) != 1)) {
+	log_err("Partial refresh did not write the window.");
+	rc = 1;
+    }
+
+    /* Large area, full refresh and full LUT */
+    RECORD_reset(Bus);
+    rc = rc || EPD_refresh_area(Display, 0, 0, WIDTH, HEIGHT);
+    if (!rc && (count_command(Bus, WRITE_LUT_REGISTER) != 1
+		|| count_command(Bus, WRITE_RAM) != 1)) {
+	log_err("Large partial refresh was not promoted to full.");
+	rc = 1;
+    }
+
+    /* Every third refresh is full */
+    RECORD_reset(Bus);
+    for (int i = 0; i < 3 && !rc; ++i)
+	rc = EPD_refresh_area(Display, 0, 0, 8, 8);
+    if (!rc && count_command(Bus, WRITE_RAM) != 2 * 8 * 2 + 1) {
+	log_err("Full refresh not forced after 2 partials.");
+	rc = 1;
+    }
+
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* Drawing lands in the back buffer only, EPD_swap exchanges the
+   buffers without copying. */
+static int
+test_swap(void)
+{
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	return 1;
+
+    uint8_t *back = EPD_get_bmp(Display);
+    uint8_t *front = EPD_get_front(Display);
+    uint8_t blank[(WIDTH / 8) * HEIGHT];
+    memcpy(blank, front, sizeof blank);
+
+    EPD_set_px(Display, 7, 7);
+    int rc = memcmp(front, blank, sizeof blank) == 0
+	&& memcmp(back, blank, sizeof blank) != 0 ? 0 : 1;
+
+    EPD_swap(Display);
+    if (EPD_get_front(Display) != back || EPD_get_bmp(Display) != front)
+	rc = 1;
+    if (rc)
+	log_err("Back buffer drawn or swapped incorrectly.");
+
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* Identical frames are not sent, a warm device only receives the
+   rows that changed. */
+static int
+test_diff(void)
+{
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	return 1;
+
+    struct Transport *Bus = EPD_get_transport(Display);
+    EPD_set_idle_sleep(Display, 60000);
+
+    /* Cold device, whole frame */
+    EPD_set_px(Display, 3, 3);
+    EPD_swap(Display);
+    RECORD_reset(Bus);
+    int rc = EPD_refresh(Display);
+    if (!rc && count_command(Bus, WRITE_RAM) != 1) {
+	log_err("Cold refresh did not send the frame.");
+	rc = 1;
+    }
+
+    RECORD_reset(Bus);
+    rc = rc || EPD_refresh(Display);
+    size_t n;
+    RECORD_get_entries(Bus, &n);
+    if (!rc && n != 0) {
+	log_err("Unchanged frame produced %zu bytes.", n);
+	rc = 1;
+    }
+
+    /* Rows 10 to 12 changed, the back buffer is redrawn from blank */
+    EPD_set_px(Display, 3, 3);
+    EPD_set_px(Display, 100, 10);
+    EPD_set_px(Display, 5, 12);
+    EPD_swap(Display);
+    RECORD_reset(Bus);
+    rc = rc || EPD_refresh(Display);
+
+    struct Stream S;
+    S.entries = RECORD_get_entries(Bus, &S.length);
+    S.pos = 0;
+    const uint8_t cursor_x[] = { 0 };
+    const uint8_t cursor_y[] = { 10, 0 };
+    rc = rc
+	|| seek_command(&S, SET_RAM_X_ADDRESS_COUNTER)
+	|| expect_command(&S, SET_RAM_X_ADDRESS_COUNTER,
+			  cursor_x, sizeof cursor_x)
+	|| expect_command(&S, SET_RAM_Y_ADDRESS_COUNTER,
+			  cursor_y, sizeof cursor_y)
+	|| expect_command(&S, WRITE_RAM, EPD_get_front(Display) + 10 * WIDTH / 8,
+			  3 * WIDTH / 8);
+    if (!rc && (count_command(Bus, WRITE_RAM) != 1
+		|| count_command(Bus, MASTER_ACTIVATION) != 1)) {
+	log_err("Changed rows not refreshed once.");
+	rc = 1;
+    }
+
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* Count the runs of consecutive bytes sent on one bus in the trace
+   file at path. Returns non-zero if it cannot be read. */
+static int
+trace_bus_runs(const char *path, size_t *runs)
+{
+    FILE *fp = fopen(path, "rb");
+    uint8_t rec[8];
+    long last = -1;
+
+    if (NULL == fp)
+	return 1;
+    if (fseek(fp, 16, SEEK_SET)) {
+	fclose(fp);
+	return 1;
+    }
+
+    *runs = 0;
+    while (fread(rec, sizeof rec, 1, fp) == 1) {
+	long bus = rec[6] | (rec[7] << 8);
+	if (bus != last)
+	    ++*runs;
+	last = bus;
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/* A wall splits its canvas into each panel, panels with no change
+   are left alone. Each panel uses its own wiring. */
+static int
+test_wall(void)
+{
+    struct EPD_CONFIG configs[2];
+    EPD_default_config(&configs[0]);
+    configs[0].backend = RECORD_BACKEND;
+    configs[1] = configs[0];
+    configs[1].channel = 1;
+    configs[1].rst_pin = 5;
+    configs[1].dc_pin = 6;
+    configs[1].cs_pin = 7;
+    configs[1].busy_pin = 13;
+
+    EPD Wall = EPD_create_wall(WIDTH, HEIGHT, 2, 1, configs);
+    if (Wall == NULL)
+	return 1;
+
+    int rc = (EPD_get_width(Wall) != 2 * WIDTH
+	      || EPD_get_height(Wall) != HEIGHT
+	      || EPD_get_panel_count(Wall) != 2);
+
+    struct Transport *Left = EPD_get_transport(EPD_get_panel(Wall, 0));
+    struct Transport *Right = EPD_get_transport(EPD_get_panel(Wall, 1));
+    RECORD_reset(Left);
+    RECORD_reset(Right);
+
+    /* Right hand panel only */
+    EPD_set_px(Wall, WIDTH + 9, 20);
+    EPD_swap(Wall);
+    rc = rc || EPD_refresh(Wall);
+
+    size_t n;
+    RECORD_get_entries(Left, &n);
+    if (!rc && n != 0) {
+	log_err("Unchanged panel sent %zu bytes.", n);
+	rc = 1;
+    }
+
+    /* Tile of the canvas, byte 1 of row 20 within the panel */
+    uint8_t tile[(WIDTH / 8) * HEIGHT];
+    const uint8_t *canvas = EPD_get_front(Wall);
+    for (size_t y = 0; y < HEIGHT; ++y)
+	memcpy(tile + y * (WIDTH / 8),
+	       canvas + y * (2 * WIDTH / 8) + (WIDTH / 8), WIDTH / 8);
+
+    struct Stream S;
+    S.entries = RECORD_get_entries(Right, &S.length);
+    S.pos = 0;
+    rc = rc
+	|| seek_command(&S, WRITE_RAM)
+	|| expect_command(&S, WRITE_RAM, tile, sizeof tile);
+    if (!rc && tile[20 * (WIDTH / 8) + 1] == tile[0]) {
+	log_err("Pixel missing from the panel tile.");
+	rc = 1;
+    }
+
+    /* Through the bus scheduler, only the left panel changed */
+    struct EPD_BUS_STATS Stats;
+    EPD_set_shared_bus(Wall, 1);
+    EPD_set_px(Wall, WIDTH + 9, 20);
+    EPD_set_px(Wall, 2, 2);
+    EPD_swap(Wall);
+    rc = rc || EPD_refresh(Wall);
+    EPD_get_bus_stats(Wall, &Stats);
+    if (!rc && Stats.panels != 1) {
+	log_err("%zu panels scheduled, expected 1.", Stats.panels);
+	rc = 1;
+    }
+
+    EPD_destroy(Wall);
+
+    /* Partial refreshes of an area across both panels of a shared
+       bus send to one panel at a time, one run of bytes per panel per
+       refresh. The panels are emulated in real time once warm, so a
+       panel waiting on busy between its two window uploads would give
+       the bus to the other if both ran at once. */
+    configs[0].backend = EMULATE_BACKEND;
+    configs[1].backend = EMULATE_BACKEND;
+    Wall = rc ? NULL : EPD_create_wall(WIDTH, HEIGHT, 2, 1, configs);
+    if (Wall == NULL)
+	return 1;
+
+    EPD_set_shared_bus(Wall, 1);
+    EPD_set_idle_sleep(Wall, 60000);
+    EPD_set_refresh_mode(Wall, PARTIAL_REFRESH);
+    EPD_set_px(Wall, 0, 30);
+    EPD_set_px(Wall, WIDTH, 30);
+    EPD_swap(Wall);
+    rc = EPD_refresh(Wall);
+
+    const struct EmulateTiming Timing = { .frame_us = 1000,
+					  .overhead_us = 20000,
+					  .realtime = 1 };
+    for (size_t i = 0; i < 2; ++i)
+	EMULATE_set_timing(EPD_get_transport(EPD_get_panel(Wall, i)),
+			   &Timing);
+
+    char path[] = "/tmp/wsepd_wallXXXXXX";
+    int fd = mkstemp(path);
+    size_t runs = 0;
+    rc = rc || fd < 0 || EPD_trace_start(1 << 17);
+    for (size_t i = 1; i <= 2 && !rc; ++i) {
+	EPD_set_px(Wall, WIDTH - i, 30);
+	EPD_set_px(Wall, WIDTH + i, 30);
+	EPD_swap(Wall);
+	rc = EPD_refresh_area(Wall, WIDTH - 16, 24, 32, 16);
+    }
+    rc = rc || EPD_trace_dump(path) || trace_bus_runs(path, &runs);
+    EPD_trace_stop();
+    if (!rc && runs != 2 * 2) {
+	log_err("Shared bus area refreshes sent %zu runs, expected 4.", runs);
+	rc = 1;
+    }
+    if (fd >= 0) {
+	close(fd);
+	unlink(path);
+    }
+
+    EPD_destroy(Wall);
+    return rc;
+}
+
+/* Panels on a shared bus each receive their frame once, throughput
+   is reported for the panels that changed. */
+/* Displays refreshed in turn from another thread */
+struct SharedRun {
+    EPD Displays[2];
+    int rc;
+};
+
+static void *
+shared_run(void *data)
+{
+    struct SharedRun *Run = data;
+
+    for (int i = 0; i < 50 && !Run->rc; ++i) {
+	EPD_set_px(Run->Displays[0], i, i);
+	EPD_swap(Run->Displays[0]);
+	Run->rc = EPD_refresh_shared(Run->Displays, 2, NULL, NULL);
+    }
+
+    return NULL;
+}
+
+static int
+test_shared(void)
+{
+    EPD Panels[3];
+    struct Transport *Buses[3];
+    int rc = 0;
+
+    for (size_t i = 0; i < 3; ++i) {
+	Panels[i] = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+	if (Panels[i] == NULL)
+	    return 1;
+	EPD_set_px(Panels[i], i, i);
+	EPD_swap(Panels[i]);
+	Buses[i] = EPD_get_transport(Panels[i]);
+	RECORD_reset(Buses[i]);
+    }
+
+    struct EPD_BUS_STATS Stats;
+    struct EPD_PANEL_STATS panel_stats[3];
+    rc = EPD_refresh_shared(Panels, 3, &Stats, panel_stats);
+
+    for (size_t i = 0; i < 3 && !rc; ++i) {
+	struct Stream S;
+	S.entries = RECORD_get_entries(Buses[i], &S.length);
+	S.pos = 0;
+	rc = seek_command(&S, WRITE_RAM)
+	    || expect_command(&S, WRITE_RAM, EPD_get_front(Panels[i]),
+			      (WIDTH / 8) * HEIGHT)
+	    || count_command(Buses[i], DEEP_SLEEP_MODE) != 1
+	    || panel_stats[i].bytes != (WIDTH / 8) * HEIGHT;
+    }
+    if (!rc && (Stats.panels != 3 || Stats.bytes != 3 * (WIDTH / 8) * HEIGHT
+		|| EPD_get_poweron(Panels[0]))) {
+	log_err("Shared bus refresh misreported.");
+	rc = 1;
+    }
+
+    /* Only the changed panel is scheduled */
+    EPD_set_px(Panels[1], 1, 1);
+    EPD_set_px(Panels[1], 50, 50);
+    EPD_swap(Panels[1]);
+    rc = rc || EPD_refresh_shared(Panels, 3, &Stats, panel_stats);
+    if (!rc && (Stats.panels != 1 || panel_stats[0].bytes != 0
+		|| panel_stats[1].bytes == 0)) {
+	log_err("Unchanged panels were scheduled.");
+	rc = 1;
+    }
+
+    /* A display listed twice is refused rather than locked twice */
+    EPD Twice[2] = { Panels[2], Panels[2] };
+    if (!rc && !EPD_refresh_shared(Twice, 2, NULL, NULL)) {
+	log_err("Duplicate display accepted.");
+	rc = 1;
+    }
+
+    /* The same displays passed in opposite orders from two threads */
+    struct SharedRun Runs[2] = { { { Panels[0], Panels[1] }, 0 },
+				 { { Panels[1], Panels[0] }, 0 } };
+    pthread_t thread;
+    if (!rc && pthread_create(&thread, NULL, shared_run, &Runs[0]) == 0) {
+	shared_run(&Runs[1]);
+	pthread_join(thread, NULL);
+	rc = Runs[0].rc || Runs[1].rc;
+    }
+
+    for (size_t i = 0; i < 3; ++i)
+	EPD_destroy(Panels[i]);
+    return rc;
+}
+
+/* Refresh Display after changing pixel (i, i), counting the
+   controller configurations it sends. Returns -1 on failure. */
+static long
+refresh_configures(EPD Display, size_t i)
+{
+    struct Transport *Bus = EPD_get_transport(Display);
+
+    RECORD_reset(Bus);
+    EPD_set_px(Display, i, i);
+    EPD_swap(Display);
+    if (EPD_refresh(Display))
+	return -1;
+
+    return count_command(Bus, DRIVER_OUTPUT_CONTROL);
+}
+
+/* Displays on one RST line are reset by each other, so a warm display
+   is configured again after a sibling's reset, whether refreshed alone
+   or through the bus scheduler. A display on its own line stays
+   warm. */
+static int
+test_shared_reset(void)
+{
+    struct EPD_CONFIG configs[3];
+    EPD Displays[3] = { NULL, NULL, NULL };
+    int rc = 1;
+
+    EPD_default_config(&configs[0]);
+    configs[0].backend = RECORD_BACKEND;
+    configs[1] = configs[0];
+    configs[1].channel = 1;
+    configs[1].dc_pin = 6;
+    configs[1].cs_pin = 7;
+    configs[1].busy_pin = 13;
+    configs[2] = configs[1];
+    configs[2].rst_pin = 5;
+
+    for (size_t i = 0; i < 3; ++i) {
+	Displays[i] = EPD_create_config(WIDTH, HEIGHT, &configs[i]);
+	if (Displays[i] == NULL)
+	    goto out;
+    }
+    EPD Warm = Displays[0], Sibling = Displays[1], Alone = Displays[2];
+    EPD_set_idle_sleep(Warm, 60000);
+    EPD_set_idle_sleep(Alone, 60000);
+    if (refresh_configures(Warm, 1) != 1 || refresh_configures(Alone, 1) != 1
+	|| refresh_configures(Warm, 2) != 0) {
+	log_err("Warm displays configured again.");
+	goto out;
+    }
+
+    /* Outside the scheduler */
+    if (refresh_configures(Sibling, 1) != 1
+	|| refresh_configures(Warm, 3) != 1
+	|| refresh_configures(Alone, 2) != 0) {
+	log_err("Reset through the shared line not detected.");
+	goto out;
+    }
+
+    /* Through the scheduler, the sleeping sibling is reset with the
+       warm display */
+    EPD Pair[2] = { Warm, Sibling };
+    for (size_t i = 0; i < 2; ++i) {
+	EPD_set_px(Pair[i], 4, 4);
+	EPD_swap(Pair[i]);
+	RECORD_reset(EPD_get_transport(Pair[i]));
+    }
+    if (EPD_refresh_shared(Pair, 2, NULL, NULL)
+	|| count_command(EPD_get_transport(Warm), DRIVER_OUTPUT_CONTROL) != 1
+	|| !EPD_get_poweron(Warm)) {
+	log_err("Warm display not reset with its sibling.");
+	goto out;
+    }
+    if (refresh_configures(Warm, 5) != 0
+	|| refresh_configures(Alone, 3) != 0) {
+	log_err("Warm displays configured again after a shared refresh.");
+	goto out;
+    }
+
+    rc = 0;
+ out:
+    for (size_t i = 0; i < 3; ++i)
+	if (Displays[i])
+	    EPD_destroy(Displays[i]);
+    return rc;
+}
+
+/* Each refresh is timed per phase and the traffic counted */
+static int
+test_stats(void)
+{
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	return 1;
+
+    struct Transport *Bus = EPD_get_transport(Display);
+    struct EPD_STATS Stats;
+    EPD_reset_stats(Display);
+    RECORD_reset(Bus);
+
+    EPD_set_px(Display, 1, 1);
+    EPD_set_px(Display, 2, 2);
+    EPD_swap(Display);
+    int rc = EPD_refresh(Display) || EPD_refresh(Display);
+
+    size_t n;
+    RECORD_get_entries(Bus, &n);
+    EPD_get_stats(Display, &Stats);
+    if (!rc && (Stats.pixels != 2 || Stats.full_refreshes != 1
+		|| Stats.skipped_refreshes != 1
+		|| Stats.spi_bytes != n
+		|| Stats.spi_transfers != RECORD_get_transfers(Bus)
+		|| Stats.phase[PHASE_RESET].count != 1
+		|| Stats.phase[PHASE_UPLOAD].count != 1
+		|| Stats.phase[PHASE_SLEEP].count != 1
+		|| Stats.phase[PHASE_REFRESH].count != 1
+		|| Stats.phase[PHASE_REFRESH].min_us
+		> Stats.phase[PHASE_REFRESH].max_us)) {
+	log_err("Statistics do not match the refresh.");
+	EPD_dump_stats(Display, stderr);
+	rc = 1;
+    }
+
+    FILE *sink = fopen("/dev/null", "w");
+    if (!rc && (sink == NULL || EPD_dump_stats(Display, sink)))
+	rc = 1;
+    if (sink)
+	fclose(sink);
+
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* Returns non-zero if pixel (x, y) of a buffer with stride bytes per
+   row is black */
+static int
+is_black(const uint8_t *buf, size_t stride, size_t x, size_t y)
+{
+    return !(buf[(y * stride) + (x / 8)] & (0x80 >> (x % 8)));
+}
+
+/* Lines are continuous along their major axis whatever the canvas
+   shape, and horizontal runs cover exactly their pixels */
+static int
+test_line(void)
+{
+    const size_t w = HEIGHT, h = WIDTH, stride = HEIGHT / 8;
+    EPD Display = EPD_create_backend(w, h, RECORD_BACKEND);
+    if (Display == NULL)
+	return 1;
+
+    int rc = 0;
+    PATH Route = PATH_create(w, h);
+    const uint8_t *buf = EPD_get_bmp(Display);
+
+    /* Steep on a landscape canvas, one pixel on every row */
+    PATH_append_coordinate(Route, 3, 0);
+    PATH_append_coordinate(Route, 20, h - 1);
+    rc = EPD_draw_path(Display, Route);
+    for (size_t y = 0; y < h && !rc; ++y) {
+	size_t n = 0;
+	for (size_t x = 0; x < w; ++x)
+	    n += is_black(buf, stride, x, y);
+	if (n != 1) {
+	    log_err("Row %zu of a steep line has %zu pixels.", y, n);
+	    rc = 1;
+	}
+    }
+    if (!rc && (!is_black(buf, stride, 3, 0)
+		|| !is_black(buf, stride, 20, h - 1))) {
+	log_err("Steep line misses its end points.");
+	rc = 1;
+    }
+
+    /* Shallow, one pixel in every column */
+    memset(EPD_get_bmp(Display), 0xFF, stride * h);
+    PATH_destroy(Route);
+    Route = PATH_create(w, h);
+    PATH_append_coordinate(Route, w - 1, 40);
+    PATH_append_coordinate(Route, 0, 10);
+    rc = rc || EPD_draw_path(Display, Route);
+    for (size_t x = 0; x < w && !rc; ++x) {
+	size_t n = 0;
+	for (size_t y = 0; y < h; ++y)
+	    n += is_black(buf, stride, x, y);
+	if (n != 1) {
+	    log_err("Column %zu of a shallow line has %zu pixels.", x, n);
+	    rc = 1;
+	}
+    }
+
+    /* Horizontal span toggled across byte boundaries */
+    memset(EPD_get_bmp(Display), 0xFF, stride * h);
+    EPD_set_write_mode(Display, TOGGLEMODE);
+    PATH_destroy(Route);
+    Route = PATH_create(w, h);
+    PATH_append_coordinate(Route, 29, 5);
+    PATH_append_coordinate(Route, 5, 5);
+    rc = rc || EPD_draw_path(Display, Route);
+    for (size_t x = 0; x < w && !rc; ++x)
+	if (is_black(buf, stride, x, 5) != (x >= 5 && x <= 29)) {
+	    log_err("Horizontal span wrong at x == %zu.", x);
+	    rc = 1;
+	}
+
+    PATH_destroy(Route);
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* The batch and raster paths draw exactly what EPD_set_px does in
+   every write mode, skipping points off the canvas */
+static int
+test_pixels(void)
+{
+    const size_t len = (WIDTH / 8) * HEIGHT;
+    static const enum WRITE_MODE modes[] = { TOGGLEMODE, FGMODE, BGMODE };
+    struct Coordinate Points[64];
+    int rc = 0;
+
+    for (size_t i = 0; i < 64; ++i) {
+	Points[i].x = (i * 37) % WIDTH;
+	Points[i].y = (i * 101) % HEIGHT;
+    }
+    Points[63].x = WIDTH;
+
+    EPD A = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    EPD B = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (A == NULL || B == NULL)
+	return 1;
+
+    for (size_t m = 0; m < 3 * 2 && !rc; ++m) {
+	enum FOREGROUND_COLOUR colour = (m & 1) ? WHITE : BLACK;
+	EPD_set_write_mode(A, modes[m / 2]);
+	EPD_set_write_mode(B, modes[m / 2]);
+	EPD_set_fgcolour(A, colour);
+	EPD_set_fgcolour(B, colour);
+	memset(EPD_get_bmp(A), 0x5A, len);
+	memset(EPD_get_bmp(B), 0x5A, len);
+
+	for (size_t i = 0; i < 63; ++i)
+	    EPD_set_px(A, Points[i].x, Points[i].y);
+	if (EPD_set_pixels(B, Points, 64) == 0) {
+	    log_err("Point off the canvas not reported.");
+	    rc = 1;
+	}
+	if (memcmp(EPD_get_bmp(A), EPD_get_bmp(B), len)) {
+	    log_err("Batch differs from EPD_set_px in mode %zu.", m);
+	    rc = 1;
+	}
+
+	struct EPD_RASTER Raster;
+	memset(EPD_get_bmp(B), 0x5A, len);
+	EPD_get_raster(B, &Raster);
+	for (size_t i = 0; i < 63; ++i)
+	    EPD_raster_px(&Raster, Points[i].x, Points[i].y);
+	if (memcmp(EPD_get_bmp(A), EPD_get_bmp(B), len)) {
+	    log_err("Raster differs from EPD_set_px in mode %zu.", m);
+	    rc = 1;
+	}
+    }
+
+    EPD_destroy(A);
+    EPD_destroy(B);
+    return rc;
+}
+
+/* The blitter matches a per pixel reference at every alignment,
+   with clipping on each edge, for every raster operation */
+static int
+test_blit(void)
+{
+    const size_t len = (WIDTH / 8) * HEIGHT;
+    static const long pos[][2] = { { 0, 0 }, { 3, 7 }, { -5, -2 },
+				   { 100, 290 }, { 61, 11 }, { -70, 40 } };
+    static const size_t sizes[][2] = { { 1, 1 }, { 13, 9 }, { 70, 5 },
+				       { 128, 3 }, { 150, 20 } };
+    uint8_t src[20 * 24], want[(WIDTH / 8) * HEIGHT];
+    uint32_t seed = 99;
+    int rc = 0;
+
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	return 1;
+    uint8_t *buf = EPD_get_bmp(Display);
+
+    for (size_t i = 0; i < sizeof src; ++i) {
+	seed = seed * 1103515245 + 12345;
+	src[i] = seed >> 16;
+    }
+
+    for (int rop = ROP_COPY; rop <= ROP_INVERT && !rc; ++rop)
+	for (size_t p = 0; p < 6 && !rc; ++p)
+	    for (size_t s = 0; s < 5 && !rc; ++s) {
+		size_t w = sizes[s][0], h = sizes[s][1], stride = 20;
+		long x = pos[p][0], y = pos[p][1];
+
+		for (size_t i = 0; i < len; ++i)
+		    buf[i] = want[i] = i * 7;
+
+		for (size_t j = 0; j < h; ++j)
+		    for (size_t i = 0; i < w; ++i) {
+			long dx = x + (long)i, dy = y + (long)j;
+			if (dx < 0 || dy < 0 || dx >= WIDTH || dy >= HEIGHT)
+			    continue;
+			uint8_t *d = &want[dy * (WIDTH / 8) + dx / 8];
+			uint8_t m = 0x80 >> (dx % 8);
+			int sb = !!(src[j * stride + i / 8] & (0x80 >> (i % 8)));
+			int db = !!(*d & m);
+			int r = (rop == ROP_AND) ? (db & sb)
+			    : (rop == ROP_OR) ? (db | sb)
+			    : (rop == ROP_XOR) ? (db ^ sb)
+			    : (rop == ROP_INVERT) ? !sb : sb;
+			*d = r ? (*d | m) : (*d & ~m);
+		    }
+
+		EPD_blit(Display, src, w, h, stride, x, y, rop);
+		if (memcmp(buf, want, len)) {
+		    log_err("Blit %zux%zu at (%ld,%ld) rop %d differs.",
+			    w, h, x, y, rop);
+		    rc = 1;
+		}
+	    }
+
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* Number of black pixels on the canvas */
+static size_t
+count_black(const uint8_t *buf, size_t len)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; ++i)
+	n += 8 - __builtin_popcount(buf[i]);
+
+    return n;
+}
+
+/* Filled shapes cover exactly their pixels, outlines toggle each
+   pixel once and fill rules and stipples select the expected pixels */
+static int
+test_shapes(void)
+{
+    const size_t stride = WIDTH / 8, len = stride * HEIGHT;
+    uint8_t drawn[(WIDTH / 8) * HEIGHT];
+    int rc = 1;
+
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	return 1;
+    uint8_t *buf = EPD_get_bmp(Display);
+    PATH Star = PATH_create(WIDTH, HEIGHT);
+    if (Star == NULL)
+	goto out;
+
+    /* Rectangle, clipped at the left edge */
+    memset(buf, 0xFF, len);
+    EPD_fill_rect(Display, -3, 5, 20, 4);
+    for (size_t y = 0; y < 12; ++y)
+	for (size_t x = 0; x < 24; ++x)
+	    if (is_black(buf, stride, x, y) != (x < 17 && y >= 5 && y < 9)) {
+		log_err("Filled rectangle wrong at (%zu,%zu).", x, y);
+		goto out;
+	    }
+
+    /* Circle, symmetric in both axes and the diagonal, covering the
+       pixel centres within r + 1/2 so about pi (r + 1/2)^2 */
+    memset(buf, 0xFF, len);
+    EPD_fill_circle(Display, 64, 100, 30);
+    for (long dy = -31; dy <= 31; ++dy)
+	for (long dx = -31; dx <= 31; ++dx) {
+	    int b = is_black(buf, stride, 64 + dx, 100 + dy);
+	    if (b != is_black(buf, stride, 64 - dx, 100 + dy)
+		|| b != is_black(buf, stride, 64 + dx, 100 - dy)
+		|| b != is_black(buf, stride, 64 + dy, 100 + dx)) {
+		log_err("Circle not symmetric at (%ld,%ld).", dx, dy);
+		goto out;
+	    }
+	}
+    size_t area = count_black(buf, len);
+    if (area < 2835 || area > 3010) {
+	log_err("Circle of radius 30 covers %zu pixels.", area);
+	goto out;
+    }
+
+    /* Shapes far larger than the canvas only visit its rows, and
+       radii too large to rasterise exactly are refused */
+    memset(buf, 0xFF, len);
+    EPD_fill_circle(Display, 64, 148, 27000);
+    if (count_black(buf, len) != WIDTH * HEIGHT) {
+	log_err("Large circle left %zu pixels white.",
+		WIDTH * HEIGHT - count_black(buf, len));
+	goto out;
+    }
+    memset(buf, 0xFF, len);
+    EPD_fill_circle(Display, 64, 148, 40000);
+    EPD_draw_rect(Display, -1000000000L, -1000000000L,
+		  2000000000L, 2000000000L);
+    if (count_black(buf, len) != 0) {
+	log_err("Oversized shapes drew %zu pixels.", count_black(buf, len));
+	goto out;
+    }
+    EPD_fill_rect(Display, -1000000000L, -1000000000L,
+		  2000000000L, 2000000000L);
+    if (count_black(buf, len) != WIDTH * HEIGHT) {
+	log_err("Large rectangle left %zu pixels white.",
+		WIDTH * HEIGHT - count_black(buf, len));
+	goto out;
+    }
+
+    /* Outlines toggle every pixel once, so match the foreground
+       drawing and toggle back out */
+    memset(buf, 0xFF, len);
+    EPD_draw_ellipse(Display, 60, 150, 40, 25);
+    EPD_draw_ellipse(Display, 60, 150, 7, 1);
+    EPD_draw_circle(Display, 100, 40, 0);
+    EPD_draw_rect(Display, 10, 200, 50, 30);
+    EPD_draw_rect(Display, 70, 200, 1, 5);
+    memcpy(drawn, buf, len);
+
+    memset(buf, 0xFF, len);
+    EPD_set_write_mode(Display, TOGGLEMODE);
+    EPD_draw_ellipse(Display, 60, 150, 40, 25);
+    EPD_draw_ellipse(Display, 60, 150, 7, 1);
+    EPD_draw_circle(Display, 100, 40, 0);
+    EPD_draw_rect(Display, 10, 200, 50, 30);
+    EPD_draw_rect(Display, 70, 200, 1, 5);
+    if (memcmp(buf, drawn, len)) {
+	log_err("Toggled outlines differ from drawn outlines.");
+	goto out;
+    }
+    EPD_draw_ellipse(Display, 60, 150, 40, 25);
+    EPD_draw_ellipse(Display, 60, 150, 7, 1);
+    EPD_draw_circle(Display, 100, 40, 0);
+    EPD_draw_rect(Display, 10, 200, 50, 30);
+    EPD_draw_rect(Display, 70, 200, 1, 5);
+    if (count_black(buf, len) != 0) {
+	log_err("Outlines toggled twice left %zu pixels.",
+		count_black(buf, len));
+	goto out;
+    }
+    EPD_set_write_mode(Display, FGMODE);
+
+    /* Pentagram, the centre is a hole under even-odd only */
+    static const size_t star[][2] = { { 64, 100 }, { 99, 207 },
+				      { 7, 141 }, { 121, 141 },
+				      { 29, 207 } };
+    for (enum FILL_RULE rule = EVEN_ODD_FILL; rule <= NON_ZERO_FILL; ++rule) {
+	PATH_clear_coordinates(Star);
+	for (size_t i = 0; i < 5; ++i)
+	    PATH_append_coordinate(Star, star[i][0], star[i][1]);
+
+	memset(buf, 0xFF, len);
+	if (EPD_fill_polygon(Display, Star, rule)) {
+	    log_err("Failed to fill polygon.");
+	    goto out;
+	}
+	if (!is_black(buf, stride, 64, 110)
+	    || !is_black(buf, stride, 20, 143)
+	    || is_black(buf, stride, 64, 200)
+	    || is_black(buf, stride, 64, 99)
+	    || is_black(buf, stride, 64, 160) != (rule == NON_ZERO_FILL)) {
+	    log_err("Star filled wrongly with rule %d.", rule);
+	    goto out;
+	}
+    }
+
+    /* A 50% stipple fills half of the pixels */
+    uint8_t grey[8];
+    EPD_grey_stipple(grey, 32);
+    EPD_set_stipple(Display, grey);
+    memset(buf, 0xFF, len);
+    EPD_fill_rect(Display, 3, 3, 64, 64);
+    EPD_set_stipple(Display, NULL);
+    if (count_black(buf, len) != 64 * 32) {
+	log_err("Grey stipple drew %zu of %d pixels.",
+		count_black(buf, len), 64 * 64);
+	goto out;
+    }
+
+    rc = 0;
+ out:
+    PATH_destroy(Star);
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* Glyphs are drawn exactly at any alignment and clipping, through a
+   cache that survives eviction, from well and badly formed UTF-8 */
+static int
+test_text(void)
+{
+    const size_t stride = WIDTH / 8, len = stride * HEIGHT;
+    static const long pos[][2] = { { 0, 0 }, { 3, 5 }, { -4, -3 },
+				   { 120, 290 }, { 56, 100 } };
+    static const uint32_t codepoints[] = { 'A', 'g', 0x4E00, 0x10FFFF };
+    int rc = 1;
+
+    FONT Font = FONT_load("font/unifont-12.0.01.hex");
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Font == NULL || Display == NULL)
+	goto out;
+    uint8_t *buf = EPD_get_bmp(Display);
+    EPD_set_font(Display, Font);
+
+    if (FONT_get_count(Font) < 57000) {
+	log_err("Only %zu glyphs loaded.", FONT_get_count(Font));
+	goto out;
+    }
+
+    /* More distinct glyphs than the cache holds */
+    char text[3 * 256 + 1], *t = text;
+    for (uint32_t c = 0x4E00; c < 0x4F00; ++c) {
+	*t++ = 0xE0 | (c >> 12);
+	*t++ = 0x80 | ((c >> 6) & 0x3F);
+	*t++ = 0x80 | (c & 0x3F);
+    }
+    *t = '\0';
+    EPD_draw_text(Display, 0, 0, text);
+
+    for (size_t c = 0; c < sizeof codepoints / sizeof *codepoints; ++c) {
+	struct FontGlyph Glyph;
+	if (FONT_get_glyph(Font, codepoints[c], &Glyph)) {
+	    log_err("No glyph for U+%04X.", codepoints[c]);
+	    goto out;
+	}
+	uint8_t bitmap[32];
+	memcpy(bitmap, Glyph.bitmap, Glyph.stride * Glyph.height);
+
+	char utf8[5] = { 0 };
+	const char *u = utf8;
+	if (codepoints[c] < 0x80) {
+	    utf8[0] = codepoints[c];
+	} else if (codepoints[c] < 0x10000) {
+	    utf8[0] = 0xE0 | (codepoints[c] >> 12);
+	    utf8[1] = 0x80 | ((codepoints[c] >> 6) & 0x3F);
+	    utf8[2] = 0x80 | (codepoints[c] & 0x3F);
+	} else {
+	    utf8[0] = 0xF0 | (codepoints[c] >> 18);
+	    utf8[1] = 0x80 | ((codepoints[c] >> 12) & 0x3F);
+	    utf8[2] = 0x80 | ((codepoints[c] >> 6) & 0x3F);
+	    utf8[3] = 0x80 | (codepoints[c] & 0x3F);
+	}
+	if (FONT_utf8_next(&u) != codepoints[c] || *u) {
+	    log_err("Failed to decode U+%04X.", codepoints[c]);
+	    goto out;
+	}
+
+	for (size_t p = 0; p < sizeof pos / sizeof *pos; ++p) {
+	    long x = pos[p][0], y = pos[p][1];
+
+	    memset(buf, 0xFF, len);
+	    EPD_draw_text(Display, x, y, utf8);
+	    for (long j = 0; j < HEIGHT; ++j)
+		for (long i = 0; i < WIDTH; ++i) {
+		    long gx = i - x, gy = j - y;
+		    int ink = gx >= 0 && gy >= 0 && gx < (long)Glyph.width
+			&& gy < (long)Glyph.height
+			&& (bitmap[gy * Glyph.stride + gx / 8] & (0x80 >> (gx % 8)));
+		    if (is_black(buf, stride, i, j) != !!ink) {
+			log_err("U+%04X at (%ld,%ld) wrong at (%ld,%ld).",
+				codepoints[c], x, y, i, j);
+			goto out;
+		    }
+		}
+	}
+    }
+
+    /* Toggled text toggles back out */
+    memset(buf, 0xFF, len);
+    EPD_set_write_mode(Display, TOGGLEMODE);
+    EPD_draw_text(Display, 3, 7, "Hello,\nworld \xE2\x82\xAC");
+    if (count_black(buf, len) == 0) {
+	log_err("Toggled text drew nothing.");
+	goto out;
+    }
+    EPD_draw_text(Display, 3, 7, "Hello,\nworld \xE2\x82\xAC");
+    if (count_black(buf, len) != 0) {
+	log_err("Text toggled twice left %zu pixels.", count_black(buf, len));
+	goto out;
+    }
+
+    /* Malformed sequences are replaced a byte at a time */
+    static const uint32_t want[] = { 0xE9, FONT_REPLACEMENT, '(',
+				     FONT_REPLACEMENT, FONT_REPLACEMENT,
+				     FONT_REPLACEMENT, FONT_REPLACEMENT,
+				     FONT_REPLACEMENT, FONT_REPLACEMENT };
+    const char *u = "\xC3\xA9\xC3(\xC0\x80\xED\xA0\x80\xFF";
+    for (size_t i = 0; i < sizeof want / sizeof *want; ++i)
+	if (FONT_utf8_next(&u) != want[i]) {
+	    log_err("UTF-8 character %zu decoded wrongly.", i);
+	    goto out;
+	}
+    if (*u) {
+	log_err("UTF-8 not consumed.");
+	goto out;
+    }
+
+    rc = 0;
+ out:
+    EPD_destroy(Display);
+    FONT_destroy(Font);
+    return rc;
+}
+
+/* A compiled pack holds the glyphs of its source, and a subset only
+   those asked for */
+static int
+test_font_pack(void)
+{
+    static const uint32_t codepoints[] = { ' ', 'A', '~', 0xE9, 0x20AC,
+					   0x4E00, 0x9FA5, 0xFFFD };
+    static const struct FontRange Latin[] = { { 0x20, 0x7E },
+					       { 0xA0, 0xFF } };
+    char path[] = "/tmp/wsepd_fontXXXXXX";
+    FONT Hex = NULL, Pack = NULL;
+    int rc = 1;
+
+    int fd = mkstemp(path);
+    if (fd < 0)
+	return 1;
+    close(fd);
+
+    Hex = FONT_load("font/unifont-12.0.01.hex");
+    if (NULL == Hex || FONT_write_pack(Hex, path, NULL, 0)
+	|| NULL == (Pack = FONT_load(path)))
+	goto out;
+
+    if (FONT_get_count(Pack) != FONT_get_count(Hex)) {
+	log_err("Pack has %zu of %zu glyphs.", FONT_get_count(Pack),
+		FONT_get_count(Hex));
+	goto out;
+    }
+
+    for (int subset = 0; subset < 2; ++subset) {
+	for (size_t i = 0; i < sizeof codepoints / sizeof *codepoints; ++i) {
+	    struct FontGlyph G, P;
+	    uint8_t want[32];
+
+	    if (FONT_get_glyph(Hex, codepoints[i], &G)
+		|| FONT_get_glyph(Pack, codepoints[i], &P)) {
+		log_err("No glyph for U+%04X.", codepoints[i]);
+		goto out;
+	    }
+	    memcpy(want, G.bitmap, G.stride * G.height);
+
+	    int kept = !subset || codepoints[i] == FONT_REPLACEMENT
+		|| codepoints[i] <= 0xFF;
+	    if (P.codepoint != (kept ? codepoints[i] : FONT_REPLACEMENT)) {
+		log_err("U+%04X found as U+%04X.", codepoints[i], P.codepoint);
+		goto out;
+	    }
+	    if (kept && (P.width != G.width || P.height != G.height
+			 || memcmp(P.bitmap, want, G.stride * G.height))) {
+		log_err("U+%04X differs in the pack.", codepoints[i]);
+		goto out;
+	    }
+	}
+
+	FONT_destroy(Pack);
+	Pack = NULL;
+	if (subset)
+	    break;
+	if (FONT_write_pack(Hex, path, Latin, 2)
+	    || NULL == (Pack = FONT_load(path)))
+	    goto out;
+	if (FONT_get_count(Pack) != 95 + 96 + 1) {
+	    log_err("Subset pack has %zu glyphs.", FONT_get_count(Pack));
+	    goto out;
+	}
+    }
+
+    /* An entry numbering a glyph beyond the pack is measured as the
+       replacement it is drawn with. The tables follow the 40 byte
+       header, the first found through the block 0 entry. */
+    uint8_t buf[4];
+    FILE *fp = fopen(path, "r+b");
+    uint32_t off_tables, table, entry = (0xFFFF << 1) | 1;
+    int bad = (NULL == fp || fseek(fp, 24, SEEK_SET)
+	       || fread(buf, 4, 1, fp) != 1);
+    off_tables = buf[0] | (buf[1] << 8) | (buf[2] << 16)
+	| ((uint32_t)buf[3] << 24);
+    bad = bad || fseek(fp, 40, SEEK_SET) || fread(buf, 2, 1, fp) != 1;
+    table = buf[0] | (buf[1] << 8);
+    for (size_t i = 0; i < 4; ++i)
+	buf[i] = entry >> (8 * i);
+    bad = bad || 0 == table
+	|| fseek(fp, off_tables + (table - 1) * 1024 + 4 * 'A', SEEK_SET)
+	|| fwrite(buf, 4, 1, fp) != 1;
+    if (fp)
+	bad = fclose(fp) || bad;
+    if (bad || NULL == (Pack = FONT_load(path)))
+	goto out;
+
+    struct FontGlyph P;
+    if (FONT_get_glyph(Pack, 'A', &P) || P.codepoint != FONT_REPLACEMENT
+	|| FONT_get_advance(Pack, 'A') != P.width) {
+	log_err("Corrupt pack entry measured as %zu, drawn as U+%04X.",
+		FONT_get_advance(Pack, 'A'), P.codepoint);
+	goto out;
+    }
+
+    rc = 0;
+ out:
+    FONT_destroy(Pack);
+    FONT_destroy(Hex);
+    unlink(path);
+    return rc;
+}
+
+/* The text of the layout's line at row y, non-ASCII shown as '*' */
+static void
+layout_line(LAYOUT Text, long y, char *out)
+{
+    size_t n;
+    const struct LayoutGlyph *Glyphs = LAYOUT_get_glyphs(Text, &n);
+
+    for (size_t i = 0; i < n; ++i)
+	if (Glyphs[i].y == y)
+	    *out++ = (Glyphs[i].codepoint < 0x80) ? Glyphs[i].codepoint : '*';
+    *out = '\0';
+}
+
+/* Wrapping, truncation and alignment place glyphs as expected, an
+   unchanged layout is not laid out again and drawing one matches
+   drawing its text */
+static int
+test_layout(void)
+{
+    const size_t len = (WIDTH / 8) * HEIGHT;
+    uint8_t want[(WIDTH / 8) * HEIGHT];
+    struct LayoutRect Bounds;
+    char line[64];
+    int rc = 1;
+
+    FONT Font = FONT_load("font/unifont-12.0.01.hex");
+    LAYOUT Text = LAYOUT_create(Font);
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Font == NULL || Text == NULL || Display == NULL)
+	goto out;
+    uint8_t *buf = EPD_get_bmp(Display);
+
+    /* Word wrap, a word wider than the box is broken */
+    struct LayoutBox Box = { .x = 4, .y = 10, .width = 64,
+			     .flags = LAYOUT_WRAP, .line_gap = 2 };
+    static const char *wrapped[] = { "hello", "world,", "this is",
+				     "abcdefgh", "ijkl" };
+    LAYOUT_set_text(Text, &Box, "hello world, this is abcdefghijkl");
+    if (LAYOUT_get_lines(Text) != 5) {
+	log_err("Wrapped to %zu lines.", LAYOUT_get_lines(Text));
+	goto out;
+    }
+    for (size_t l = 0; l < 5; ++l) {
+	layout_line(Text, 10 + 18 * l, line);
+	if (strcmp(line, wrapped[l])) {
+	    log_err("Line %zu is '%s' not '%s'.", l, line, wrapped[l]);
+	    goto out;
+	}
+    }
+    LAYOUT_get_bounds(Text, &Bounds);
+    if (Bounds.x != 4 || Bounds.y != 10 || Bounds.width != 64
+	|| Bounds.height != 4 * 18 + 16) {
+	log_err("Wrapped bounds %ldx%ld %zux%zu.", Bounds.x, Bounds.y,
+		Bounds.width, Bounds.height);
+	goto out;
+    }
+
+    /* Unchanged text is not laid out again */
+    unsigned long shapes = LAYOUT_get_shapes(Text);
+    LAYOUT_set_text(Text, &Box, "hello world, this is abcdefghijkl");
+    if (LAYOUT_get_shapes(Text) != shapes) {
+	log_err("Unchanged text laid out again.");
+	goto out;
+    }
+
+    /* Alignment within the box */
+    static const long offsets[] = { 0, 12, 24 };
+    for (enum LAYOUT_ALIGN a = ALIGN_LEFT; a <= ALIGN_RIGHT; ++a) {
+	size_t n;
+	Box.align = a;
+	LAYOUT_set_text(Text, &Box, "hello");
+	const struct LayoutGlyph *Glyphs = LAYOUT_get_glyphs(Text, &n);
+	LAYOUT_get_bounds(Text, &Bounds);
+	if (n != 5 || Glyphs[0].x != 4 + offsets[a]
+	    || Bounds.x != 4 + offsets[a] || Bounds.width != 40) {
+	    log_err("Alignment %d placed text at %ld.", a, Glyphs[0].x);
+	    goto out;
+	}
+    }
+    if (LAYOUT_get_shapes(Text) != shapes + 3) {
+	log_err("Changed boxes not laid out again.");
+	goto out;
+    }
+
+    /* Truncation, too wide and too many lines */
+    Box = (struct LayoutBox){ .width = 64, .flags = LAYOUT_ELLIPSIS };
+    LAYOUT_set_text(Text, &Box, "abcdefghijkl");
+    layout_line(Text, 0, line);
+    if (strcmp(line, "abcdefg*")) {
+	log_err("Truncated to '%s'.", line);
+	goto out;
+    }
+    Box = (struct LayoutBox){ .width = 64, .height = 40, .line_gap = 4,
+			      .flags = LAYOUT_WRAP | LAYOUT_ELLIPSIS };
+    LAYOUT_set_text(Text, &Box, "one two three four five");
+    layout_line(Text, 20, line);
+    if (LAYOUT_get_lines(Text) != 2 || strcmp(line, "three*")) {
+	log_err("Cut to %zu lines ending '%s'.", LAYOUT_get_lines(Text), line);
+	goto out;
+    }
+
+    /* Drawn as the text itself */
+    Box = (struct LayoutBox){ .x = 3, .y = 7 };
+    LAYOUT_set_text(Text, &Box, "Hello,\nworld \xE2\x82\xAC");
+    EPD_set_font(Display, Font);
+    memset(buf, 0xFF, len);
+    EPD_draw_text(Display, 3, 7, "Hello,\nworld \xE2\x82\xAC");
+    memcpy(want, buf, len);
+    memset(buf, 0xFF, len);
+    EPD_draw_layout(Display, Text);
+    if (memcmp(buf, want, len)) {
+	log_err("Layout drawn differently from its text.");
+	goto out;
+    }
+
+    rc = 0;
+ out:
+    EPD_destroy(Display);
+    LAYOUT_destroy(Text);
+    FONT_destroy(Font);
+    return rc;
+}
+
+/* The emulated controller shows what the library meant to display,
+   through full, partial and shared bus refreshes, and sleeps and wakes
+   as commanded */
+static int
+test_emulate(void)
+{
+    const size_t len = (WIDTH / 8) * HEIGHT;
+    EPD Panels[2] = { NULL, NULL };
+    int rc = 1;
+
+    for (size_t i = 0; i < 2; ++i) {
+	Panels[i] = EPD_create_backend(WIDTH, HEIGHT, EMULATE_BACKEND);
+	if (Panels[i] == NULL)
+	    goto out;
+    }
+
+    EPD Display = Panels[0];
+    struct Transport *Bus = EPD_get_transport(Display);
+    struct EmulateState State;
+    EPD_set_idle_sleep(Display, 60000);
+    EPD_set_refresh_mode(Display, PARTIAL_REFRESH);
+
+    EPD_set_px(Display, 0, 0);
+    EPD_set_px(Display, WIDTH - 1, HEIGHT - 1);
+    EPD_swap(Display);
+    rc = EPD_refresh(Display);
+    EMULATE_get_state(Bus, &State);
+    if (!rc && memcmp(EMULATE_get_image(Bus), EPD_get_front(Display), len)) {
+	log_err("Emulated panel differs after a full refresh.");
+	rc = 1;
+    }
+    unsigned long activations = State.activations;
+    uint64_t full_us = State.last_busy_us;
+
+    EPD_set_px(Display, 0, 0);
+    EPD_set_px(Display, WIDTH - 1, HEIGHT - 1);
+    EPD_set_px(Display, 20, 30);
+    EPD_swap(Display);
+    rc = rc || EPD_refresh_area(Display, 16, 24, 16, 16);
+    EMULATE_get_state(Bus, &State);
+    if (!rc && (memcmp(EMULATE_get_image(Bus), EPD_get_front(Display), len)
+		|| State.activations != activations + 1 || State.errors != 0
+		|| State.last_busy_us >= full_us)) {
+	log_err("Emulated panel differs after a partial refresh.");
+	rc = 1;
+    }
+
+    EPD_sleep(Display);
+    EMULATE_get_state(Bus, &State);
+    if (!rc && !State.asleep) {
+	log_err("Emulated panel not asleep.");
+	rc = 1;
+    }
+
+    /* Woken by the shared bus scheduler */
+    for (size_t i = 0; i < 2; ++i) {
+	EPD_set_px(Panels[i], 5 + i, 9);
+	EPD_swap(Panels[i]);
+    }
+    rc = rc || EPD_refresh_shared(Panels, 2, NULL, NULL);
+    for (size_t i = 0; i < 2 && !rc; ++i) {
+	Bus = EPD_get_transport(Panels[i]);
+	EMULATE_get_state(Bus, &State);
+	if (memcmp(EMULATE_get_image(Bus), EPD_get_front(Panels[i]), len)
+	    || State.errors != 0 || State.ignored != 0) {
+	    log_err("Emulated panel %zu differs after a shared refresh.", i);
+	    rc = 1;
+	}
+    }
+
+ out:
+    for (size_t i = 0; i < 2; ++i)
+	if (Panels[i])
+	    EPD_destroy(Panels[i]);
+    return rc;
+}
+
+/* Replace the file at path with the len bytes at data */
+static int
+write_file(const char *path, const void *data, size_t len)
+{
+    FILE *fp = fopen(path, "wb");
+    if (NULL == fp)
+	return 1;
+    int rc = (fwrite(data, 1, len, fp) != len);
+    return fclose(fp) || rc;
+}
+
+/* Non-zero unless the rows of the image at path read back as the w
+   by h levels want */
+static int
+check_image_rows(const char *path, size_t w, size_t h, const uint8_t *want)
+{
+    uint8_t row[8];
+    int rc = 1;
+
+    IMAGE Img = IMAGE_open(path);
+    if (NULL == Img || IMAGE_set_size(Img, w, h))
+	goto out;
+    for (size_t y = 0; y < h; ++y) {
+	if (IMAGE_read_row(Img, row))
+	    goto out;
+	if (memcmp(row, want + (y * w), w)) {
+	    log_err("Image row %zu: got %u %u, expected %u %u.", y,
+		    row[0], row[w - 1], want[y * w], want[(y * w) + w - 1]);
+	    goto out;
+	}
+    }
+    rc = 0;
+ out:
+    IMAGE_close(Img);
+    return rc;
+}
+
+/* White pixels of the canvas in the w x h rectangle at (x, y) */
+static size_t
+count_white(EPD Display, size_t x, size_t y, size_t w, size_t h)
+{
+    const uint8_t *bmp = EPD_get_bmp(Display);
+    size_t n = 0;
+
+    for (size_t j = y; j < y + h; ++j)
+	for (size_t i = x; i < x + w; ++i)
+	    n += !!(bmp[(j * (WIDTH / 8)) + (i / 8)] & (0x80 >> (i % 8)));
+    return n;
+}
+
+/* Netpbm images are read in every variant, box filtered to exact
+   averages and dithered into the canvas */
+static int
+test_image(void)
+{
+    char path[] = "/tmp/wsepd_imageXXXXXX";
+    EPD Display = NULL;
+    int rc = 1;
+
+    int fd = mkstemp(path);
+    if (fd < 0)
+	return 1;
+    close(fd);
+
+    /* Reduced by 3:2 each output pixel covers one and a half */
+    static const uint8_t p5[] = "P5\n# comment\n3 1\n255\n\x00\x5A\xFF";
+    static const uint8_t p5_want[] = { 30, 200 };
+    if (write_file(path, p5, sizeof p5 - 1)
+	|| check_image_rows(path, 2, 1, p5_want))
+	goto out;
+
+    /* Enlarged, every pixel is repeated */
+    static const char p2[] = "P2 2 1 15 0 15\n";
+    static const uint8_t p2_want[] = { 0, 0, 255, 255, 0, 0, 255, 255 };
+    if (write_file(path, p2, strlen(p2))
+	|| check_image_rows(path, 4, 2, p2_want))
+	goto out;
+
+    /* Colour is luminance, two byte samples are scaled by maxval */
+    static const uint8_t p6[] = "P6 2 1 65535\n\xFF\xFF\0\0\0\0"
+	"\xFF\xFF\xFF\xFF\xFF\xFF";
+    static const uint8_t p6_want[] = { 77, 255 };
+    if (write_file(path, p6, sizeof p6 - 1)
+	|| check_image_rows(path, 2, 1, p6_want))
+	goto out;
+
+    Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	goto out;
+    EPD_set_write_mode(Display, FGMODE);
+    EPD_set_fgcolour(Display, BLACK);
+
+    /* Raw and plain bitmaps land unaligned, set bits black */
+    static const uint8_t p4[] = "P4 10 2\n\xC0\x40\x01\x80";
+    static const char p1[] = "P1 10 2\n1100000001\n0000000110\n";
+    const char *bitmaps[] = { (const char *)p4, p1 };
+    const size_t lens[] = { sizeof p4 - 1, sizeof p1 - 1 };
+    for (size_t b = 0; b < 2; ++b) {
+	EPD_fill_rect(Display, 0, 0, WIDTH, HEIGHT);
+	if (write_file(path, bitmaps[b], lens[b])
+	    || EPD_draw_image(Display, path, 5, 7, 0, 0, DITHER_THRESHOLD))
+	    goto out;
+	if (count_white(Display, 5, 7, 10, 2) != 15
+	    || count_white(Display, 5, 7, 2, 1) != 0
+	    || count_white(Display, 14, 7, 1, 1) != 0
+	    || count_white(Display, 12, 8, 2, 1) != 0
+	    || count_white(Display, 0, 0, WIDTH, HEIGHT) != 15) {
+	    log_err("Bitmap P%c drawn wrongly.", bitmaps[b][1]);
+	    goto out;
+	}
+    }
+
+    /* Mid grey is white by threshold and half white by dithering,
+       dark grey is black by threshold */
+    static const struct {
+	uint8_t level;
+	enum EPD_DITHER dither;
+	size_t min, max;
+    } greys[] = { { 0x80, DITHER_THRESHOLD, 4096, 4096 },
+		  { 0x7F, DITHER_THRESHOLD, 0, 0 },
+		  { 0x80, DITHER_ORDERED, 2048, 2048 },
+		  { 0x80, DITHER_DIFFUSION, 1984, 2112 },
+		  { 0x40, DITHER_DIFFUSION, 960, 1088 } };
+    uint8_t pgm[32 + (128 * 128)];
+    for (size_t g = 0; g < sizeof greys / sizeof *greys; ++g) {
+	int len = sprintf((char *)pgm, "P5 128 128 255\n");
+	memset(pgm + len, greys[g].level, 128 * 128);
+	EPD_fill_rect(Display, 0, 0, WIDTH, HEIGHT);
+	if (write_file(path, pgm, len + (128 * 128))
+	    || EPD_draw_image(Display, path, 32, 40, 64, 64, greys[g].dither))
+	    goto out;
+	size_t n = count_white(Display, 32, 40, 64, 64);
+	if (n < greys[g].min || n > greys[g].max
+	    || count_white(Display, 0, 0, WIDTH, HEIGHT) != n) {
+	    log_err("Grey 0x%02X dithered %zu white of 4096.",
+		    greys[g].level, n);
+	    goto out;
+	}
+    }
+
+    /* Clipped at every edge */
+    if (EPD_draw_image(Display, path, -20, -20, WIDTH + 40, HEIGHT + 40,
+		       DITHER_DIFFUSION))
+	goto out;
+
+    /* Malformed and truncated files are refused */
+    static const char bad[] = "P5 4 4 255\n\x10\x10";
+    if (write_file(path, bad, sizeof bad - 1)
+	|| !EPD_draw_image(Display, path, 0, 0, 0, 0, DITHER_THRESHOLD)
+	|| write_file(path, "P7 1 1\n", 7) || NULL != IMAGE_open(path)
+	|| write_file(path, "P2 0 1 255\n", 11) || NULL != IMAGE_open(path))
+	goto out;
+
+    rc = 0;
+ out:
+    if (Display)
+	EPD_destroy(Display);
+    unlink(path);
+    return rc;
+}
+
+/* Non-zero if the panel image shows the canvas frame turned clockwise
+   by rotation and reflected by flags, checked pixel by pixel */
+static int
+check_orientation(const uint8_t *image, const uint8_t *frame,
+		  enum EPD_ROTATION rotation, int flags)
+{
+    const size_t turn = (rotation == ROTATE_90 || rotation == ROTATE_270);
+    const size_t cw = turn ? HEIGHT : WIDTH, ch = turn ? WIDTH : HEIGHT;
+
+    for (size_t y = 0; y < ch; ++y) {
+	for (size_t x = 0; x < cw; ++x) {
+	    size_t qx = (flags & EPD_MIRROR_X) ? cw - 1 - x : x;
+	    size_t qy = (flags & EPD_MIRROR_Y) ? ch - 1 - y : y;
+	    size_t px = qx, py = qy;
+
+	    if (rotation == ROTATE_90) {
+		px = WIDTH - 1 - qy;
+		py = qx;
+	    } else if (rotation == ROTATE_180) {
+		px = WIDTH - 1 - qx;
+		py = HEIGHT - 1 - qy;
+	    } else if (rotation == ROTATE_270) {
+		px = qy;
+		py = HEIGHT - 1 - qx;
+	    }
+
+	    int want = !!(frame[(y * (cw / 8)) + (x / 8)] & (0x80 >> (x % 8)));
+	    int got = !!(image[(py * (WIDTH / 8)) + (px / 8)] & (0x80 >> (px % 8)));
+	    if ((flags & EPD_INVERT) ? want == got : want != got) {
+		log_err("Canvas pixel (%zu, %zu) is wrong at %d degrees, "
+			"flags 0x%x.", x, y, 90 * (int)rotation, flags);
+		return 1;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+/* A turned and reflected canvas reaches the emulated panel as the
+   geometry says, through full and partial refreshes */
+static int
+test_orientation(void)
+{
+    static const int flags[] = { 0, EPD_MIRROR_X, EPD_MIRROR_Y,
+				 EPD_MIRROR_X | EPD_MIRROR_Y | EPD_INVERT };
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, EMULATE_BACKEND);
+    if (Display == NULL)
+	return 1;
+
+    struct Transport *Bus = EPD_get_transport(Display);
+    EPD_set_idle_sleep(Display, 60000);
+    int rc = 0;
+
+    for (int r = ROTATE_0; r <= ROTATE_270 && !rc; ++r) {
+	for (size_t f = 0; f < sizeof flags / sizeof *flags && !rc; ++f) {
+	    rc = EPD_set_orientation(Display, r, flags[f]);
+	    size_t w = EPD_get_width(Display), h = EPD_get_height(Display);
+	    if (!rc && (w != ((r % 2) ? HEIGHT : WIDTH)
+			|| h != ((r % 2) ? WIDTH : HEIGHT)
+			|| EPD_get_physical_width(Display) != WIDTH)) {
+		log_err("Canvas is %zux%zu at %d degrees.", w, h, 90 * r);
+		rc = 1;
+	    }
+
+	    /* Asymmetric marks and a scatter of pixels */
+	    EPD_set_refresh_mode(Display, FULL_REFRESH);
+	    EPD_clear(Display);
+	    EPD_fill_rect(Display, 0, 0, 24, 8);
+	    EPD_fill_rect(Display, 0, 0, 4, 40);
+	    for (size_t i = 0; i < 200; ++i)
+		EPD_set_px(Display, (i * 37 + f) % w, (i * i * 11 + r) % h);
+	    EPD_swap(Display);
+	    rc = rc || EPD_refresh(Display)
+		|| check_orientation(EMULATE_get_image(Bus),
+				     EPD_get_front(Display), r, flags[f]);
+
+	    /* A partial refresh lands the canvas area on the panel */
+	    EPD_set_refresh_mode(Display, PARTIAL_REFRESH);
+	    memcpy(EPD_get_bmp(Display), EPD_get_front(Display), w * h / 8);
+	    EPD_fill_rect(Display, w - 30, 9, 21, 13);
+	    EPD_swap(Display);
+	    rc = rc || EPD_refresh_area(Display, w - 32, 8, 24, 16)
+		|| check_orientation(EMULATE_get_image(Bus),
+				     EPD_get_front(Display), r, flags[f]);
+	}
+    }
+
+    /* Back to the panel's own orientation */
+    rc = rc || EPD_set_orientation(Display, ROTATE_0, 0)
+	|| EPD_get_width(Display) != WIDTH || EPD_get_height(Display) != HEIGHT;
+
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* RAM writes step through a 3x3 byte window in every data entry
+   mode, each starting from the window's first corner in the
+   directions of the mode, and decrementing counters wrap within RAM */
+static int
+test_entry_modes(void)
+{
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, EMULATE_BACKEND);
+    if (Display == NULL)
+	return 1;
+
+    struct Transport *Bus = EPD_get_transport(Display);
+    struct EmulateState State;
+    const size_t stride = WIDTH / 8;
+    int rc = 0;
+
+    /* Keep the controller awake for the scripts below */
+    EPD_set_idle_sleep(Display, 60000);
+    EPD_set_px(Display, 0, 0);
+    EPD_swap(Display);
+    rc = EPD_refresh(Display);
+
+    for (uint8_t mode = 0; mode < 8 && !rc; ++mode) {
+	const int dx = (mode & 0x01) ? 1 : -1, dy = (mode & 0x02) ? 1 : -1;
+	const uint8_t x0 = (dx > 0) ? 2 : 4, x1 = (dx > 0) ? 4 : 2;
+	const uint8_t y0 = (dy > 0) ? 10 : 12, y1 = (dy > 0) ? 12 : 10;
+	const uint8_t script[] =
+	    { DATA_ENTRY_MODE_SETTING, 1, mode,
+	      SET_RAM_X_ADDRESS_START_END_POSITION, 2, x0, x1,
+	      SET_RAM_Y_ADDRESS_START_END_POSITION, 4, y0, 0, y1, 0,
+	      SET_RAM_X_ADDRESS_COUNTER, 1, x0,
+	      SET_RAM_Y_ADDRESS_COUNTER, 2, y0, 0,
+	      WRITE_RAM, 9, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+
+	rc = run_script(Bus, script, sizeof script)
+	    || load_display_from_ram(Bus, NULL);
+	const uint8_t *image = EMULATE_get_image(Bus);
+	for (size_t k = 0; k < 9 && !rc; ++k) {
+	    /* Bit 2 of the mode steps y first */
+	    size_t i = (mode & 0x04) ? k / 3 : k % 3;
+	    size_t j = (mode & 0x04) ? k % 3 : k / 3;
+	    size_t x = x0 + (dx * (long)i), y = y0 + (dy * (long)j);
+	    if (image[(y * stride) + x] != k + 1) {
+		log_err("Entry mode 0x%02X: byte %zu not at (%zu, %zu).",
+			mode, k, x, y);
+		rc = 1;
+	    }
+	}
+    }
+
+    /* Decrementing from address 0 wraps to the last RAM column */
+    const uint8_t wrap[] =
+	{ DATA_ENTRY_MODE_SETTING, 1, 0x00,
+	  SET_RAM_X_ADDRESS_START_END_POSITION, 2, 15, 5,
+	  SET_RAM_Y_ADDRESS_START_END_POSITION, 4, 20, 0, 0, 0,
+	  SET_RAM_X_ADDRESS_COUNTER, 1, 0,
+	  SET_RAM_Y_ADDRESS_COUNTER, 2, 20, 0,
+	  WRITE_RAM, 4, 0xA1, 0xA2, 0xA3, 0xA4 };
+    rc = rc || run_script(Bus, wrap, sizeof wrap)
+	|| load_display_from_ram(Bus, NULL);
+    EMULATE_get_state(Bus, &State);
+    if (!rc && (EMULATE_get_image(Bus)[20 * stride] != 0xA1
+		|| State.errors != 0)) {
+	log_err("Decrementing RAM write did not wrap.");
+	rc = 1;
+    }
+
+    EPD_destroy(Display);
+    return rc;
+}
+
+/* A traced refresh replayed through another transport reproduces the
+   captured traffic byte for byte */
+static int
+test_trace(void)
+{
+    char path[] = "/tmp/wsepd_traceXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+	return 1;
+    close(fd);
+
+    if (EPD_trace_start(1 << 14)) {
+	unlink(path);
+	return 1;
+    }
+
+    int rc = 1;
+    struct Transport *Replay = NULL;
+    EPD Display = EPD_create_backend(WIDTH, HEIGHT, RECORD_BACKEND);
+    if (Display == NULL)
+	goto out;
+
+    struct Transport *Bus = EPD_get_transport(Display);
+    EPD_set_px(Display, 7, 7);
+    EPD_swap(Display);
+    rc = EPD_refresh(Display) || EPD_trace_dump(path);
+    EPD_trace_stop();
+
+    Replay = TRANSPORT_create(RECORD_BACKEND, 0, 0, NULL);
+    rc = rc || Replay == NULL || TRACE_replay(Replay, path, Bus->id, 0);
+
+    size_t n, m;
+    const struct RecordEntry *Want = RECORD_get_entries(Bus, &n);
+    const struct RecordEntry *Got = rc ? NULL : RECORD_get_entries(Replay, &m);
+    if (!rc && (n != m || memcmp(Want, Got, n * sizeof *Want)
+		|| RECORD_get_delay_ms(Replay) < 3 * RST_DELAY_MS)) {
+	log_err("Replay differs from the captured traffic.");
+	rc = 1;
+    }
+
+ out:
+    EPD_trace_stop();
+    if (Replay)
+	TRANSPORT_destroy(Replay);
+    if (Display)
+	EPD_destroy(Display);
+    unlink(path);
+    return rc;
+}
+
+int
+main(int argc, char *argv[])
+{
+    log_debug("Testing %s (argc == %d).", argv[0], argc);
+
+    int failures = 0;
+
+    if (test_full_frame()) {
+	log_err("Full frame upload test failed.");
+	++failures;
+    }
+    if (test_window()) {
+	log_err("Windowed upload test failed.");
+	++failures;
+    }
+
+    if (test_async()) {
+	log_err("Asynchronous refresh test failed.");
+	++failures;
+    }
+
+    if (test_warm()) {
+	log_err("Warm controller test failed.");
+	++failures;
+    }
+
+    if (test_partial()) {
+	log_err("Partial refresh test failed.");
+	++failures;
+    }
+
+    if (test_swap()) {
+	log_err("Buffer swap test failed.");
+	++failures;
+    }
+
+    if (test_wall()) {
+	log_err("Multi-panel wall test failed.");
+	++failures;
+    }
+
+    if (test_shared()) {
+	log_err("Shared bus scheduler test failed.");
+	++failures;
+    }
+
+    if (test_shared_reset()) {
+	log_err("Shared reset line test failed.");
+	++failures;
+    }
+
+    if (test_stats()) {
+	log_err("Statistics test failed.");
+	++failures;
+    }
+
+    if (test_diff()) {
+	log_err("Shadow buffer diff test failed.");
+	++failures;
+    }
+
+    if (test_line()) {
+	log_err("Line rasteriser test failed.");
+	++failures;
+    }
+
+    if (test_pixels()) {
+	log_err("Batch pixel test failed.");
+	++failures;
+    }
+
+    if (test_blit()) {
+	log_err("Blitter test failed.");
+	++failures;
+    }
+
+    if (test_shapes()) {
+	log_err("Shape test failed.");
+	++failures;
+    }
+
+    if (test_text()) {
+	log_err("Text test failed.");
+	++failures;
+    }
+
+    if (test_font_pack()) {
+	log_err("Font pack test failed.");
+	++failures;
+    }
+
+    if (test_layout()) {
+	log_err("Text layout test failed.");
+	++failures;
+    }
+
+    if (test_emulate()) {
+	log_err("Emulated controller test failed.");
+	++failures;
+    }
+
+    if (test_entry_modes()) {
+	log_err("Data entry mode test failed.");
+	++failures;
+    }
+
+    if (test_trace()) {
+	log_err("SPI trace replay test failed.");
+	++failures;
+    }
+
+    if (test_orientation()) {
+	log_err("Orientation test failed.");
+	++failures;
+    }
+
+    if (test_image()) {
+	log_err("Image import test failed.");
+	++failures;
+    }
+
+    if (failures == 0)
+	log_info("All recorded stream tests passed.");
+
+    return failures ? 1 : 0;
+}
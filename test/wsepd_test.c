@@ -19,13 +19,15 @@
  * 
  * Description:
  *
- * Functions that test the interface of libwsepd.a
+ * Functions that test the interface of libwsepd.a, on the attached
+ * panel or with -e on the emulated controller.
  * 
  */
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ert_log.h>
 
 #include "libwsepd.h"
@@ -39,7 +41,10 @@ main(int argc, char *argv[])
 {
     log_debug("Testing %s (argc == %d).", argv[0], argc);
 
-    EPD Display = EPD_create(WIDTH, HEIGHT);
+    int emulate = (argc > 1 && !strcmp(argv[1], "-e"));
+    EPD Display = emulate
+	? EPD_create_backend(WIDTH, HEIGHT, EMULATE_BACKEND)
+	: EPD_create(WIDTH, HEIGHT);
     if (Display == NULL) {
     	log_debug("Failed to create object");
     	return 1;
@@ -86,6 +91,7 @@ main(int argc, char *argv[])
     PATH_append_coordinate(Route, 10, 20);
     EPD_draw_path(Display, Route);
 
+    EPD_swap(Display);
     EPD_refresh(Display);
     PATH_destroy(Route);
     EPD_destroy(Display);
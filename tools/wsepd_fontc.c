@@ -0,0 +1,127 @@
+/* wsepd_fontc.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Description:
+ *
+ * Compiles a GNU Unifont .hex file to a font pack, which FONT_load
+ * maps instead of parsing. Subsetting keeps only the codepoint ranges
+ * listed (hexadecimal, comma separated), for example the Basic Latin
+ * and Latin-1 blocks with -b 0000-00FF.
+ *
+ *   wsepd_fontc [-b first-last,...] font.hex pack
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ert_log.h>
+
+#include "libwsepd.h"
+
+#define FONTC_MAX_RANGES 64
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+	    "Usage: %s [-b first-last,...] font.hex pack\n"
+	    "  -b  keep only these codepoint ranges (hexadecimal)\n",
+	    name);
+}
+
+/* Parse comma separated ranges into Subset, returns the number parsed
+   or 0 if the list is malformed */
+static size_t
+parse_ranges(const char *list, struct FontRange *Subset, size_t max)
+{
+    size_t n = 0;
+    char *end;
+
+    while (*list) {
+	if (n == max)
+	    return 0;
+
+	Subset[n].first = strtoul(list, &end, 16);
+	if (end == list)
+	    return 0;
+	Subset[n].last = Subset[n].first;
+	if (*end == '-') {
+	    list = end + 1;
+	    Subset[n].last = strtoul(list, &end, 16);
+	    if (end == list || Subset[n].last < Subset[n].first)
+		return 0;
+	}
+	++n;
+
+	if (*end == ',')
+	    ++end;
+	else if (*end)
+	    return 0;
+	list = end;
+    }
+
+    return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct FontRange Subset[FONTC_MAX_RANGES];
+    size_t n = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+	switch (opt) {
+	case 'b':
+	    n = parse_ranges(optarg, Subset, FONTC_MAX_RANGES);
+	    if (0 == n) {
+		fprintf(stderr, "Invalid ranges '%s'.\n", optarg);
+		return 1;
+	    }
+	    break;
+	default:
+	    usage(argv[0]);
+	    return 1;
+	}
+    }
+    if (optind != argc - 2) {
+	usage(argv[0]);
+	return 1;
+    }
+
+    FONT Font = FONT_load(argv[optind]);
+    if (NULL == Font)
+	return 1;
+
+    int rc = FONT_write_pack(Font, argv[optind + 1], n ? Subset : NULL, n);
+    FONT_destroy(Font);
+    if (rc)
+	return rc;
+
+    /* Check the pack loads */
+    FONT Pack = FONT_load(argv[optind + 1]);
+    if (NULL == Pack)
+	return 1;
+    printf("%s: %zu glyphs\n", argv[optind + 1], FONT_get_count(Pack));
+    FONT_destroy(Pack);
+
+    return 0;
+}
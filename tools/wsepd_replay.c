@@ -0,0 +1,126 @@
+/* wsepd_replay.c
+ *
+ * This file is part of libwsepd.
+ *
+ * Copyright (C) 2019 Ellis Rhys Thomas
+ *
+ * libwsepd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwsepd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libwsepd.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ * Description:
+ *
+ * Replays an SPI trace written by EPD_trace_dump through any
+ * transport, to reproduce a captured problem on a bench panel or to
+ * compare transports on identical traffic.
+ *
+ *   wsepd_replay [-b wiringpi|native|record|emulate] [-c channel] [-s hz]
+ *                [-i bus | -a] [-t] trace
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ert_log.h>
+
+#include "libwsepd.h"
+#include "wsepd_transport.h"
+#include "wsepd_trace.h"
+#include "wsepd_clock.h"
+#include "waveshare2.9.h"
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+	    "Usage: %s [-b wiringpi|native|record|emulate] [-c channel] [-s hz]\n"
+	    "          [-i bus | -a] [-t] trace\n"
+	    "  -b  transport backend (default native)\n"
+	    "  -c  SPI channel (default %d)\n"
+	    "  -s  SPI clock in Hz (default %d)\n"
+	    "  -i  replay the traffic of one bus id (default 0)\n"
+	    "  -a  replay the traffic of every bus\n"
+	    "  -t  keep the captured gaps between transfers\n",
+	    name, PI_CHANNEL, SPI_CLK_HZ);
+}
+
+int
+main(int argc, char *argv[])
+{
+    enum EPD_BACKEND backend = NATIVE_BACKEND;
+    int channel = PI_CHANNEL, flags = 0, opt;
+    uint32_t speed_hz = SPI_CLK_HZ;
+    uint16_t bus = 0;
+
+    while ((opt = getopt(argc, argv, "b:c:s:i:at")) != -1) {
+	switch (opt) {
+	case 'b':
+	    if (!strcmp(optarg, "wiringpi"))
+		backend = WIRINGPI_BACKEND;
+	    else if (!strcmp(optarg, "native"))
+		backend = NATIVE_BACKEND;
+	    else if (!strcmp(optarg, "record"))
+		backend = RECORD_BACKEND;
+	    else if (!strcmp(optarg, "emulate"))
+		backend = EMULATE_BACKEND;
+	    else {
+		usage(argv[0]);
+		return 1;
+	    }
+	    break;
+	case 'c': channel = atoi(optarg);
+	    break;
+	case 's': speed_hz = strtoul(optarg, NULL, 0);
+	    break;
+	case 'i': bus = atoi(optarg);
+	    break;
+	case 'a': flags |= TRACE_ANY_BUS;
+	    break;
+	case 't': flags |= TRACE_TIMED;
+	    break;
+	default:
+	    usage(argv[0]);
+	    return 1;
+	}
+    }
+    if (optind != argc - 1) {
+	usage(argv[0]);
+	return 1;
+    }
+
+    struct Transport *Bus = TRANSPORT_create(backend, channel, speed_hz, NULL);
+    if (NULL == Bus)
+	return 1;
+
+    int rc = 1;
+    if (bus_pin_mode(Bus, Bus->pins.rst, GPIO_OUTPUT)
+	|| bus_pin_mode(Bus, Bus->pins.dc, GPIO_OUTPUT)
+	|| bus_pin_mode(Bus, Bus->pins.cs, GPIO_OUTPUT)
+	|| bus_pin_mode(Bus, Bus->pins.busy, GPIO_INPUT)) {
+	log_err("Failed to set GPIO pin modes.");
+	goto out;
+    }
+
+    uint64_t start = clock_now_us();
+    rc = TRACE_replay(Bus, argv[optind], bus, flags);
+    uint64_t elapsed = clock_now_us() - start;
+
+    printf("%s: %llu bytes in %llu transfers, %llu us\n", Bus->ops->name,
+	   (unsigned long long)Bus->bytes, (unsigned long long)Bus->transfers,
+	   (unsigned long long)elapsed);
+ out:
+    TRANSPORT_destroy(Bus);
+    return rc;
+}